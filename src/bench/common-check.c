@@ -0,0 +1,475 @@
+/*
+ * Copyright (c) 2016 XTAO Technology <www.xtaotech.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * checks of the common data structures, run by make check.
+ *
+ * obj: random inserts and removals in the object table against a
+ * shadow copy, through the grows and the relocations.
+ * wsdeque: the owner pushes and pops while the thieves steal, every
+ * item is taken once.
+ * hist: the bucket boundaries, up to 2^XT_HIST_MAX_SHIFT and beyond.
+ * wmark: the journal entries released out of order, the watermark
+ * only passes the entries all released.
+ */
+
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "mem.h"
+#include "logging.h"
+#include "xlist.h"
+#include "obj-table.h"
+#include "wsdeque.h"
+#include "stats.h"
+#include "filesystem.h"
+
+#define CHECK(cond) do {						\
+	if (!(cond)) {							\
+		fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__,	\
+		    __LINE__, #cond);					\
+		exit(1);						\
+	}								\
+} while (0)
+
+static uint64_t check_seed = 88172645463325252ULL;
+
+static uint64_t check_rand(void)
+{
+	check_seed ^= check_seed << 13;
+	check_seed ^= check_seed >> 7;
+	check_seed ^= check_seed << 17;
+	return check_seed;
+}
+
+/*
+ * object table
+ */
+#define OBJ_CHECK_INODES	20000
+#define OBJ_CHECK_OPS		400000
+
+typedef struct obj_waiter {
+	struct xlist_head list;
+	ino_t ino;
+} obj_waiter_t;
+
+static void obj_check_one(obj_table_t *tbl, ino_t ino, int present,
+    obj_waiter_t *w)
+{
+	op_obj_t *obj = obj_tbl_get(tbl, ino);
+
+	if (!present) {
+		CHECK(obj == NULL);
+		return;
+	}
+
+	CHECK(obj != NULL);
+	CHECK(obj->obj == ino);
+	CHECK(obj->ref == (unsigned int)ino * 7);
+	/*
+	 * the pending list follows the object when it is relocated
+	 */
+	CHECK(obj->pending.next == &w->list);
+	CHECK(w->list.next == &obj->pending);
+	CHECK(w->list.prev == &obj->pending);
+}
+
+static void obj_check(void)
+{
+	obj_table_t *tbl = NULL;
+	obj_waiter_t *waiters = NULL;
+	char *present = NULL;
+	op_obj_t *obj = NULL;
+	unsigned int min_mask = 0;
+	unsigned int max_mask = 0;
+	unsigned long live = 0;
+	unsigned long i = 0;
+	ino_t ino = 0;
+
+	tbl = obj_tbl_new(16);
+	present = XT_CALLOC(OBJ_CHECK_INODES + 1, 1);
+	waiters = XT_CALLOC(OBJ_CHECK_INODES + 1, sizeof (obj_waiter_t));
+	CHECK(tbl && present && waiters);
+	min_mask = tbl->mask;
+
+	for (i = 0; i < OBJ_CHECK_OPS; i++) {
+		/*
+		 * grow to all the inodes, then churn at a few live ones
+		 */
+		if (i < OBJ_CHECK_OPS / 4)
+			ino = 1 + check_rand() % OBJ_CHECK_INODES;
+		else
+			ino = 1 + check_rand() % 64;
+
+		if (!present[ino]) {
+			CHECK(obj_tbl_maint(tbl, 1) == 0);
+			CHECK(obj_tbl_get(tbl, ino) == NULL);
+			obj = obj_tbl_insert(tbl, ino);
+			obj->ref = (unsigned int)ino * 7;
+			waiters[ino].ino = ino;
+			xlist_add_tail(&waiters[ino].list, &obj->pending);
+			present[ino] = 1;
+			live++;
+		} else if (i >= OBJ_CHECK_OPS / 4 || check_rand() % 4 == 0) {
+			obj = obj_tbl_get(tbl, ino);
+			CHECK(obj != NULL);
+			xlist_del_init(&waiters[ino].list);
+			obj_tbl_remove(tbl, obj);
+			present[ino] = 0;
+			live--;
+		}
+
+		CHECK(tbl->used + tbl->old_used == live);
+		obj_check_one(tbl, ino, present[ino], &waiters[ino]);
+		if (tbl->mask > max_mask)
+			max_mask = tbl->mask;
+
+		if (i % 4096 == 0) {
+			for (ino = 1; ino <= OBJ_CHECK_INODES; ino++)
+				obj_check_one(tbl, ino, present[ino],
+				    &waiters[ino]);
+		}
+	}
+
+	/*
+	 * grown with the inodes, and the old table drained
+	 */
+	CHECK(max_mask > min_mask);
+	CHECK(obj_tbl_maint(tbl, 0) == 0);
+	for (i = 0; i < OBJ_CHECK_OPS && tbl->old; i++)
+		obj_tbl_maint(tbl, 0);
+	CHECK(tbl->old == NULL);
+
+	for (ino = 1; ino <= OBJ_CHECK_INODES; ino++) {
+		obj_check_one(tbl, ino, present[ino], &waiters[ino]);
+		if (!present[ino])
+			continue;
+		xlist_del_init(&waiters[ino].list);
+		obj_tbl_remove(tbl, obj_tbl_get(tbl, ino));
+	}
+	CHECK(tbl->used == 0);
+
+	obj_tbl_destroy(tbl);
+	XT_FREE(waiters);
+	XT_FREE(present);
+	printf("obj table: ok, %u to %u slots\n", min_mask + 1,
+	    max_mask + 1);
+}
+
+/*
+ * work stealing deque
+ */
+#define WSQ_CHECK_ITEMS		2000000
+#define WSQ_CHECK_THIEVES	3
+
+typedef struct wsq_check {
+	wsdeque_t q;
+	unsigned char *taken;
+	unsigned long count;
+} wsq_check_t;
+
+static void wsq_take(wsq_check_t *c, void *item)
+{
+	unsigned long i = (unsigned long)item - 1;
+
+	CHECK(i < WSQ_CHECK_ITEMS);
+	CHECK(__atomic_add_fetch(&c->taken[i], 1, __ATOMIC_RELAXED) == 1);
+	__atomic_add_fetch(&c->count, 1, __ATOMIC_RELEASE);
+}
+
+static void *wsq_thief(void *arg)
+{
+	wsq_check_t *c = arg;
+	void *item = NULL;
+
+	while (__atomic_load_n(&c->count, __ATOMIC_ACQUIRE) <
+	    WSQ_CHECK_ITEMS) {
+		item = wsdeque_steal(&c->q);
+		if (item)
+			wsq_take(c, item);
+	}
+
+	return NULL;
+}
+
+static void wsq_check(void)
+{
+	pthread_t tids[WSQ_CHECK_THIEVES];
+	wsq_check_t c;
+	void *item = NULL;
+	unsigned long i = 0;
+
+	memset(&c, 0, sizeof (c));
+	CHECK(wsdeque_init(&c.q, 256) == 0);
+	c.taken = XT_CALLOC(WSQ_CHECK_ITEMS, 1);
+	CHECK(c.taken != NULL);
+
+	for (i = 0; i < WSQ_CHECK_THIEVES; i++)
+		CHECK(pthread_create(&tids[i], NULL, wsq_thief, &c) == 0);
+
+	/*
+	 * pushes in bursts and pops some, the last items of the deque
+	 * race the pops against the steals
+	 */
+	for (i = 1; i <= WSQ_CHECK_ITEMS; i++) {
+		if (wsdeque_push(&c.q, (void *)i)) {
+			wsq_take(&c, (void *)i);
+			continue;
+		}
+		if (check_rand() % 3 == 0) {
+			item = wsdeque_pop(&c.q);
+			if (item)
+				wsq_take(&c, item);
+		}
+	}
+	while ((item = wsdeque_pop(&c.q)) != NULL)
+		wsq_take(&c, item);
+
+	for (i = 0; i < WSQ_CHECK_THIEVES; i++)
+		pthread_join(tids[i], NULL);
+
+	CHECK(c.count == WSQ_CHECK_ITEMS);
+	CHECK(wsdeque_pop(&c.q) == NULL);
+	CHECK(wsdeque_steal(&c.q) == NULL);
+
+	wsdeque_destroy(&c.q);
+	XT_FREE(c.taken);
+	printf("wsdeque: ok\n");
+}
+
+/*
+ * histogram
+ */
+static void hist_check_value(uint64_t v)
+{
+	unsigned int b = xt_hist_bucket(v);
+
+	CHECK(b < XT_HIST_BUCKETS);
+	if (v >= (1ULL << XT_HIST_MAX_SHIFT)) {
+		CHECK(b == XT_HIST_BUCKETS - 1);
+		return;
+	}
+
+	CHECK(xt_hist_bucket_low(b) <= v);
+	if (b < XT_HIST_BUCKETS - 1)
+		CHECK(v < xt_hist_bucket_low(b + 1));
+}
+
+static void hist_check(void)
+{
+	uint64_t top = 1ULL << XT_HIST_MAX_SHIFT;
+	xt_hist_t *h = NULL;
+	unsigned int b = 0;
+	unsigned int s = 0;
+
+	for (s = 0; s < 64; s++) {
+		hist_check_value(1ULL << s);
+		hist_check_value((1ULL << s) - 1);
+		hist_check_value((1ULL << s) + 1);
+	}
+	hist_check_value(UINT64_MAX);
+	for (b = 0; b < XT_HIST_BUCKETS; b++) {
+		hist_check_value(xt_hist_bucket_low(b));
+		CHECK(xt_hist_bucket(xt_hist_bucket_low(b)) == b);
+	}
+
+	/*
+	 * the last bucket holds the top sub range and all above
+	 */
+	CHECK(xt_hist_bucket(top - 1) == XT_HIST_BUCKETS - 1);
+	CHECK(xt_hist_bucket(top) == XT_HIST_BUCKETS - 1);
+	CHECK(xt_hist_bucket_low(XT_HIST_BUCKETS - 1) ==
+	    top - (top >> (XT_HIST_SUB_BITS + 1)));
+	CHECK(xt_hist_bucket_low(XT_HIST_BUCKETS) ==
+	    xt_hist_bucket_low(XT_HIST_BUCKETS - 1));
+
+	/*
+	 * the percentiles in the last bucket are the exact max
+	 */
+	h = XT_CALLOC(1, sizeof (xt_hist_t));
+	CHECK(h != NULL);
+	CHECK(xt_hist_percentile(h, 50) == 0);
+	xt_hist_record(h, 1000);
+	xt_hist_record(h, top * 4);
+	CHECK(xt_hist_percentile(h, 0) >= 1000);
+	CHECK(xt_hist_percentile(h, 0) < xt_hist_bucket_low(
+	    xt_hist_bucket(1000) + 1));
+	CHECK(xt_hist_percentile(h, 100) == top * 4);
+	XT_FREE(h);
+
+	printf("hist: ok, %d buckets\n", XT_HIST_BUCKETS);
+}
+
+/*
+ * journal release watermark, on a stub filesystem
+ */
+#define WMARK_CHECK_ENTRIES	5000
+
+typedef struct wmark_check {
+	uint64_t seq;
+	unsigned char released[WMARK_CHECK_ENTRIES + 1];
+	unsigned long freed;
+	unsigned long trims;
+	uint64_t trimmed;
+} wmark_check_t;
+
+static wmark_check_t wmc;
+
+static int wmark_hold(void *hdl, journal_entry_t **entry)
+{
+	journal_entry_t *e = XT_CALLOC(1, sizeof (journal_entry_t));
+
+	if (e == NULL)
+		return ENOMEM;
+	e->seq = ++wmc.seq;
+	*entry = e;
+	return 0;
+}
+
+static int wmark_release(void *hdl, journal_entry_t *entry)
+{
+	XT_FREE(entry);
+	return 0;
+}
+
+static void wmark_free(void *hdl, journal_entry_t *entry)
+{
+	__atomic_add_fetch(&wmc.freed, 1, __ATOMIC_RELAXED);
+	XT_FREE(entry);
+}
+
+static int wmark_trim(void *hdl, uint64_t seq)
+{
+	uint64_t i = 0;
+
+	/*
+	 * never trim an entry not released yet
+	 */
+	CHECK(seq > wmc.trimmed);
+	for (i = 1; i <= seq; i++)
+		CHECK(__atomic_load_n(&wmc.released[i], __ATOMIC_ACQUIRE));
+	wmc.trimmed = seq;
+	wmc.trims++;
+	return 0;
+}
+
+static struct filesystem_ops wmark_ops = {
+	.fs_hold_jentry = wmark_hold,
+	.fs_release_jentry = wmark_release,
+	.fs_free_jentry = wmark_free,
+	.fs_trim_journal = wmark_trim,
+};
+
+/*
+ * hold all the entries and release them in a random order
+ */
+static void wmark_check_run(int range)
+{
+	journal_entry_t **entries = NULL;
+	unsigned long long committed = 0;
+	unsigned long long cleared = 0;
+	filesystem_t fs;
+	uint64_t expect = 0;
+	unsigned long i = 0;
+	unsigned long j = 0;
+	journal_entry_t *e = NULL;
+
+	memset(&fs, 0, sizeof (fs));
+	memset(&wmc, 0, sizeof (wmc));
+	fs.name = "check";
+	fs.fs_ops = &wmark_ops;
+	fs.release_range = range;
+	fs.release_batch = 64;
+	fs.release_interval = 1;
+	fs.committed_record = &committed;
+	fs.cleared_record = &cleared;
+
+	entries = XT_CALLOC(WMARK_CHECK_ENTRIES, sizeof (journal_entry_t *));
+	CHECK(entries != NULL);
+	CHECK(filesystem_release_start(&fs) == 0);
+	CHECK(fs.wmark->trim == range);
+
+	/*
+	 * more entries than the initial slots, the ring grows
+	 */
+	for (i = 0; i < WMARK_CHECK_ENTRIES; i++)
+		CHECK(filesystem_hold_jentry(&fs, &entries[i]) == 0);
+
+	for (i = WMARK_CHECK_ENTRIES - 1; i > 0; i--) {
+		j = check_rand() % (i + 1);
+		e = entries[i];
+		entries[i] = entries[j];
+		entries[j] = e;
+	}
+
+	for (i = 0; i < WMARK_CHECK_ENTRIES; i++) {
+		__atomic_store_n(&wmc.released[entries[i]->seq], 1,
+		    __ATOMIC_RELEASE);
+		filesystem_release_jentry(&fs, entries[i]);
+
+		while (expect < WMARK_CHECK_ENTRIES && wmc.released[expect + 1])
+			expect++;
+		CHECK(__atomic_load_n(&committed, __ATOMIC_RELAXED) ==
+		    expect);
+		if (!range)
+			CHECK(cleared == expect);
+	}
+
+	filesystem_release_stop(&fs);
+	CHECK(committed == WMARK_CHECK_ENTRIES);
+	CHECK(cleared == WMARK_CHECK_ENTRIES);
+	if (range) {
+		CHECK(wmc.freed == WMARK_CHECK_ENTRIES);
+		CHECK(wmc.trimmed == WMARK_CHECK_ENTRIES);
+	} else {
+		CHECK(wmc.freed == 0 && wmc.trims == 0);
+	}
+
+	XT_FREE(entries);
+	printf("wmark %s: ok, %lu trims\n", range ? "by range" : "per entry",
+	    wmc.trims);
+}
+
+static void wmark_check(void)
+{
+	wmark_check_run(0);
+	wmark_check_run(1);
+}
+
+int main(int argc, char **argv)
+{
+	xt_log_init("/dev/null");
+
+	obj_check();
+	wsq_check();
+	hist_check();
+	wmark_check();
+
+	return 0;
+}
@@ -0,0 +1,229 @@
+/*
+ * Copyright (c) 2016 XTAO Technology <www.xtaotech.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * contended get/put throughput of a mem_pool with and without the
+ * per thread magazines.
+ *
+ * local: every thread gets and puts its own objects.
+ * handoff: one thread gets the objects and the others put them, as the
+ * reader and the workers of the pipeline do with the ops.
+ * -a runs both with the cache aligned and huge page backed layout.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include "mem.h"
+#include "logging.h"
+#include "stats.h"
+
+#define BENCH_DEPTH	8
+#define BENCH_RING	1024
+#define BENCH_OBJ_SIZE	256
+
+/*
+ * handoff ring from the getter to a putter
+ */
+typedef struct bench_ring {
+	void *objs[BENCH_RING];
+	unsigned long head;
+	unsigned long tail;
+	struct bench *b;
+} bench_ring_t;
+
+typedef struct bench {
+	struct mem_pool *pool;
+	unsigned long loops;
+	int threads;
+	bench_ring_t *rings;
+	int done;
+} bench_t;
+
+static void *bench_local(void *arg)
+{
+	bench_t *b = (bench_t *)arg;
+	void *objs[BENCH_DEPTH];
+	unsigned long i = 0;
+	int j = 0;
+
+	for (i = 0; i < b->loops; i++) {
+		for (j = 0; j < BENCH_DEPTH; j++)
+			objs[j] = mem_get(b->pool);
+		for (j = 0; j < BENCH_DEPTH; j++)
+			mem_put(b->pool, objs[j]);
+	}
+
+	return NULL;
+}
+
+static void *bench_putter(void *arg)
+{
+	bench_ring_t *r = (bench_ring_t *)arg;
+	unsigned long tail = 0;
+
+	for (;;) {
+		tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+		if (r->head == tail) {
+			if (__atomic_load_n(&r->b->done, __ATOMIC_ACQUIRE) &&
+			    r->head == __atomic_load_n(&r->tail,
+			    __ATOMIC_ACQUIRE))
+				return NULL;
+			sched_yield();
+			continue;
+		}
+
+		while (r->head != tail) {
+			mem_put(r->b->pool, r->objs[r->head % BENCH_RING]);
+			__atomic_store_n(&r->head, r->head + 1,
+			    __ATOMIC_RELEASE);
+		}
+	}
+}
+
+static void bench_getter(bench_t *b)
+{
+	unsigned long total = b->loops * BENCH_DEPTH * (b->threads - 1);
+	bench_ring_t *r = NULL;
+	unsigned long i = 0;
+
+	for (i = 0; i < total; i++) {
+		r = &b->rings[i % (b->threads - 1)];
+		while (r->tail - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) ==
+		    BENCH_RING)
+			sched_yield();
+		r->objs[r->tail % BENCH_RING] = mem_get(b->pool);
+		__atomic_store_n(&r->tail, r->tail + 1, __ATOMIC_RELEASE);
+	}
+
+	__atomic_store_n(&b->done, 1, __ATOMIC_RELEASE);
+}
+
+static double bench_run(int handoff, int threads, unsigned long loops,
+    int flags)
+{
+	pthread_t *tids = NULL;
+	bench_t *b = NULL;
+	uint64_t start = 0;
+	double secs = 0;
+	int i = 0;
+
+	b = XT_CALLOC(1, sizeof(bench_t));
+	tids = XT_CALLOC(threads, sizeof(pthread_t));
+	if (b)
+		b->rings = XT_CALLOC(threads, sizeof(bench_ring_t));
+	if (b == NULL || b->rings == NULL || tids == NULL) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+
+	b->pool = mem_pool_new_flags(BENCH_OBJ_SIZE,
+	    threads * (BENCH_DEPTH + BENCH_RING + MEM_MAG_SIZE), flags);
+	b->loops = loops;
+	b->threads = threads;
+	for (i = 0; i < threads; i++)
+		b->rings[i].b = b;
+
+	start = xt_now_ns();
+	if (handoff) {
+		for (i = 1; i < threads; i++)
+			pthread_create(&tids[i], NULL, bench_putter,
+			    &b->rings[i - 1]);
+		bench_getter(b);
+		for (i = 1; i < threads; i++)
+			pthread_join(tids[i], NULL);
+	} else {
+		for (i = 0; i < threads; i++)
+			pthread_create(&tids[i], NULL, bench_local, b);
+		for (i = 0; i < threads; i++)
+			pthread_join(tids[i], NULL);
+	}
+	secs = (xt_now_ns() - start) / 1e9;
+
+	mem_pool_destroy(b->pool);
+	XT_FREE(b->rings);
+	XT_FREE(tids);
+	XT_FREE(b);
+
+	/*
+	 * get/put pairs per second
+	 */
+	return (handoff ? threads - 1 : threads) * loops * BENCH_DEPTH / secs;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-a] [-t threads] [-n loops]\n", prog);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long loops = 200000;
+	int threads = 4;
+	double before = 0;
+	double after = 0;
+	int handoff = 0;
+	int layout = 0;
+	int opt = 0;
+
+	while ((opt = getopt(argc, argv, "at:n:")) != -1) {
+		switch (opt) {
+		case 'a':
+			layout = MEM_POOL_CACHE_ALIGNED | MEM_POOL_HUGEPAGE;
+			break;
+		case 't':
+			threads = atoi(optarg);
+			break;
+		case 'n':
+			loops = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (threads < 2 || loops == 0)
+		usage(argv[0]);
+
+	xt_log_init("/dev/null");
+
+	printf("%-8s %8s %16s %16s %8s\n", "mode", "threads", "no magazine/s",
+	    "magazine/s", "speedup");
+	for (handoff = 0; handoff <= 1; handoff++) {
+		before = bench_run(handoff, threads, loops,
+		    layout | MEM_POOL_NO_MAGAZINE);
+		after = bench_run(handoff, threads, loops, layout);
+		printf("%-8s %8d %16.0f %16.0f %7.2fx\n",
+		    handoff ? "handoff" : "local", threads, before, after,
+		    after / before);
+	}
+
+	return 0;
+}
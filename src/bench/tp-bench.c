@@ -0,0 +1,292 @@
+/*
+ * Copyright (c) 2016 XTAO Technology <www.xtaotech.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * throughput of the work stealing thread pool against a single mutex
+ * queue shared by all the workers.
+ *
+ * inject: the main thread enqueues all the tasks, they are taken from
+ * the injection queue and stolen.
+ * tree: every task enqueues two children down to the depth, the tasks
+ * are enqueued by the workers, as the parallel scanner does with the
+ * directories.
+ * -w sets the spin loops of every task.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include "mem.h"
+#include "logging.h"
+#include "stats.h"
+#include "thread-pool.h"
+
+/*
+ * the single mutex queue pool
+ */
+typedef struct mq_pool {
+	struct xlist_head queue;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	pthread_t *tids;
+	int threads;
+	int exit_asked;
+} mq_pool_t;
+
+typedef struct bench {
+	int (*enqueue)(struct bench *b, tp_t *tp);
+	tp_ctrl_t *ctrl;
+	mq_pool_t *mq;
+	struct bench_task *tasks;
+	unsigned long ntasks;
+	unsigned long next;
+	unsigned long done;
+	int depth;
+	int work;
+} bench_t;
+
+typedef struct bench_task {
+	tp_t tp;
+	bench_t *b;
+	int depth;
+} bench_task_t;
+
+static void *mq_worker(void *arg)
+{
+	mq_pool_t *mq = (mq_pool_t *)arg;
+	tp_t *tp = NULL;
+
+	for (;;) {
+		pthread_mutex_lock(&mq->mutex);
+		while (xlist_empty(&mq->queue) && !mq->exit_asked)
+			pthread_cond_wait(&mq->cond, &mq->mutex);
+		if (mq->exit_asked) {
+			pthread_mutex_unlock(&mq->mutex);
+			return NULL;
+		}
+		tp = xlist_entry(mq->queue.next, tp_t, list);
+		xlist_del_init(&tp->list);
+		pthread_mutex_unlock(&mq->mutex);
+
+		tp->handler(tp);
+	}
+}
+
+static int mq_enqueue(bench_t *b, tp_t *tp)
+{
+	mq_pool_t *mq = b->mq;
+
+	pthread_mutex_lock(&mq->mutex);
+	xlist_add_tail(&tp->list, &mq->queue);
+	pthread_cond_signal(&mq->cond);
+	pthread_mutex_unlock(&mq->mutex);
+	return 0;
+}
+
+static int ws_enqueue(bench_t *b, tp_t *tp)
+{
+	return tp_enqueue(b->ctrl, tp);
+}
+
+static void bench_spin(int work)
+{
+	volatile unsigned long x = 0;
+	int i = 0;
+
+	for (i = 0; i < work; i++)
+		x += i;
+}
+
+static int bench_handler(tp_t *tp)
+{
+	bench_task_t *t = (bench_task_t *)tp;
+	bench_t *b = t->b;
+	bench_task_t *c = NULL;
+	int i = 0;
+
+	bench_spin(b->work);
+
+	for (i = 0; i < 2 && t->depth < b->depth; i++) {
+		c = &b->tasks[__atomic_fetch_add(&b->next, 1,
+		    __ATOMIC_RELAXED)];
+		c->b = b;
+		c->depth = t->depth + 1;
+		c->tp.handler = bench_handler;
+		b->enqueue(b, &c->tp);
+	}
+
+	__atomic_add_fetch(&b->done, 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+static double bench_run(int ws, int tree, int threads, unsigned long ntasks,
+    int work)
+{
+	bench_t *b = NULL;
+	bench_task_t *t = NULL;
+	uint64_t start = 0;
+	double secs = 0;
+	unsigned long i = 0;
+	int depth = 0;
+
+	/*
+	 * the tree is complete, it has 2^(depth+1) - 1 tasks
+	 */
+	if (tree) {
+		while ((2UL << (depth + 1)) - 1 <= ntasks)
+			depth++;
+		ntasks = (2UL << depth) - 1;
+	}
+
+	b = XT_CALLOC(1, sizeof(bench_t));
+	if (b)
+		b->tasks = XT_CALLOC(ntasks, sizeof(bench_task_t));
+	if (b == NULL || b->tasks == NULL) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+	b->ntasks = ntasks;
+	b->depth = tree ? depth : 0;
+	b->work = work;
+
+	if (ws) {
+		b->enqueue = ws_enqueue;
+		b->ctrl = tp_ctrl_new("tp-bench", 1024 * 1024, 10, threads,
+		    threads);
+		if (b->ctrl == NULL || tp_threads_start(b->ctrl)) {
+			fprintf(stderr, "failed to start the pool\n");
+			exit(1);
+		}
+	} else {
+		b->enqueue = mq_enqueue;
+		b->mq = XT_CALLOC(1, sizeof(mq_pool_t));
+		if (b->mq == NULL) {
+			fprintf(stderr, "out of memory\n");
+			exit(1);
+		}
+		INIT_XLIST_HEAD(&b->mq->queue);
+		pthread_mutex_init(&b->mq->mutex, NULL);
+		pthread_cond_init(&b->mq->cond, NULL);
+		b->mq->threads = threads;
+		b->mq->tids = XT_CALLOC(threads, sizeof(pthread_t));
+		for (i = 0; i < threads; i++)
+			pthread_create(&b->mq->tids[i], NULL, mq_worker, b->mq);
+	}
+
+	start = xt_now_ns();
+	if (tree) {
+		t = &b->tasks[b->next++];
+		t->b = b;
+		t->tp.handler = bench_handler;
+		b->enqueue(b, &t->tp);
+	} else {
+		for (i = 0; i < ntasks; i++) {
+			t = &b->tasks[b->next++];
+			t->b = b;
+			t->tp.handler = bench_handler;
+			b->enqueue(b, &t->tp);
+		}
+	}
+	while (__atomic_load_n(&b->done, __ATOMIC_ACQUIRE) < ntasks)
+		usleep(100);
+	secs = (xt_now_ns() - start) / 1e9;
+
+	if (ws) {
+		tp_threads_finish(b->ctrl);
+		tp_ctrl_free(b->ctrl);
+	} else {
+		pthread_mutex_lock(&b->mq->mutex);
+		b->mq->exit_asked = 1;
+		pthread_cond_broadcast(&b->mq->cond);
+		pthread_mutex_unlock(&b->mq->mutex);
+		for (i = 0; i < threads; i++)
+			pthread_join(b->mq->tids[i], NULL);
+		XT_FREE(b->mq->tids);
+		XT_FREE(b->mq);
+	}
+
+	XT_FREE(b->tasks);
+	XT_FREE(b);
+
+	/*
+	 * tasks per second
+	 */
+	return ntasks / secs;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-t threads] [-n tasks] [-w work]\n",
+	    prog);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long ntasks = 1000000;
+	int threads = 4;
+	int work = 100;
+	double before = 0;
+	double after = 0;
+	int tree = 0;
+	int opt = 0;
+
+	while ((opt = getopt(argc, argv, "t:n:w:")) != -1) {
+		switch (opt) {
+		case 't':
+			threads = atoi(optarg);
+			break;
+		case 'n':
+			ntasks = strtoul(optarg, NULL, 0);
+			break;
+		case 'w':
+			work = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (threads < 1 || ntasks == 0 || work < 0)
+		usage(argv[0]);
+
+	xt_log_init("/dev/null");
+
+	printf("%-8s %8s %16s %16s %8s\n", "mode", "threads", "mutex queue/s",
+	    "stealing/s", "speedup");
+	for (tree = 0; tree <= 1; tree++) {
+		before = bench_run(0, tree, threads, ntasks, work);
+		after = bench_run(1, tree, threads, ntasks, work);
+		printf("%-8s %8d %16.0f %16.0f %7.2fx\n",
+		    tree ? "tree" : "inject", threads, before, after,
+		    after / before);
+	}
+
+	return 0;
+}
@@ -35,6 +35,10 @@
 #include "database.h"
 #include "filesystem.h"
 #include "processor.h"
+#include "metrics.h"
+#include "checkpoint.h"
+#include "trace.h"
+#include "defaults.h"
 #include "cfg-parser.h"
 
 #define MH_PARSER "MH_PARSER"
@@ -105,6 +109,42 @@ static int parse_fs(cJSON *seg, metahunter_t *mh) {
 
 	fs->name = xt_strdup(c->valuestring);
 
+	/*
+	 * optional, with "release_range" the journal is trimmed by range
+	 * if the fs supports it, every "release_batch" entries or
+	 * "release_interval" ms. The entries are released one by one
+	 * otherwise.
+	 */
+	c = cJSON_GetObjectItem(seg, "release_range");
+	if (c) {
+		if (c->type != cJSON_True && c->type != cJSON_False) {
+			xt_log(MH_PARSER, XT_LOG_ERROR, "fs release_range "
+			    "invalid.");
+			goto err;
+		}
+		fs->release_range = (c->type == cJSON_True);
+	}
+
+	c = cJSON_GetObjectItem(seg, "release_batch");
+	if (c) {
+		if (c->type != cJSON_Number || c->valueint <= 0) {
+			xt_log(MH_PARSER, XT_LOG_ERROR, "fs release_batch "
+			    "invalid.");
+			goto err;
+		}
+		fs->release_batch = c->valueint;
+	}
+
+	c = cJSON_GetObjectItem(seg, "release_interval");
+	if (c) {
+		if (c->type != cJSON_Number || c->valueint <= 0) {
+			xt_log(MH_PARSER, XT_LOG_ERROR, "fs release_interval "
+			    "invalid.");
+			goto err;
+		}
+		fs->release_interval = c->valueint;
+	}
+
 	ret = filesystem_load(fs);
 	if (ret) {
 		xt_log(MH_PARSER, XT_LOG_ERROR, "load fs module failed.");
@@ -129,6 +169,54 @@ err:
 	return ret;
 }
 
+/*
+ * optional, workers of each stage, e.g.
+ * "stages": {"STAGE_DB_APPLY": {"workers": 4}}
+ */
+static int parse_stage_workers(cJSON *seg, processor_t *processor)
+{
+	cJSON *stage = NULL;
+	cJSON *c = NULL;
+	int i = 0;
+
+	if (seg->type != cJSON_Object) {
+		xt_log(MH_PARSER, XT_LOG_ERROR, "processor stages invalid.");
+		return -1;
+	}
+
+	processor->stage_workers = XT_CALLOC(processor->stage_count,
+	    sizeof (int));
+	if (!processor->stage_workers) {
+		xt_log(MH_PARSER, XT_LOG_ERROR, "stage workers allocation "
+		    "failed.");
+		return -1;
+	}
+
+	for (stage = seg->child; stage; stage = stage->next) {
+		for (i = 0; i < processor->stage_count; i++) {
+			if (!strcmp(stage->string,
+			    processor->stages_desc[i].stage_name))
+				break;
+		}
+
+		if (i == processor->stage_count) {
+			xt_log(MH_PARSER, XT_LOG_ERROR, "unknown stage %s.",
+			    stage->string);
+			return -1;
+		}
+
+		c = cJSON_GetObjectItem(stage, "workers");
+		if (!c || c->type != cJSON_Number || c->valueint < 0) {
+			xt_log(MH_PARSER, XT_LOG_ERROR, "stage %s workers "
+			    "invalid.", stage->string);
+			return -1;
+		}
+		processor->stage_workers[i] = c->valueint;
+	}
+
+	return 0;
+}
+
 static int parse_processor(cJSON *seg, metahunter_t *mh)
 {
 	processor_t *processor = NULL;
@@ -167,6 +255,60 @@ static int parse_processor(cJSON *seg, metahunter_t *mh)
 
 	processor->outstanding_ops = c->valueint;
 
+	/*
+	 * optional, bounds of the adaptive outstanding window. The
+	 * window stays at outstanding_limit if none is given.
+	 */
+	c = cJSON_GetObjectItem(seg, "outstanding_min");
+	if (c) {
+		if (c->type != cJSON_Number || c->valueint <= 0 ||
+		    c->valueint > processor->outstanding_ops) {
+			xt_log(MH_PARSER, XT_LOG_ERROR, "processor "
+			    "outstanding_min invalid.");
+			goto err;
+		}
+		processor->outstanding_min = c->valueint;
+	}
+
+	c = cJSON_GetObjectItem(seg, "outstanding_max");
+	if (c) {
+		if (c->type != cJSON_Number ||
+		    c->valueint < processor->outstanding_ops) {
+			xt_log(MH_PARSER, XT_LOG_ERROR, "processor "
+			    "outstanding_max invalid.");
+			goto err;
+		}
+		processor->outstanding_max = c->valueint;
+	}
+
+	/*
+	 * optional, split the objects of each stage into shards
+	 * by inode hash, every shard has its own lock.
+	 */
+	c = cJSON_GetObjectItem(seg, "shards");
+	if (c) {
+		if (c->type != cJSON_Number || c->valueint <= 0) {
+			xt_log(MH_PARSER, XT_LOG_ERROR, "processor shards "
+			    "invalid.");
+			goto err;
+		}
+		processor->shard_count = c->valueint;
+	}
+
+	/*
+	 * optional, coalesce the ops of the same object across the
+	 * outstanding window, enabled by default.
+	 */
+	c = cJSON_GetObjectItem(seg, "coalesce");
+	if (c) {
+		if (c->type != cJSON_True && c->type != cJSON_False) {
+			xt_log(MH_PARSER, XT_LOG_ERROR, "processor coalesce "
+			    "invalid.");
+			goto err;
+		}
+		processor->no_coalesce = (c->type == cJSON_False);
+	}
+
 	ret = processor_load(processor);
 	if (ret) {
 		xt_log(MH_PARSER, XT_LOG_ERROR, "load processor %s failed.",
@@ -174,6 +316,13 @@ static int parse_processor(cJSON *seg, metahunter_t *mh)
 		goto err;
 	}
 
+	c = cJSON_GetObjectItem(seg, "stages");
+	if (c) {
+		ret = parse_stage_workers(c, processor);
+		if (ret)
+			goto err;
+	}
+
 	if (processor->conf_parse) {
 		ret = processor->conf_parse(seg, &processor->conf);
 		if (ret) {
@@ -190,10 +339,277 @@ static int parse_processor(cJSON *seg, metahunter_t *mh)
 
 	return ret;
 err:
+	if (processor)
+		XT_FREE(processor->stage_workers);
 	XT_FREE(processor);
 	return ret;
 }
 
+/*
+ * stats server, "socket" is the unix socket path, "http_port" is
+ * the optional localhost port.
+ */
+static int parse_metrics(cJSON *seg, metahunter_t *mh)
+{
+	metrics_server_t *ms = NULL;
+	cJSON *c = NULL;
+
+	xt_log(MH_PARSER, XT_LOG_TRACE, "enter parse metrics");
+
+	ms = XT_CALLOC(1, sizeof (metrics_server_t));
+	if (!ms) {
+		xt_log(MH_PARSER, XT_LOG_ERROR, "metrics allocation failed.");
+		return -1;
+	}
+
+	c = cJSON_GetObjectItem(seg, "socket");
+	if (c) {
+		if (c->type != cJSON_String) {
+			xt_log(MH_PARSER, XT_LOG_ERROR, "metrics socket "
+			    "invalid.");
+			goto err;
+		}
+		ms->sock_path = xt_strdup(c->valuestring);
+	} else {
+		ms->sock_path = xt_strdup(MH_DEFAULT_METRICS_SOCK);
+	}
+
+	c = cJSON_GetObjectItem(seg, "http_port");
+	if (c) {
+		if (c->type != cJSON_Number || c->valueint <= 0 ||
+		    c->valueint > 65535) {
+			xt_log(MH_PARSER, XT_LOG_ERROR, "metrics http_port "
+			    "invalid.");
+			goto err;
+		}
+		ms->http_port = c->valueint;
+	}
+
+	mh->metrics = ms;
+
+	xt_log(MH_PARSER, XT_LOG_TRACE, "exit parse metrics");
+
+	return 0;
+err:
+	XT_FREE(ms->sock_path);
+	XT_FREE(ms);
+	return -1;
+}
+
+/*
+ * checkpoint of the committed records, "type" is the checkpoint type,
+ * "path" its location, "interval" the ms between two stores.
+ */
+static int parse_checkpoint(cJSON *seg, metahunter_t *mh)
+{
+	checkpoint_t *ck = NULL;
+	cJSON *c = NULL;
+
+	xt_log(MH_PARSER, XT_LOG_TRACE, "enter parse checkpoint");
+
+	ck = XT_CALLOC(1, sizeof (checkpoint_t));
+	if (!ck) {
+		xt_log(MH_PARSER, XT_LOG_ERROR, "checkpoint allocation "
+		    "failed.");
+		return -1;
+	}
+
+	c = cJSON_GetObjectItem(seg, "type");
+	if (c && c->type != cJSON_String) {
+		xt_log(MH_PARSER, XT_LOG_ERROR, "checkpoint type invalid.");
+		goto err;
+	}
+	ck->type = xt_strdup(c ? c->valuestring : MH_DEFAULT_CHECKPOINT_TYPE);
+
+	c = cJSON_GetObjectItem(seg, "path");
+	if (c && c->type != cJSON_String) {
+		xt_log(MH_PARSER, XT_LOG_ERROR, "checkpoint path invalid.");
+		goto err;
+	}
+	ck->path = xt_strdup(c ? c->valuestring : MH_DEFAULT_CHECKPOINT_FILE);
+
+	c = cJSON_GetObjectItem(seg, "interval");
+	if (c) {
+		if (c->type != cJSON_Number || c->valueint <= 0) {
+			xt_log(MH_PARSER, XT_LOG_ERROR, "checkpoint interval "
+			    "invalid.");
+			goto err;
+		}
+		ck->interval = c->valueint;
+	} else {
+		ck->interval = MH_DEFAULT_CHECKPOINT_INTERVAL;
+	}
+
+	if (!ck->type || !ck->path) {
+		xt_log(MH_PARSER, XT_LOG_ERROR, "checkpoint allocation "
+		    "failed.");
+		goto err;
+	}
+
+	mh->checkpoint = ck;
+
+	xt_log(MH_PARSER, XT_LOG_TRACE, "exit parse checkpoint");
+
+	return 0;
+err:
+	XT_FREE(ck->type);
+	XT_FREE(ck->path);
+	XT_FREE(ck);
+	return -1;
+}
+
+/*
+ * namespace scan of the scanner, "walkers" is the number of threads
+ * reading the directories, "max_open_dirs" bounds the directories open
+ * at once, "bulk_load" loads a scan into an empty database in batches
+ * without the pipeline.
+ */
+static int parse_scanner(cJSON *seg, metahunter_t *mh)
+{
+	scan_ctrl_t *scan = NULL;
+	cJSON *c = NULL;
+
+	xt_log(MH_PARSER, XT_LOG_TRACE, "enter parse scanner");
+
+	scan = XT_CALLOC(1, sizeof (scan_ctrl_t));
+	if (!scan) {
+		xt_log(MH_PARSER, XT_LOG_ERROR, "scanner allocation failed.");
+		return -1;
+	}
+
+	scan->walkers = MH_DEFAULT_SCAN_WALKERS;
+	scan->max_open_dirs = MH_DEFAULT_SCAN_MAX_OPEN_DIRS;
+
+	c = cJSON_GetObjectItem(seg, "walkers");
+	if (c) {
+		if (c->type != cJSON_Number || c->valueint <= 0) {
+			xt_log(MH_PARSER, XT_LOG_ERROR, "scanner walkers "
+			    "invalid.");
+			goto err;
+		}
+		scan->walkers = c->valueint;
+	}
+
+	c = cJSON_GetObjectItem(seg, "max_open_dirs");
+	if (c) {
+		if (c->type != cJSON_Number || c->valueint <= 0) {
+			xt_log(MH_PARSER, XT_LOG_ERROR, "scanner max_open_dirs "
+			    "invalid.");
+			goto err;
+		}
+		scan->max_open_dirs = c->valueint;
+	}
+
+	c = cJSON_GetObjectItem(seg, "bulk_load");
+	if (c) {
+		if (c->type != cJSON_True && c->type != cJSON_False) {
+			xt_log(MH_PARSER, XT_LOG_ERROR, "scanner bulk_load "
+			    "invalid.");
+			goto err;
+		}
+		scan->bulk_load = (c->type == cJSON_True);
+	}
+
+	mh->scan = scan;
+
+	xt_log(MH_PARSER, XT_LOG_TRACE, "exit parse scanner");
+
+	return 0;
+err:
+	XT_FREE(scan);
+	return -1;
+}
+
+/*
+ * log levels, "levels" maps a log domain, or "default" for the global
+ * level, to its level:
+ *
+ * "Log": {
+ *	"levels": {"MH_CEPH": "TRACE", "MH_RBH_DB": "DEBUG"}
+ * }
+ */
+static int parse_log(cJSON *seg)
+{
+	cJSON *levels = NULL;
+	cJSON *c = NULL;
+	xt_loglevel_t level = XT_LOG_NONE;
+
+	xt_log(MH_PARSER, XT_LOG_TRACE, "enter parse log");
+
+	levels = cJSON_GetObjectItem(seg, "levels");
+	if (!levels)
+		return 0;
+
+	if (levels->type != cJSON_Object) {
+		xt_log(MH_PARSER, XT_LOG_ERROR, "log levels invalid.");
+		return -1;
+	}
+
+	for (c = levels->child; c; c = c->next) {
+		if (c->type != cJSON_String) {
+			xt_log(MH_PARSER, XT_LOG_ERROR, "log level of %s "
+			    "invalid.", c->string);
+			return -1;
+		}
+
+		level = xt_str2loglvl(c->valuestring);
+		if (!strcmp(c->string, "default")) {
+			xt_log_set_loglevel(level);
+			continue;
+		}
+
+		if (xt_log_set_domain_level(c->string, level)) {
+			xt_log(MH_PARSER, XT_LOG_ERROR, "log domain %s "
+			    "invalid or too many domains.", c->string);
+			return -1;
+		}
+	}
+
+	xt_log(MH_PARSER, XT_LOG_TRACE, "exit parse log");
+
+	return 0;
+}
+
+/*
+ * binary tracepoints, "dir" holds the ring files of the threads,
+ * "records" the size of a ring.
+ */
+static int parse_trace(cJSON *seg)
+{
+	const char *dir = MH_DEFAULT_TRACE_DIR;
+	unsigned int records = MH_DEFAULT_TRACE_RECORDS;
+	cJSON *c = NULL;
+
+	xt_log(MH_PARSER, XT_LOG_TRACE, "enter parse trace");
+
+	c = cJSON_GetObjectItem(seg, "dir");
+	if (c) {
+		if (c->type != cJSON_String) {
+			xt_log(MH_PARSER, XT_LOG_ERROR, "trace dir invalid.");
+			return -1;
+		}
+		dir = c->valuestring;
+	}
+
+	c = cJSON_GetObjectItem(seg, "records");
+	if (c) {
+		if (c->type != cJSON_Number || c->valueint <= 0) {
+			xt_log(MH_PARSER, XT_LOG_ERROR, "trace records "
+			    "invalid.");
+			return -1;
+		}
+		records = c->valueint;
+	}
+
+	if (mh_trace_init(dir, records)) {
+		xt_log(MH_PARSER, XT_LOG_ERROR, "failed to start trace.");
+		return -1;
+	}
+
+	xt_log(MH_PARSER, XT_LOG_TRACE, "exit parse trace");
+
+	return 0;
+}
 
 static int parse_segments(cJSON *json, metahunter_t *mh)
 {
@@ -215,6 +631,16 @@ static int parse_segments(cJSON *json, metahunter_t *mh)
 			ret = parse_processor(seg, mh);
 		} else if (!strcmp(seg->string, "DataBase")) {
 			ret = parse_db(seg, mh);
+		} else if (!strcmp(seg->string, "Metrics")) {
+			ret = parse_metrics(seg, mh);
+		} else if (!strcmp(seg->string, "Checkpoint")) {
+			ret = parse_checkpoint(seg, mh);
+		} else if (!strcmp(seg->string, "Scanner")) {
+			ret = parse_scanner(seg, mh);
+		} else if (!strcmp(seg->string, "Log")) {
+			ret = parse_log(seg);
+		} else if (!strcmp(seg->string, "Trace")) {
+			ret = parse_trace(seg);
 		} else {
 			xt_log(MH_PARSER, XT_LOG_ERROR, "invalid segment");
 			return -1;
@@ -225,53 +651,71 @@ static int parse_segments(cJSON *json, metahunter_t *mh)
 	return 0;
 }
 
-int xt_parse_config(char *conffile, metahunter_t *mh)
+static cJSON *load_config(char *conffile)
 {
 	FILE *f = NULL;
 	long len = 0;
 	char *data;
 	int ret = 0;
-	char *out;
 	cJSON *json = NULL;
 
 	f = fopen(conffile, "rb");
 	if (f == NULL) {
 		xt_log("parser", XT_LOG_ERROR, "failed to open conf file:%s",
 		    conffile);
-		return -1;
+		return NULL;
 	}
 
 	ret = fseek(f, 0, SEEK_END);
 	if (ret == -1) {
 		xt_log("parser", XT_LOG_ERROR, "failed to seek conf file to "
 		    "end: %s with %s!", conffile, strerror(errno));
-		return -1;
+		fclose(f);
+		return NULL;
 	}
 
 	len = ftell(f);
 	if (len == -1) {
 		xt_log("parser", XT_LOG_ERROR, "failed to tell conf file length"
 		    ": %s, %s!", conffile, strerror(errno));
-		return -1;
+		fclose(f);
+		return NULL;
 	}
 
 	ret = fseek(f, 0, SEEK_SET);
 	if (ret == -1) {
 		xt_log("parser", XT_LOG_ERROR, "failed to seek conf file to "
 		    "head: %s with %s!", conffile, strerror(errno));
-		return -1;
+		fclose(f);
+		return NULL;
 	}
-	data = XT_MALLOC(len);
+	data = XT_MALLOC(len + 1);
 	if (data == NULL) {
 		xt_log("parser", XT_LOG_ERROR, "Failed allocate buffer for %s."
 		    , conffile);
-			return -1;
+		fclose(f);
+		return NULL;
 	}
 
 	fread(data, 1, len, f);
+	data[len] = '\0';
 	fclose(f);
 
 	json = cJSON_Parse(data);
+	XT_FREE(data);
+
+	return json;
+}
+
+int xt_parse_config(char *conffile, metahunter_t *mh)
+{
+	cJSON *json = NULL;
+	char *out;
+	int ret = 0;
+
+	json = load_config(conffile);
+	if (json == NULL)
+		return -1;
 
 	out = cJSON_Print(json);
 
@@ -283,10 +727,32 @@ int xt_parse_config(char *conffile, metahunter_t *mh)
 	 */
 	ret = parse_segments(json, mh);
 
-	XT_FREE(data);
-
 	cJSON_Delete(json);
 
 	return ret;
 }
 
+/*
+ * reload the log levels of the configuration, the domains it no
+ * longer lists fall back to the global level.
+ */
+int xt_parse_log_config(char *conffile)
+{
+	cJSON *json = NULL;
+	cJSON *seg = NULL;
+	int ret = 0;
+
+	json = load_config(conffile);
+	if (json == NULL)
+		return -1;
+
+	xt_log_clear_domain_levels();
+
+	seg = cJSON_GetObjectItem(json, "Log");
+	if (seg)
+		ret = parse_log(seg);
+
+	cJSON_Delete(json);
+
+	return ret;
+}
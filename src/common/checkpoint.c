@@ -0,0 +1,310 @@
+/*
+ * Copyright (c) 2016 XTAO Technology <www.xtaotech.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <libgen.h>
+#include <unistd.h>
+#include "logging.h"
+#include "mem.h"
+#include "checkpoint.h"
+
+#define MH_CHECKPOINT "checkpoint"
+
+/*
+ * "file": a single record at the head of a local file
+ */
+#define CK_FILE_MAGIC	0x4d48434bU	/* MHCK */
+#define CK_FILE_VERSION	1
+
+typedef struct ck_file_rec {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t seq;
+	uint64_t check;
+} ck_file_rec_t;
+
+static inline uint64_t ck_file_check(uint64_t seq)
+{
+	return ~seq ^ ((uint64_t)CK_FILE_MAGIC << 32 | CK_FILE_VERSION);
+}
+
+/*
+ * sync the directory the checkpoint file is created in
+ */
+static void ck_file_sync_dir(const char *path)
+{
+	char *copy = xt_strdup(path);
+	int fd = -1;
+
+	if (copy == NULL)
+		return;
+
+	fd = open(dirname(copy), O_RDONLY | O_DIRECTORY);
+	if (fd >= 0) {
+		fsync(fd);
+		close(fd);
+	}
+	XT_FREE(copy);
+}
+
+static int ck_file_open(const char *path, void **hdl)
+{
+	int *pfd = NULL;
+	int created = 0;
+	int fd = -1;
+
+	fd = open(path, O_RDWR);
+	if (fd < 0 && errno == ENOENT) {
+		fd = open(path, O_RDWR | O_CREAT | O_EXCL, 0644);
+		created = 1;
+	}
+	if (fd < 0) {
+		xt_log(MH_CHECKPOINT, XT_LOG_ERROR, "failed to open %s: %s",
+		    path, strerror(errno));
+		return errno;
+	}
+
+	if (created)
+		ck_file_sync_dir(path);
+
+	pfd = XT_MALLOC(sizeof(int));
+	if (pfd == NULL) {
+		close(fd);
+		return ENOMEM;
+	}
+
+	*pfd = fd;
+	*hdl = pfd;
+	return 0;
+}
+
+static int ck_file_load(void *hdl, uint64_t *seq)
+{
+	ck_file_rec_t rec;
+	ssize_t len = 0;
+
+	len = pread(*(int *)hdl, &rec, sizeof(rec), 0);
+	if (len < 0)
+		return errno;
+	if (len == 0)
+		return ENOENT;
+
+	if (len != sizeof(rec) || rec.magic != CK_FILE_MAGIC ||
+	    rec.version != CK_FILE_VERSION ||
+	    rec.check != ck_file_check(rec.seq))
+		return EINVAL;
+
+	*seq = rec.seq;
+	return 0;
+}
+
+static int ck_file_store(void *hdl, uint64_t seq)
+{
+	int fd = *(int *)hdl;
+	ck_file_rec_t rec;
+
+	memset(&rec, 0, sizeof(rec));
+	rec.magic = CK_FILE_MAGIC;
+	rec.version = CK_FILE_VERSION;
+	rec.seq = seq;
+	rec.check = ck_file_check(seq);
+
+	/*
+	 * the record is within a sector, it is not torn
+	 */
+	if (pwrite(fd, &rec, sizeof(rec), 0) != sizeof(rec))
+		return errno ? errno : EIO;
+
+	if (fdatasync(fd))
+		return errno;
+
+	return 0;
+}
+
+static void ck_file_close(void *hdl)
+{
+	close(*(int *)hdl);
+	XT_FREE(hdl);
+}
+
+static const struct checkpoint_ops ck_file_ops = {
+	"file",
+	ck_file_open,
+	ck_file_load,
+	ck_file_store,
+	ck_file_close,
+};
+
+/*
+ * checkpoint types, a new type is added here
+ */
+static const struct checkpoint_ops *checkpoint_types[] = {
+	&ck_file_ops,
+	NULL,
+};
+
+int checkpoint_load(checkpoint_t *ck)
+{
+	int ret = 0;
+	int i = 0;
+
+	for (i = 0; checkpoint_types[i]; i++) {
+		if (!strcmp(checkpoint_types[i]->name, ck->type))
+			break;
+	}
+
+	if (checkpoint_types[i] == NULL) {
+		xt_log(MH_CHECKPOINT, XT_LOG_ERROR, "unknown checkpoint "
+		    "type %s", ck->type);
+		return EINVAL;
+	}
+
+	ck->ops = checkpoint_types[i];
+	ret = ck->ops->ck_open(ck->path, &ck->hdl);
+	if (ret)
+		return ret;
+
+	ret = ck->ops->ck_load(ck->hdl, &ck->loaded);
+	if (ret == ENOENT) {
+		ck->loaded = 0;
+	} else if (ret) {
+		/*
+		 * the journal is applied from its head again, it takes
+		 * longer but nothing is lost.
+		 */
+		xt_log(MH_CHECKPOINT, XT_LOG_WARNING, "checkpoint %s is "
+		    "invalid: %d, ignored", ck->path, ret);
+		ck->loaded = 0;
+	}
+
+	ck->stored = ck->loaded;
+	xt_log(MH_CHECKPOINT, XT_LOG_INFO, "checkpoint %s at %llu",
+	    ck->path, (unsigned long long)ck->loaded);
+	return 0;
+}
+
+/*
+ * store the watermark if it advanced, called with the lock held
+ */
+static void checkpoint_store(checkpoint_t *ck)
+{
+	uint64_t seq = __atomic_load_n(ck->committed, __ATOMIC_RELAXED);
+	int ret = 0;
+
+	if (seq <= ck->stored)
+		return;
+
+	UNLOCK(&ck->lock);
+	ret = ck->ops->ck_store(ck->hdl, seq);
+	LOCK(&ck->lock);
+
+	if (ret) {
+		xt_log(MH_CHECKPOINT, XT_LOG_ERROR, "failed to store "
+		    "checkpoint %llu: %d", (unsigned long long)seq, ret);
+		return;
+	}
+
+	ck->stored = seq;
+	ck->nb_stores++;
+}
+
+static void *checkpoint_thr(void *arg)
+{
+	checkpoint_t *ck = (checkpoint_t *)arg;
+	struct timespec ts;
+
+	LOCK(&ck->lock);
+	while (!ck->exiting) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += ck->interval / 1000;
+		ts.tv_nsec += (ck->interval % 1000) * 1000000L;
+		if (ts.tv_nsec >= 1000000000L) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000L;
+		}
+		pthread_cond_timedwait(&ck->cond, &ck->lock, &ts);
+		checkpoint_store(ck);
+	}
+	UNLOCK(&ck->lock);
+	return NULL;
+}
+
+int checkpoint_start(checkpoint_t *ck, unsigned long long *committed)
+{
+	int ret = 0;
+
+	ck->committed = committed;
+	ck->exiting = 0;
+	LOCK_INIT(&ck->lock);
+	COND_INIT(&ck->cond);
+
+	ret = pthread_create(&ck->tid, NULL, checkpoint_thr, ck);
+	if (ret) {
+		xt_log(MH_CHECKPOINT, XT_LOG_ERROR, "failed to create "
+		    "checkpoint thread: %d", ret);
+		COND_DESTROY(&ck->cond);
+		LOCK_DESTROY(&ck->lock);
+		return ret;
+	}
+
+	ck->running = 1;
+	return 0;
+}
+
+void checkpoint_stop(checkpoint_t *ck)
+{
+	if (ck->running) {
+		LOCK(&ck->lock);
+		ck->exiting = 1;
+		COND_SIGNAL(&ck->cond);
+		UNLOCK(&ck->lock);
+		pthread_join(ck->tid, NULL);
+
+		/*
+		 * the entries released since the last interval
+		 */
+		LOCK(&ck->lock);
+		checkpoint_store(ck);
+		UNLOCK(&ck->lock);
+
+		COND_DESTROY(&ck->cond);
+		LOCK_DESTROY(&ck->lock);
+		ck->running = 0;
+
+		xt_log(MH_CHECKPOINT, XT_LOG_INFO, "checkpoint %s at %llu, "
+		    "%llu stores", ck->path, (unsigned long long)ck->stored,
+		    ck->nb_stores);
+	}
+
+	if (ck->hdl) {
+		ck->ops->ck_close(ck->hdl);
+		ck->hdl = NULL;
+	}
+}
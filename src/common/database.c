@@ -126,3 +126,53 @@ int database_remove_inode(database_t *db, void *hdl, char *name, mattr_t *attr)
 		return -1;
 	return db->db_ops->db_rm_inode(hdl, name, attr);
 }
+
+/*
+ * apply the changes one by one if the database does not support
+ * batch, all the changes are tried, return the first error.
+ */
+int database_apply_batch(database_t *db, void *hdl, db_batch_op_t *ops,
+    int count)
+{
+	int i = 0;
+	int ret = 0;
+	int err = 0;
+
+	if (!db)
+		return -1;
+
+	if (db->db_ops->db_apply_batch)
+		return db->db_ops->db_apply_batch(hdl, ops, count);
+
+	for (i = 0; i < count; i++) {
+		switch (ops[i].type) {
+		case db_op_insert:
+			ret = db->db_ops->db_insert(hdl, ops[i].name,
+			    ops[i].attr);
+			break;
+		case db_op_update:
+			ret = db->db_ops->db_update(hdl, ops[i].name,
+			    ops[i].attr);
+			break;
+		case db_op_rm_dentry:
+			ret = db->db_ops->db_rm_dentry(hdl, ops[i].name,
+			    ops[i].attr);
+			break;
+		case db_op_rm_inode:
+			ret = db->db_ops->db_rm_inode(hdl, ops[i].name,
+			    ops[i].attr);
+			break;
+		default:
+			xt_log("database", XT_LOG_ERROR, "invalid batch op %d",
+			    ops[i].type);
+			ret = -1;
+			break;
+		}
+
+		ops[i].status = ret;
+		if (ret && !err)
+			err = ret;
+	}
+
+	return err;
+}
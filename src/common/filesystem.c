@@ -29,10 +29,18 @@
 #include <netdb.h>
 #include <fnmatch.h>
 #include <stdlib.h>
+#include <errno.h>
+#include <time.h>
 #include "logging.h"
 #include "mem.h"
+#include "defaults.h"
 #include "filesystem.h"
 
+/*
+ * initial slots of the watermark, it grows with the outstanding entries
+ */
+#define FS_WMARK_SLOTS	1024
+
 int filesystem_load(filesystem_t *fs)
 {
 	char *name = NULL;
@@ -85,14 +93,293 @@ void filesystem_fini(filesystem_t *fs)
 	fs->fs_ops->fs_fini(fs->private);
 }
 
+static int fs_wmark_grow(fs_wmark_t *wm)
+{
+	unsigned long size = wm->size ? wm->size * 2 : FS_WMARK_SLOTS;
+	fs_wmark_slot_t *slots = NULL;
+	unsigned long i = 0;
+
+	slots = XT_CALLOC(size, sizeof(fs_wmark_slot_t));
+	if (slots == NULL)
+		return ENOMEM;
+
+	for (i = wm->head; i != wm->tail; i++)
+		slots[i & (size - 1)] = wm->slots[i & (wm->size - 1)];
+
+	XT_FREE(wm->slots);
+	wm->slots = slots;
+	wm->size = size;
+	return 0;
+}
+
+/*
+ * track the held entry. An entry out of seq order is not tracked, it
+ * is released on its own.
+ */
+static void fs_wmark_hold(fs_wmark_t *wm, uint64_t seq)
+{
+	LOCK(&wm->lock);
+
+	if (seq <= wm->committed || (wm->tail != wm->head &&
+	    seq <= wm->slots[(wm->tail - 1) & (wm->size - 1)].seq)) {
+		xt_log("filesystem", XT_LOG_WARNING, "journal entry %llu out "
+		    "of order", (unsigned long long)seq);
+		goto out;
+	}
+
+	if (wm->tail - wm->head == wm->size && fs_wmark_grow(wm)) {
+		xt_log("filesystem", XT_LOG_WARNING, "failed to track "
+		    "journal entry %llu", (unsigned long long)seq);
+		goto out;
+	}
+
+	wm->slots[wm->tail & (wm->size - 1)].seq = seq;
+	wm->slots[wm->tail & (wm->size - 1)].done = 0;
+	wm->tail++;
+out:
+	UNLOCK(&wm->lock);
+}
+
+/*
+ * mark the entry released and advance the watermark over the done
+ * entries at the head. return -1 if the entry is not tracked.
+ */
+static int fs_wmark_done(filesystem_t *fs, uint64_t seq)
+{
+	fs_wmark_t *wm = fs->wmark;
+	fs_wmark_slot_t *slot = NULL;
+	unsigned long lo = 0;
+	unsigned long hi = 0;
+	unsigned long mid = 0;
+	unsigned long n = 0;
+
+	LOCK(&wm->lock);
+
+	/*
+	 * the slots are sorted by seq
+	 */
+	lo = wm->head;
+	hi = wm->tail;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (wm->slots[mid & (wm->size - 1)].seq < seq)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	slot = &wm->slots[lo & (wm->size - 1)];
+	if (lo == wm->tail || slot->seq != seq || slot->done) {
+		UNLOCK(&wm->lock);
+		return -1;
+	}
+	slot->done = 1;
+
+	while (wm->head != wm->tail) {
+		slot = &wm->slots[wm->head & (wm->size - 1)];
+		if (!slot->done)
+			break;
+		wm->committed = slot->seq;
+		wm->head++;
+		n++;
+	}
+
+	if (n) {
+		if (fs->committed_record)
+			__atomic_store_n(fs->committed_record, wm->committed,
+			    __ATOMIC_RELAXED);
+
+		if (!wm->trim) {
+			wm->cleared = wm->committed;
+			if (fs->cleared_record)
+				__atomic_store_n(fs->cleared_record,
+				    wm->cleared, __ATOMIC_RELAXED);
+		} else if (wm->pending < fs->release_batch &&
+		    wm->pending + n >= fs->release_batch) {
+			COND_SIGNAL(&wm->cond);
+		}
+		wm->pending += n;
+	}
+
+	UNLOCK(&wm->lock);
+	return 0;
+}
+
+/*
+ * trim the journal up to the watermark, called by the flusher with
+ * the lock held.
+ */
+static void fs_wmark_trim(filesystem_t *fs)
+{
+	fs_wmark_t *wm = fs->wmark;
+	uint64_t seq = wm->committed;
+	int ret = 0;
+
+	if (seq == wm->cleared)
+		return;
+
+	wm->pending = 0;
+	UNLOCK(&wm->lock);
+
+	ret = fs->fs_ops->fs_trim_journal(fs->private, seq);
+
+	LOCK(&wm->lock);
+	if (ret) {
+		xt_log("filesystem", XT_LOG_ERROR, "failed to trim journal "
+		    "up to %llu: %d", (unsigned long long)seq, ret);
+		return;
+	}
+
+	wm->cleared = seq;
+	if (fs->cleared_record)
+		__atomic_store_n(fs->cleared_record, seq, __ATOMIC_RELAXED);
+}
+
+static void *fs_wmark_flusher(void *arg)
+{
+	filesystem_t *fs = (filesystem_t *)arg;
+	fs_wmark_t *wm = fs->wmark;
+	struct timespec ts;
+
+	LOCK(&wm->lock);
+	while (!wm->exiting) {
+		if (wm->pending < fs->release_batch) {
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_sec += fs->release_interval / 1000;
+			ts.tv_nsec += (fs->release_interval % 1000) * 1000000L;
+			if (ts.tv_nsec >= 1000000000L) {
+				ts.tv_sec++;
+				ts.tv_nsec -= 1000000000L;
+			}
+			pthread_cond_timedwait(&wm->cond, &wm->lock, &ts);
+		}
+		fs_wmark_trim(fs);
+	}
+
+	/*
+	 * the last released entries
+	 */
+	fs_wmark_trim(fs);
+	UNLOCK(&wm->lock);
+	return NULL;
+}
+
+/*
+ * start tracking the watermark of the held entries, before the first
+ * entry is held.
+ */
+int filesystem_release_start(filesystem_t *fs)
+{
+	fs_wmark_t *wm = NULL;
+	int ret = 0;
+
+	wm = XT_CALLOC(1, sizeof(fs_wmark_t));
+	if (wm == NULL)
+		return ENOMEM;
+
+	ret = fs_wmark_grow(wm);
+	if (ret) {
+		XT_FREE(wm);
+		return ret;
+	}
+
+	LOCK_INIT(&wm->lock);
+	COND_INIT(&wm->cond);
+	/*
+	 * the entries below the trimmed seq are never released on their
+	 * own, trim by range only when configured
+	 */
+	wm->trim = fs->release_range && fs->fs_ops->fs_free_jentry &&
+	    fs->fs_ops->fs_trim_journal;
+	if (fs->release_range && !wm->trim)
+		xt_log("filesystem", XT_LOG_WARNING, "%s can not trim the "
+		    "journal by range, release per entry", fs->name);
+
+	if (fs->release_batch == 0)
+		fs->release_batch = MH_DEFAULT_RELEASE_BATCH;
+	if (fs->release_interval == 0)
+		fs->release_interval = MH_DEFAULT_RELEASE_INTERVAL;
+
+	fs->wmark = wm;
+
+	if (wm->trim) {
+		ret = pthread_create(&wm->tid, NULL, fs_wmark_flusher, fs);
+		if (ret) {
+			xt_log("filesystem", XT_LOG_ERROR, "failed to create "
+			    "journal flusher: %d", ret);
+			fs->wmark = NULL;
+			COND_DESTROY(&wm->cond);
+			LOCK_DESTROY(&wm->lock);
+			XT_FREE(wm->slots);
+			XT_FREE(wm);
+			return ret;
+		}
+	}
+
+	xt_log("filesystem", XT_LOG_INFO, "journal released %s",
+	    wm->trim ? "by range" : "per entry");
+	return 0;
+}
+
+/*
+ * trim the journal up to the watermark and stop tracking, after the
+ * last entry is released.
+ */
+void filesystem_release_stop(filesystem_t *fs)
+{
+	fs_wmark_t *wm = fs->wmark;
+
+	if (wm == NULL)
+		return;
+
+	if (wm->trim) {
+		LOCK(&wm->lock);
+		wm->exiting = 1;
+		COND_SIGNAL(&wm->cond);
+		UNLOCK(&wm->lock);
+		pthread_join(wm->tid, NULL);
+	}
+
+	xt_log("filesystem", XT_LOG_INFO, "journal committed %llu cleared "
+	    "%llu, %lu entries outstanding",
+	    (unsigned long long)wm->committed,
+	    (unsigned long long)wm->cleared, wm->tail - wm->head);
+
+	fs->wmark = NULL;
+	COND_DESTROY(&wm->cond);
+	LOCK_DESTROY(&wm->lock);
+	XT_FREE(wm->slots);
+	XT_FREE(wm);
+}
+
 int filesystem_hold_jentry(filesystem_t *fs, journal_entry_t **entry)
 {
-	return fs->fs_ops->fs_hold_jentry(fs->private, entry);
+	int ret = 0;
+
+	ret = fs->fs_ops->fs_hold_jentry(fs->private, entry);
+	if (ret == 0 && fs->wmark)
+		fs_wmark_hold(fs->wmark, (*entry)->seq);
+
+	return ret;
 }
 
 void filesystem_release_jentry(filesystem_t *fs, journal_entry_t *entry)
 {
+	fs_wmark_t *wm = fs->wmark;
+	uint64_t seq = entry->seq;
+
+	if (wm && wm->trim && fs_wmark_done(fs, seq) == 0) {
+		/*
+		 * the flusher trims the journal up to the entry
+		 */
+		fs->fs_ops->fs_free_jentry(fs->private, entry);
+		return;
+	}
+
 	fs->fs_ops->fs_release_jentry(fs->private, entry);
+
+	if (wm && !wm->trim)
+		fs_wmark_done(fs, seq);
 }
 
 int filesystem_mount(filesystem_t *fs)
@@ -124,3 +411,12 @@ int filesystem_readdir_r(filesystem_t *fs, void *dirp, struct dirent *ent)
 {
 	return fs->fs_ops->fs_readdir_r(fs->private, dirp, ent);
 }
+
+int filesystem_readdirplus(filesystem_t *fs, void *dirp,
+    fs_dirent_plus_t *ents, int count)
+{
+	if (!fs->fs_ops->fs_readdirplus)
+		return -ENOTSUP;
+
+	return fs->fs_ops->fs_readdirplus(fs->private, dirp, ents, count);
+}
@@ -37,6 +37,7 @@
 #include <string.h>
 #include <stdlib.h>
 #include <sys/time.h>
+#include <sched.h>
 
 #include "logging.h"
 #include "mem.h"
@@ -49,6 +50,12 @@
 #endif
 
 xt_log_handle_t *xtlog = NULL;
+xt_loglevel_t xt_log_max_level = XT_LOG_NONE;
+
+static const char *xt_loglvl_names[] = {"NONE", "EMERG", "ALERT",
+                                        "CRITICAL", "ERROR", "WARNING",
+                                        "NOTICE", "INFO", "DEBUG",
+                                        "TRACE"};
 
 xt_loglevel_t xt_str2loglvl(char *str) {
 	if (!strcasecmp(str, "INFO"))
@@ -67,10 +74,21 @@ xt_loglevel_t xt_str2loglvl(char *str) {
 		return XT_LOG_NOTICE;
 	if (!strcasecmp(str, "EMERG"))
 		return XT_LOG_EMERG;
+	if (!strcasecmp(str, "CRITICAL"))
+		return XT_LOG_CRITICAL;
+	if (!strcasecmp(str, "NONE"))
+		return XT_LOG_NONE;
 
 	return XT_LOG_INFO;
 }
 
+const char *xt_loglvl2str(xt_loglevel_t level) {
+	if (level > XT_LOG_TRACE)
+		return "";
+
+	return xt_loglvl_names[level];
+}
+
 void
 xt_log_max_size (unsigned long max_size)
 {
@@ -95,10 +113,144 @@ xt_log_get_loglevel (void)
         return xtlog->loglevel;
 }
 
+/*
+ * recompute the inline gate, with the logfile mutex held
+ */
+static void
+xt_log_update_max_level (void)
+{
+        xt_loglevel_t max = xtlog->loglevel;
+        int           i = 0;
+
+        for (i = 0; i < xtlog->nr_domains; i++) {
+                if (xtlog->domains[i].level > max)
+                        max = xtlog->domains[i].level;
+        }
+
+        __atomic_store_n (&xt_log_max_level, max, __ATOMIC_RELAXED);
+}
+
 void
 xt_log_set_loglevel (xt_loglevel_t level)
 {
+        LOCK (&xtlog->logfile_mutex);
         xtlog->loglevel = level;
+        xt_log_update_max_level ();
+        UNLOCK (&xtlog->logfile_mutex);
+}
+
+/*
+ * the domains are only appended, the loggers look them up without the
+ * lock.
+ */
+int
+xt_log_set_domain_level (const char *domain, xt_loglevel_t level)
+{
+        xt_log_domain_t *dom = NULL;
+        int              i = 0;
+        int              ret = 0;
+
+        if (!domain || strlen (domain) >= XT_LOG_DOMAIN_SIZE ||
+            level > XT_LOG_TRACE)
+                return EINVAL;
+
+        LOCK (&xtlog->logfile_mutex);
+        for (i = 0; i < xtlog->nr_domains; i++) {
+                if (!strcmp (xtlog->domains[i].name, domain)) {
+                        dom = &xtlog->domains[i];
+                        break;
+                }
+        }
+
+        if (!dom) {
+                if (level == XT_LOG_NONE)
+                        goto out;
+
+                if (xtlog->nr_domains == XT_LOG_MAX_DOMAINS) {
+                        ret = ENOSPC;
+                        goto out;
+                }
+
+                dom = &xtlog->domains[xtlog->nr_domains];
+                strcpy (dom->name, domain);
+                dom->level = level;
+                __atomic_store_n (&xtlog->nr_domains, xtlog->nr_domains + 1,
+                                  __ATOMIC_RELEASE);
+        } else {
+                __atomic_store_n (&dom->level, level, __ATOMIC_RELAXED);
+        }
+
+        xt_log_update_max_level ();
+out:
+        UNLOCK (&xtlog->logfile_mutex);
+        return ret;
+}
+
+void
+xt_log_clear_domain_levels (void)
+{
+        int i = 0;
+
+        LOCK (&xtlog->logfile_mutex);
+        for (i = 0; i < xtlog->nr_domains; i++)
+                __atomic_store_n (&xtlog->domains[i].level, XT_LOG_NONE,
+                                  __ATOMIC_RELAXED);
+        xt_log_update_max_level ();
+        UNLOCK (&xtlog->logfile_mutex);
+}
+
+/*
+ * level of the domain, the global one unless it is overridden
+ */
+xt_loglevel_t
+xt_log_get_domain_level (const char *domain)
+{
+        xt_loglevel_t level = XT_LOG_NONE;
+        int           n = 0;
+        int           i = 0;
+
+        n = __atomic_load_n (&xtlog->nr_domains, __ATOMIC_ACQUIRE);
+        for (i = 0; domain && i < n; i++) {
+                if (strcmp (xtlog->domains[i].name, domain))
+                        continue;
+
+                level = __atomic_load_n (&xtlog->domains[i].level,
+                                         __ATOMIC_RELAXED);
+                if (level != XT_LOG_NONE)
+                        return level;
+                break;
+        }
+
+        return xtlog->loglevel;
+}
+
+/*
+ * "default LEVEL" and a "DOMAIN LEVEL" line for each overridden domain
+ */
+int
+xt_log_domain_levels (char *buf, size_t size)
+{
+        int len = 0;
+        int n = 0;
+        int i = 0;
+
+        LOCK (&xtlog->logfile_mutex);
+        len = snprintf (buf, size, "default %s\n",
+                        xt_loglvl2str (xtlog->loglevel));
+        for (i = 0; i < xtlog->nr_domains && len < size; i++) {
+                if (xtlog->domains[i].level == XT_LOG_NONE)
+                        continue;
+
+                n = snprintf (buf + len, size - len, "%s %s\n",
+                              xtlog->domains[i].name,
+                              xt_loglvl2str (xtlog->domains[i].level));
+                if (n < 0)
+                        break;
+                len += n;
+        }
+        UNLOCK (&xtlog->logfile_mutex);
+
+        return len < size ? len : size - 1;
 }
 
 int
@@ -152,9 +304,474 @@ xt_log_unlock (void)
 }
 
 
+/*
+ * asynchronous logging
+ *
+ * A thread formats its record into the next slot of its own ring, the
+ * ring has a single producer and a single consumer and needs no lock.
+ * The writer thread wakes up every XT_LOG_FLUSH_MS, or when a ring is
+ * half full or an error is logged, stamps the time and writes all the
+ * rings out with one flush.
+ */
+#define XT_LOG_RING_SIZE        256     /* records, power of 2 */
+#define XT_LOG_TEXT_SIZE        1024
+#define XT_LOG_FLUSH_MS         50
+#define XT_LOG_BT_DEPTH         3
+
+typedef struct xt_log_rec {
+        struct timeval  tv;
+        xt_loglevel_t   level;
+        xt_loglevel_t   sys_level;      /* highest level to syslog */
+        int             off;            /* of the domain in text */
+        int             nbt;
+        void           *bt[XT_LOG_BT_DEPTH];
+        char            text[XT_LOG_TEXT_SIZE];
+} xt_log_rec_t;
+
+typedef struct xt_log_ring {
+        struct xlist_head  list;
+        unsigned long      head;        /* next record to fill */
+        unsigned long      dropped;
+        int                busy;        /* a record is being queued */
+        int                dead;        /* thread exited */
+        char               pad[64];
+        unsigned long      tail;        /* next record to write */
+        xt_log_rec_t       recs[XT_LOG_RING_SIZE];
+} xt_log_ring_t;
+
+struct xt_log_async {
+        xt_lock_t          lock;
+        xt_cond_t          cond;
+        struct xlist_head  rings;
+        pthread_key_t      key;
+        pthread_t          tid;
+        int                running;
+        int                exiting;
+        xt_log_full_t      full[XT_LOG_TRACE + 1];
+        time_t             last_sec;
+        char               timestr[64];
+};
+
+static const char *xt_log_level_strings[] = {"",  /* NONE */
+                                             "M", /* EMERGENCY */
+                                             "A", /* ALERT */
+                                             "C", /* CRITICAL */
+                                             "E", /* ERROR */
+                                             "W", /* WARNING */
+                                             "N", /* NOTICE */
+                                             "I", /* INFO */
+                                             "D", /* DEBUG */
+                                             "T", /* TRACE */
+                                             ""};
+
+/*
+ * the writer frees the ring once it is drained
+ */
+static void
+xt_log_ring_release (void *data)
+{
+        xt_log_ring_t *ring = data;
+
+        __atomic_store_n (&ring->dead, 1, __ATOMIC_RELEASE);
+}
+
+static xt_log_ring_t *
+xt_log_ring_get (struct xt_log_async *as)
+{
+        xt_log_ring_t *ring = NULL;
+
+        ring = pthread_getspecific (as->key);
+        if (ring)
+                return ring;
+
+        /*
+         * not XT_CALLOC, it logs on failure
+         */
+        ring = calloc (1, sizeof (*ring));
+        if (!ring)
+                return NULL;
+
+        LOCK (&as->lock);
+        xlist_add_tail (&ring->list, &as->rings);
+        UNLOCK (&as->lock);
+
+        if (pthread_setspecific (as->key, ring)) {
+                xt_log_ring_release (ring);
+                return NULL;
+        }
+
+        return ring;
+}
+
+/*
+ * queue a record, return -1 if the caller should log synchronously.
+ * The ring is marked busy before running is checked, and
+ * xt_log_async_stop() clears running before it waits for the rings,
+ * so a record is either queued before the last drain or not at all.
+ */
+static int
+xt_log_async_vput (const char *domain, const char *file,
+                   const char *function, int line, xt_loglevel_t level,
+                   xt_loglevel_t sys_level, int callingfn, const char *fmt,
+                   va_list ap)
+{
+        struct xt_log_async *as = xtlog->async;
+        xt_log_ring_t       *ring = NULL;
+        xt_log_rec_t        *rec = NULL;
+        const char          *basename = NULL;
+        unsigned long        head = 0;
+        unsigned long        tail = 0;
+        int                  len = 0;
+
+        if (!as || !__atomic_load_n (&as->running, __ATOMIC_ACQUIRE))
+                return -1;
+
+        ring = xt_log_ring_get (as);
+        if (!ring)
+                return -1;
+
+        __atomic_store_n (&ring->busy, 1, __ATOMIC_SEQ_CST);
+        if (!__atomic_load_n (&as->running, __ATOMIC_SEQ_CST))
+                goto sync;
+
+        head = ring->head;
+        tail = __atomic_load_n (&ring->tail, __ATOMIC_ACQUIRE);
+        while (head - tail == XT_LOG_RING_SIZE) {
+                if (as->full[level] == XT_LOG_FULL_DROP) {
+                        __atomic_fetch_add (&ring->dropped, 1,
+                                            __ATOMIC_RELAXED);
+                        __atomic_store_n (&ring->busy, 0,
+                                          __ATOMIC_RELEASE);
+                        return 0;
+                }
+
+                if (!__atomic_load_n (&as->running, __ATOMIC_ACQUIRE))
+                        goto sync;
+
+                COND_SIGNAL (&as->cond);
+                sched_yield ();
+                tail = __atomic_load_n (&ring->tail, __ATOMIC_ACQUIRE);
+        }
+
+        rec = &ring->recs[head & (XT_LOG_RING_SIZE - 1)];
+        gettimeofday (&rec->tv, NULL);
+        rec->level = level;
+        rec->sys_level = sys_level;
+
+        basename = strrchr (file, '/');
+        if (basename)
+                basename++;
+        else
+                basename = file;
+
+        len = snprintf (rec->text, XT_LOG_TEXT_SIZE, "[%s:%d:%s] ",
+                        basename, line, function);
+        if (len < 0 || len >= XT_LOG_TEXT_SIZE)
+                len = XT_LOG_TEXT_SIZE - 1;
+        rec->off = len;
+
+        len += snprintf (rec->text + len, XT_LOG_TEXT_SIZE - len, "%s: ",
+                         domain);
+        if (len < XT_LOG_TEXT_SIZE - 1)
+                vsnprintf (rec->text + len, XT_LOG_TEXT_SIZE - len, fmt, ap);
+
+        /*
+         * the writer resolves the symbols
+         */
+        rec->nbt = 0;
+#if HAVE_BACKTRACE
+        if (callingfn) {
+                void *array[XT_LOG_BT_DEPTH + 2];
+                int   size = 0;
+
+                size = backtrace (array, XT_LOG_BT_DEPTH + 2);
+                if (size > 2) {
+                        rec->nbt = size - 2;
+                        memcpy (rec->bt, &array[2],
+                                rec->nbt * sizeof (void *));
+                }
+        }
+#endif /* HAVE_BACKTRACE */
+
+        __atomic_store_n (&ring->head, head + 1, __ATOMIC_RELEASE);
+
+        if (level <= XT_LOG_ERROR ||
+            head + 1 - tail >= XT_LOG_RING_SIZE / 2)
+                COND_SIGNAL (&as->cond);
+
+        __atomic_store_n (&ring->busy, 0, __ATOMIC_RELEASE);
+        return 0;
+
+sync:
+        __atomic_store_n (&ring->busy, 0, __ATOMIC_RELEASE);
+        return -1;
+}
+
+static int
+xt_log_async_put (const char *domain, const char *file,
+                  const char *function, int line, xt_loglevel_t level,
+                  xt_loglevel_t sys_level, int callingfn,
+                  const char *fmt, ...)
+{
+        va_list ap;
+        int     ret = 0;
+
+        va_start (ap, fmt);
+        ret = xt_log_async_vput (domain, file, function, line, level,
+                                 sys_level, callingfn, fmt, ap);
+        va_end (ap);
+
+        return ret;
+}
+
+static void
+xt_log_async_write (struct xt_log_async *as, xt_log_rec_t *rec)
+{
+        struct tm  tm;
+        char       callstr[4096] = {0,};
+        char       msg[XT_LOG_TEXT_SIZE + 4096 + 128];
+        int        ret = 0;
+
+        if (rec->tv.tv_sec != as->last_sec) {
+                localtime_r (&rec->tv.tv_sec, &tm);
+                strftime (as->timestr, sizeof (as->timestr),
+                          "%Y-%m-%d %H:%M:%S", &tm);
+                as->last_sec = rec->tv.tv_sec;
+        }
+
+#if HAVE_BACKTRACE
+        if (rec->nbt) {
+                char **callingfn = NULL;
+
+                callingfn = backtrace_symbols (rec->bt, rec->nbt);
+                if (callingfn) {
+                        if (rec->nbt == 3)
+                                snprintf (callstr, 4096,
+                                          "(-->%s (-->%s (-->%s))) ",
+                                          callingfn[2], callingfn[1],
+                                          callingfn[0]);
+                        if (rec->nbt == 2)
+                                snprintf (callstr, 4096,
+                                          "(-->%s (-->%s)) ",
+                                          callingfn[1], callingfn[0]);
+                        if (rec->nbt == 1)
+                                snprintf (callstr, 4096, "(-->%s) ",
+                                          callingfn[0]);
+                        free (callingfn);
+                }
+        }
+#endif /* HAVE_BACKTRACE */
+
+        ret = snprintf (msg, sizeof (msg), "[%s.%"XT_PRI_SUSECONDS"] %s "
+                        "%.*s%s%s", as->timestr, rec->tv.tv_usec,
+                        xt_log_level_strings[rec->level], rec->off,
+                        rec->text, callstr, rec->text + rec->off);
+        if (ret < 0)
+                return;
+
+        if (xtlog->logfile)
+                fprintf (xtlog->logfile, "%s\n", msg);
+        else
+                fprintf (stderr, "%s\n", msg);
+
+        /* We want only serious log in 'syslog', not our debug
+           and trace logs */
+        if (xtlog->xt_log_syslog && rec->level &&
+            (rec->level <= rec->sys_level))
+                syslog ((rec->level - 1), "%s\n", msg);
+}
+
+/*
+ * write out the records of all the rings, and free the rings of the
+ * exited threads.
+ */
+static void
+xt_log_async_drain (struct xt_log_async *as)
+{
+        xt_log_ring_t *ring = NULL;
+        xt_log_ring_t *tmp = NULL;
+        unsigned long  head = 0;
+        unsigned long  tail = 0;
+        unsigned long  dropped = 0;
+        int            dead = 0;
+
+        LOCK (&as->lock);
+        LOCK (&xtlog->logfile_mutex);
+        xlist_for_each_entry_safe (ring, tmp, &as->rings, list) {
+                dead = __atomic_load_n (&ring->dead, __ATOMIC_ACQUIRE);
+                head = __atomic_load_n (&ring->head, __ATOMIC_ACQUIRE);
+                for (tail = ring->tail; tail != head; tail++)
+                        xt_log_async_write (as, &ring->recs[tail &
+                                            (XT_LOG_RING_SIZE - 1)]);
+                __atomic_store_n (&ring->tail, tail, __ATOMIC_RELEASE);
+
+                dropped = __atomic_exchange_n (&ring->dropped, 0,
+                                               __ATOMIC_RELAXED);
+                if (dropped) {
+                        if (xtlog->logfile)
+                                fprintf (xtlog->logfile, "[%s] W "
+                                         "[logging] %lu messages dropped, "
+                                         "log ring full\n", as->timestr,
+                                         dropped);
+                }
+
+                if (dead) {
+                        xlist_del (&ring->list);
+                        free (ring);
+                }
+        }
+
+        if (xtlog->logfile)
+                fflush (xtlog->logfile);
+        UNLOCK (&xtlog->logfile_mutex);
+        UNLOCK (&as->lock);
+}
+
+static void *
+xt_log_writer (void *arg)
+{
+        struct xt_log_async *as = arg;
+        struct timespec      ts;
+        int                  exiting = 0;
+
+        while (!exiting) {
+                clock_gettime (CLOCK_REALTIME, &ts);
+                ts.tv_nsec += XT_LOG_FLUSH_MS * 1000000L;
+                if (ts.tv_nsec >= 1000000000L) {
+                        ts.tv_sec++;
+                        ts.tv_nsec -= 1000000000L;
+                }
+
+                LOCK (&as->lock);
+                if (!as->exiting)
+                        pthread_cond_timedwait (&as->cond, &as->lock, &ts);
+                exiting = as->exiting;
+                UNLOCK (&as->lock);
+
+                xt_log_async_drain (as);
+        }
+
+        return NULL;
+}
+
+static void
+xt_log_async_atexit (void)
+{
+        xt_log_async_stop ();
+}
+
+int
+xt_log_async_start (void)
+{
+        struct xt_log_async *as = NULL;
+        int                  i = 0;
+        int                  ret = 0;
+
+        if (xtlog->async)
+                return 0;
+
+        as = XT_CALLOC (1, sizeof (*as));
+        if (!as)
+                return ENOMEM;
+
+        LOCK_INIT (&as->lock);
+        COND_INIT (&as->cond);
+        INIT_XLIST_HEAD (&as->rings);
+
+        /*
+         * block for the records that tell what went wrong, drop the
+         * chatter.
+         */
+        for (i = 0; i <= XT_LOG_TRACE; i++)
+                as->full[i] = (i <= XT_LOG_WARNING) ? XT_LOG_FULL_BLOCK :
+                        XT_LOG_FULL_DROP;
+
+        ret = pthread_key_create (&as->key, xt_log_ring_release);
+        if (ret)
+                goto err;
+
+        ret = pthread_create (&as->tid, NULL, xt_log_writer, as);
+        if (ret) {
+                pthread_key_delete (as->key);
+                goto err;
+        }
+
+        xtlog->async = as;
+        __atomic_store_n (&as->running, 1, __ATOMIC_RELEASE);
+        atexit (xt_log_async_atexit);
+        return 0;
+
+err:
+        COND_DESTROY (&as->cond);
+        LOCK_DESTROY (&as->lock);
+        XT_FREE (as);
+        return ret;
+}
+
+/*
+ * stop the writer and write out what is left, the rings are freed by
+ * xt_log_cleanup(). The new records are logged synchronously from now
+ * on, the last drain waits for the records being queued.
+ */
+void
+xt_log_async_stop (void)
+{
+        struct xt_log_async *as = NULL;
+        xt_log_ring_t       *ring = NULL;
+
+        if (!xtlog || !xtlog->async)
+                return;
+
+        as = xtlog->async;
+        if (!__atomic_exchange_n (&as->running, 0, __ATOMIC_SEQ_CST))
+                return;
+
+        LOCK (&as->lock);
+        as->exiting = 1;
+        COND_SIGNAL (&as->cond);
+        UNLOCK (&as->lock);
+
+        pthread_join (as->tid, NULL);
+
+        LOCK (&as->lock);
+        xlist_for_each_entry (ring, &as->rings, list) {
+                while (__atomic_load_n (&ring->busy, __ATOMIC_SEQ_CST))
+                        sched_yield ();
+        }
+        UNLOCK (&as->lock);
+
+        xt_log_async_drain (as);
+}
+
+void
+xt_log_set_full_policy (xt_loglevel_t level, xt_log_full_t policy)
+{
+        if (!xtlog->async || level > XT_LOG_TRACE)
+                return;
+
+        xtlog->async->full[level] = policy;
+}
+
+
 void
 xt_log_cleanup (void)
 {
+        struct xt_log_async *as = xtlog->async;
+        xt_log_ring_t       *ring = NULL;
+        xt_log_ring_t       *tmp = NULL;
+
+        if (as) {
+                xt_log_async_stop ();
+                xlist_for_each_entry_safe (ring, tmp, &as->rings, list) {
+                        xlist_del (&ring->list);
+                        free (ring);
+                }
+                pthread_key_delete (as->key);
+                COND_DESTROY (&as->cond);
+                LOCK_DESTROY (&as->lock);
+                XT_FREE (as);
+        }
+
         LOCK_DESTROY(&xtlog->logfile_mutex);
 	XT_FREE(xtlog);
 	xtlog = NULL;
@@ -174,7 +791,7 @@ _xt_log_nomem (const char *domain, const char *file,
         char            timestr[256];
         char            callstr[4096];
 
-	loglevel = xtlog->loglevel;
+	loglevel = xt_log_get_domain_level (domain);
 
         if (level > loglevel)
                 goto out;
@@ -198,6 +815,11 @@ _xt_log_nomem (const char *domain, const char *file,
                 return -1;
         }
 
+        if (!xt_log_async_put (domain, file, function, line, level,
+                               XT_LOG_ERROR, 1, "no memory available for "
+                               "size (%"XT_PRI_SIZET")", size))
+                goto out;
+
 #if HAVE_BACKTRACE
         /* Print 'calling function' */
         do {
@@ -287,7 +909,7 @@ _xt_log_callingfn (const char *domain, const char *file, const char *function,
         xt_loglevel_t   loglevel = 0;
         va_list         ap;
 
-	loglevel = xtlog->loglevel;
+	loglevel = xt_log_get_domain_level (domain);
 
         if (level > loglevel)
                 goto out;
@@ -311,6 +933,13 @@ _xt_log_callingfn (const char *domain, const char *file, const char *function,
                 return -1;
         }
 
+        va_start (ap, fmt);
+        ret = xt_log_async_vput (domain, file, function, line, level,
+                                 XT_LOG_CRITICAL, 1, fmt, ap);
+        va_end (ap);
+        if (!ret)
+                goto out;
+
 #if HAVE_BACKTRACE
         /* Print 'calling function' */
         do {
@@ -424,7 +1053,7 @@ _xt_log (const char *domain, const char *file, const char *function, int line,
         size_t       len  = 0;
         int          ret  = 0;
 
-        if (level > xtlog->loglevel)
+        if (level > xt_log_get_domain_level (domain))
                 goto out;
 
         static char *level_strings[] = {"",  /* NONE */
@@ -446,6 +1075,13 @@ _xt_log (const char *domain, const char *file, const char *function, int line,
                 return -1;
         }
 
+        va_start (ap, fmt);
+        ret = xt_log_async_vput (domain, file, function, line, level,
+                                 XT_LOG_CRITICAL, 0, fmt, ap);
+        va_end (ap);
+        if (!ret)
+                goto out;
+
         ret = gettimeofday (&tv, NULL);
         if (-1 == ret)
                 goto out;
@@ -29,13 +29,135 @@
 #include "logging.h"
 #include <stdlib.h>
 #include <stdarg.h>
+#include <time.h>
+#include <sys/mman.h>
 
 #define XT_MEM_POOL_XLIST_BOUNDARY        (sizeof(struct xlist_head))
 #define XT_MEM_POOL_PAD_BOUNDARY         (XT_MEM_POOL_XLIST_BOUNDARY + sizeof(int))
-#define mem_pool_chunkhead2ptr(head)     ((head) + XT_MEM_POOL_PAD_BOUNDARY)
-#define mem_pool_ptr2chunkhead(ptr)      ((ptr) - XT_MEM_POOL_PAD_BOUNDARY)
+#define mem_pool_chunkhead2ptr(pool, head)  ((head) + (pool)->chunk_off)
+#define mem_pool_ptr2chunkhead(pool, ptr)   ((ptr) - (pool)->chunk_off)
 #define is_mem_chunk_in_use(ptr)         (*ptr == 1)
 
+#define MEM_CACHE_LINE          64
+#define MEM_HUGEPAGE_SIZE       (2 * 1024 * 1024)
+#define MEM_BITS_PER_LONG       (8 * sizeof (unsigned long))
+
+static inline struct mem_slab *
+mem_slab_of (struct mem_pool *pool, void *ptr)
+{
+        return (void *)((unsigned long)ptr & ~(pool->slab_size - 1));
+}
+
+/*
+ * mark the chunk of @ptr in use, the flag is in the chunk header or in
+ * the bitmap of the slab for the cache aligned pools.
+ */
+static inline void
+mem_chunk_take (struct mem_pool *pool, void *ptr)
+{
+        struct mem_slab *slab = NULL;
+        unsigned long    i = 0;
+        int             *in_use = NULL;
+
+        if (!(pool->flags & MEM_POOL_CACHE_ALIGNED)) {
+                in_use = mem_pool_ptr2chunkhead (pool, ptr) +
+                        XT_MEM_POOL_XLIST_BOUNDARY;
+                *in_use = 1;
+                return;
+        }
+
+        slab = mem_slab_of (pool, ptr);
+        i = (ptr - slab->chunks) / pool->padded_sizeof_type;
+        __atomic_fetch_or (&slab->bitmap[i / MEM_BITS_PER_LONG],
+                           1UL << (i % MEM_BITS_PER_LONG), __ATOMIC_RELAXED);
+}
+
+/*
+ * clear the in use flag of the chunk, return 0 if it was not in use
+ */
+static inline int
+mem_chunk_release (struct mem_pool *pool, void *ptr)
+{
+        struct mem_slab *slab = NULL;
+        unsigned long    bit = 0;
+        unsigned long    i = 0;
+        int             *in_use = NULL;
+
+        if (!(pool->flags & MEM_POOL_CACHE_ALIGNED)) {
+                in_use = mem_pool_ptr2chunkhead (pool, ptr) +
+                        XT_MEM_POOL_XLIST_BOUNDARY;
+                if (!is_mem_chunk_in_use (in_use))
+                        return 0;
+                *in_use = 0;
+                return 1;
+        }
+
+        slab = mem_slab_of (pool, ptr);
+        i = (ptr - slab->chunks) / pool->padded_sizeof_type;
+        bit = 1UL << (i % MEM_BITS_PER_LONG);
+        return !!(__atomic_fetch_and (&slab->bitmap[i / MEM_BITS_PER_LONG],
+                                      ~bit, __ATOMIC_RELAXED) & bit);
+}
+
+/*
+ * huge page slab, from the reserved huge pages if any, otherwise an
+ * aligned mapping advised to be backed by transparent huge pages.
+ */
+static void *
+mem_slab_map (unsigned long size)
+{
+        void *addr = MAP_FAILED;
+        void *aligned = NULL;
+
+#ifdef MAP_HUGETLB
+        addr = mmap (NULL, size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (addr != MAP_FAILED) {
+                if (!((unsigned long)addr & (size - 1)))
+                        return addr;
+                munmap (addr, size);
+        }
+#endif
+
+        addr = mmap (NULL, size * 2, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (addr == MAP_FAILED)
+                return NULL;
+
+        aligned = (void *)(((unsigned long)addr + size - 1) & ~(size - 1));
+        if (aligned != addr)
+                munmap (addr, aligned - addr);
+        if (aligned + size != addr + size * 2)
+                munmap (aligned + size, addr + size * 2 - (aligned + size));
+
+#ifdef MADV_HUGEPAGE
+        madvise (aligned, size, MADV_HUGEPAGE);
+#endif
+        return aligned;
+}
+
+static void *
+mem_slab_alloc (struct mem_pool *pool)
+{
+        void *slab = NULL;
+
+        if (pool->flags & MEM_POOL_HUGEPAGE)
+                return mem_slab_map (pool->slab_size);
+
+        if (posix_memalign (&slab, pool->slab_size, pool->slab_size))
+                return NULL;
+        return slab;
+}
+
+static void
+mem_slab_dealloc (struct mem_pool *pool, void *slab)
+{
+        if (pool->flags & MEM_POOL_HUGEPAGE)
+                munmap (slab, pool->slab_size);
+        else
+                free (slab);
+}
+
 int
 xt_vasprintf (char **string_ptr, const char *format, va_list arg)
 {
@@ -74,48 +196,475 @@ xt_asprintf (char **string_ptr, const char *format, ...)
         return rv;
 }
 
+/*
+ * slab directory, an open addressing table of the slabs of the pool
+ * keyed by the slab address. The table is read without the lock by
+ * mem_put(), a lookup is marked in the magazine of the thread, or
+ * counted in the pool without a magazine. A replaced table is freed
+ * once no lookup is marked, the later lookups see the new table.
+ */
+#define MEM_SLAB_TOMB   ((struct mem_slab *)1)
+
+static inline unsigned long
+mem_slab_hash (struct mem_pool *pool, void *base, unsigned long size)
+{
+        unsigned long key = (unsigned long)base / pool->slab_size;
+
+        return (key * 0x9e3779b97f4a7c15UL) >> 17 & (size - 1);
+}
+
+static struct mem_slab *
+mem_slab_lookup (struct mem_pool *pool, struct mem_mag *mag, void *ptr)
+{
+        struct mem_slab_dir *dir = NULL;
+        struct mem_slab     *slab = NULL;
+        void                *base = NULL;
+        unsigned long        i = 0;
+
+        if (mag)
+                __atomic_store_n (&mag->lookup, 1, __ATOMIC_SEQ_CST);
+        else
+                __atomic_add_fetch (&pool->lookups, 1, __ATOMIC_SEQ_CST);
+
+        base = (void *)((unsigned long)ptr & ~(pool->slab_size - 1));
+        dir = __atomic_load_n (&pool->dir, __ATOMIC_SEQ_CST);
+
+        for (i = mem_slab_hash (pool, base, dir->size); ;
+             i = (i + 1) & (dir->size - 1)) {
+                slab = __atomic_load_n (&dir->slots[i], __ATOMIC_ACQUIRE);
+                if (slab == NULL || (void *)slab == base)
+                        break;
+        }
+
+        if (mag)
+                __atomic_store_n (&mag->lookup, 0, __ATOMIC_RELEASE);
+        else
+                __atomic_sub_fetch (&pool->lookups, 1, __ATOMIC_RELEASE);
+
+        return slab;
+}
+
+static int
+mem_slab_dir_add (struct mem_pool *pool, struct mem_slab *slab)
+{
+        struct mem_slab_dir *dir = pool->dir;
+        struct mem_slab_dir *ndir = NULL;
+        unsigned long        size = dir ? dir->size : MEM_SLAB_DIR_SIZE;
+        unsigned long        i = 0;
+        unsigned long        j = 0;
+
+        /*
+         * keep the table half empty, the tombstones are dropped by
+         * the rebuild.
+         */
+        if (!dir || (pool->nr_slabs + pool->nr_tombs + 1) * 2 > size) {
+                while ((pool->nr_slabs + 1) * 2 > size)
+                        size *= 2;
+
+                ndir = XT_CALLOC (1, sizeof (*ndir) +
+                                  size * sizeof (struct mem_slab *));
+                if (!ndir)
+                        return -1;
+                ndir->size = size;
+
+                for (i = 0; dir && i < dir->size; i++) {
+                        if (!dir->slots[i] || dir->slots[i] == MEM_SLAB_TOMB)
+                                continue;
+                        j = mem_slab_hash (pool, dir->slots[i], size);
+                        while (ndir->slots[j])
+                                j = (j + 1) & (size - 1);
+                        ndir->slots[j] = dir->slots[i];
+                }
+
+                ndir->retired = dir;
+                __atomic_store_n (&pool->dir, ndir, __ATOMIC_SEQ_CST);
+                pool->nr_tombs = 0;
+                dir = ndir;
+        }
+
+        i = mem_slab_hash (pool, slab, dir->size);
+        while (dir->slots[i] && dir->slots[i] != MEM_SLAB_TOMB)
+                i = (i + 1) & (dir->size - 1);
+        if (dir->slots[i] == MEM_SLAB_TOMB)
+                pool->nr_tombs--;
+        __atomic_store_n (&dir->slots[i], slab, __ATOMIC_RELEASE);
+        pool->nr_slabs++;
+        return 0;
+}
+
+static void
+mem_slab_dir_del (struct mem_pool *pool, struct mem_slab *slab)
+{
+        struct mem_slab_dir *dir = pool->dir;
+        unsigned long        i = 0;
+
+        i = mem_slab_hash (pool, slab, dir->size);
+        while (dir->slots[i] != slab)
+                i = (i + 1) & (dir->size - 1);
+
+        __atomic_store_n (&dir->slots[i], MEM_SLAB_TOMB, __ATOMIC_RELEASE);
+        pool->nr_slabs--;
+        pool->nr_tombs++;
+}
+
+/*
+ * add a slab of slab_chunks free chunks to the pool. The slab is
+ * aligned to its size, the slab of a chunk is found by masking the
+ * chunk address. Called with the lock held.
+ */
+static int
+mem_slab_new (struct mem_pool *pool, int reserved)
+{
+        struct mem_slab   *slab = NULL;
+        struct xlist_head *list = NULL;
+        void              *chunk = NULL;
+        int               *in_use = NULL;
+        int                i = 0;
+
+        slab = mem_slab_alloc (pool);
+        if (!slab)
+                return -1;
+
+        /*
+         * the header and the bitmap of the slab
+         */
+        memset (slab, 0, pool->slab_hdr);
+        INIT_XLIST_HEAD (&slab->free);
+        slab->chunks = (void *)slab + pool->slab_hdr;
+        slab->reserved = reserved;
+
+        if (mem_slab_dir_add (pool, slab)) {
+                mem_slab_dealloc (pool, slab);
+                return -1;
+        }
+
+        /*
+         * a free chunk of a cache aligned pool holds its list head
+         */
+        for (i = pool->slab_chunks - 1; i >= 0; i--) {
+                chunk = slab->chunks + i * pool->padded_sizeof_type;
+                list = chunk;
+                if (!(pool->flags & MEM_POOL_CACHE_ALIGNED)) {
+                        in_use = chunk + XT_MEM_POOL_XLIST_BOUNDARY;
+                        *in_use = 0;
+                }
+                xlist_add (list, &slab->free);
+        }
+        slab->nfree = pool->slab_chunks;
+
+        xlist_add_tail (&slab->list, &pool->slabs);
+        xlist_add_tail (&slab->plist, &pool->partial);
+        pool->cold_count += pool->slab_chunks;
+        return 0;
+}
+
+static void
+mem_slab_free (struct mem_pool *pool, struct mem_slab *slab)
+{
+        mem_slab_dir_del (pool, slab);
+        xlist_del (&slab->list);
+        xlist_del (&slab->plist);
+        pool->cold_count -= pool->slab_chunks;
+        mem_slab_dealloc (pool, slab);
+}
+
+/*
+ * free the replaced directories if no lookup is running, they are
+ * retried by the next reap otherwise. Called with the lock held.
+ */
+static void
+mem_slab_dir_reap (struct mem_pool *pool)
+{
+        struct mem_slab_dir *dir = pool->dir ? pool->dir->retired : NULL;
+        struct mem_slab_dir *next = NULL;
+        struct mem_mag      *mag = NULL;
+
+        if (!dir)
+                return;
+
+        if (__atomic_load_n (&pool->lookups, __ATOMIC_SEQ_CST))
+                return;
+        xlist_for_each_entry (mag, &pool->mags, list) {
+                if (__atomic_load_n (&mag->lookup, __ATOMIC_SEQ_CST))
+                        return;
+        }
+
+        pool->dir->retired = NULL;
+        while (dir) {
+                next = dir->retired;
+                XT_FREE (dir);
+                dir = next;
+        }
+}
+
+/*
+ * release the slabs grown on demand which stay free for MEM_SLAB_IDLE
+ * seconds. A free slab is stamped when it is first seen by the reaper.
+ * Called with the lock held.
+ */
+static void
+mem_slab_reap (struct mem_pool *pool)
+{
+        struct mem_slab *slab = NULL;
+        struct mem_slab *tmp = NULL;
+        time_t           now = 0;
+
+        if (++pool->reap_tick % MEM_SLAB_REAP_TICKS)
+                return;
+
+        now = time (NULL);
+        if (now < pool->reap_next)
+                return;
+        pool->reap_next = now + 1;
+
+        xlist_for_each_entry_safe (slab, tmp, &pool->slabs, list) {
+                if (slab->reserved || slab->nfree != pool->slab_chunks)
+                        continue;
+                if (!slab->idle_since)
+                        slab->idle_since = now;
+                else if (now - slab->idle_since >= MEM_SLAB_IDLE)
+                        mem_slab_free (pool, slab);
+        }
+
+        mem_slab_dir_reap (pool);
+}
+
+/*
+ * take a free chunk, the pool grows by a slab if all the chunks are
+ * taken. Called with the lock held.
+ */
+static void *
+mem_pool_take (struct mem_pool *pool)
+{
+        struct mem_slab   *slab = NULL;
+        struct xlist_head *list = NULL;
+
+        if (xlist_empty (&pool->partial) && mem_slab_new (pool, 0)) {
+                xt_log ("mem-pool", XT_LOG_ERROR, "failed to grow mem "
+                        "pool %p", pool);
+                return NULL;
+        }
+
+        slab = xlist_entry (pool->partial.next, struct mem_slab, plist);
+        list = slab->free.next;
+        xlist_del (list);
+        if (--slab->nfree == 0)
+                xlist_del_init (&slab->plist);
+        slab->idle_since = 0;
+
+        pool->hot_count++;
+        pool->cold_count--;
+        return mem_pool_chunkhead2ptr (pool, (void *)list);
+}
+
+/*
+ * give back a chunk of the pool. The slabs which were full go to the
+ * tail of the partial list, the chunks are taken from the older slabs
+ * first and the slabs grown on demand drain. Called with the lock held.
+ */
+static void
+mem_pool_give (struct mem_pool *pool, void *ptr)
+{
+        struct mem_slab *slab = NULL;
+
+        slab = mem_slab_of (pool, ptr);
+        xlist_add (mem_pool_ptr2chunkhead (pool, ptr), &slab->free);
+        if (slab->nfree++ == 0)
+                xlist_add_tail (&slab->plist, &pool->partial);
+
+        pool->hot_count--;
+        pool->cold_count++;
+}
+
+/*
+ * move n chunks from the bottom of the magazine to the pool, the
+ * recently put chunks stay in the magazine. Called with the lock held.
+ */
+static void
+mem_mag_flush (struct mem_pool *pool, struct mem_mag *mag, int n)
+{
+        int i = 0;
+
+        for (i = 0; i < n; i++)
+                mem_pool_give (pool, mag->chunks[i]);
+
+        mag->count -= n;
+        memmove (mag->chunks, mag->chunks + n, mag->count * sizeof (void *));
+}
+
+/*
+ * move up to MEM_MAG_BATCH chunks of the pool to the empty magazine.
+ * Called with the lock held.
+ */
+static void
+mem_mag_refill (struct mem_pool *pool, struct mem_mag *mag)
+{
+        void *ptr = NULL;
+
+        while (mag->count < MEM_MAG_BATCH) {
+                ptr = mem_pool_take (pool);
+                if (!ptr)
+                        break;
+                mag->chunks[mag->count++] = ptr;
+        }
+}
+
+/*
+ * thread exit, the chunks of the magazine go back to the pool
+ */
+static void
+mem_mag_release (void *data)
+{
+        struct mem_mag  *mag = data;
+        struct mem_pool *pool = mag->pool;
+
+        LOCK (&pool->lock);
+        mem_mag_flush (pool, mag, mag->count);
+        xlist_del (&mag->list);
+        UNLOCK (&pool->lock);
+
+        XT_FREE (mag);
+}
+
+/*
+ * the magazine of the calling thread, NULL if the pool has no
+ * magazines.
+ */
+static struct mem_mag *
+mem_mag_get (struct mem_pool *pool)
+{
+        struct mem_mag *mag = NULL;
+
+        if (pool->flags & MEM_POOL_NO_MAGAZINE)
+                return NULL;
+
+        mag = pthread_getspecific (pool->mag_key);
+        if (mag)
+                return mag;
+
+        mag = XT_CALLOC (1, sizeof (*mag));
+        if (!mag)
+                return NULL;
+
+        mag->pool = pool;
+        if (pthread_setspecific (pool->mag_key, mag)) {
+                XT_FREE (mag);
+                return NULL;
+        }
+
+        LOCK (&pool->lock);
+        xlist_add (&mag->list, &pool->mags);
+        UNLOCK (&pool->lock);
+
+        return mag;
+}
+
 struct mem_pool *
 mem_pool_new (unsigned long sizeof_type,
                  unsigned long count)
+{
+        return mem_pool_new_flags (sizeof_type, count, 0);
+}
+
+struct mem_pool *
+mem_pool_new_flags (unsigned long sizeof_type,
+                    unsigned long count, int flags)
 {
         struct mem_pool  *mem_pool = NULL;
         unsigned long     padded_sizeof_type = 0;
-        void             *pool = NULL;
-        int               i = 0;
-        struct xlist_head *list = NULL;
+        unsigned long     chunk_off = XT_MEM_POOL_PAD_BOUNDARY;
+        unsigned long     align = sizeof (void *);
+        unsigned long     slab_hdr = 0;
+        unsigned long     slab_size = MEM_SLAB_SIZE;
+        unsigned long     chunks = 0;
+        unsigned long     i = 0;
 
         if (!sizeof_type || !count) {
                 xt_log ("mem-pool", XT_LOG_ERROR, "invalid argument");
                 return NULL;
         }
-        padded_sizeof_type = sizeof_type + XT_MEM_POOL_PAD_BOUNDARY;
+
+        /*
+         * the chunks of a cache aligned pool have no header, a free
+         * chunk holds its list head and the in use flags are in the
+         * bitmap of the slab.
+         */
+        if (flags & MEM_POOL_CACHE_ALIGNED) {
+                align = MEM_CACHE_LINE;
+                chunk_off = 0;
+                padded_sizeof_type = (sizeof_type + MEM_CACHE_LINE - 1) &
+                        ~(MEM_CACHE_LINE - 1);
+        } else {
+                padded_sizeof_type = sizeof_type + XT_MEM_POOL_PAD_BOUNDARY;
+        }
+
+        /*
+         * only a pool of a huge page at least is backed by huge pages
+         */
+        if ((flags & MEM_POOL_HUGEPAGE) &&
+            count * padded_sizeof_type < MEM_HUGEPAGE_SIZE)
+                flags &= ~MEM_POOL_HUGEPAGE;
+        if (flags & MEM_POOL_HUGEPAGE)
+                slab_size = MEM_HUGEPAGE_SIZE;
+
+        /*
+         * a slab holds one chunk at least, the header is followed
+         * by the bitmap of the cache aligned pools.
+         */
+        for (;;) {
+                chunks = (slab_size - sizeof (struct mem_slab)) /
+                        padded_sizeof_type;
+                while (chunks) {
+                        slab_hdr = sizeof (struct mem_slab);
+                        if (flags & MEM_POOL_CACHE_ALIGNED)
+                                slab_hdr += (chunks + MEM_BITS_PER_LONG - 1) /
+                                        MEM_BITS_PER_LONG *
+                                        sizeof (unsigned long);
+                        slab_hdr = (slab_hdr + align - 1) & ~(align - 1);
+                        if (slab_hdr + chunks * padded_sizeof_type <=
+                            slab_size)
+                                break;
+                        chunks--;
+                }
+                if (chunks)
+                        break;
+                slab_size *= 2;
+        }
 
         mem_pool = XT_CALLOC (1, sizeof (*mem_pool));
         if (!mem_pool)
                 return NULL;
 
         LOCK_INIT (&mem_pool->lock);
-        INIT_XLIST_HEAD (&mem_pool->list);
+        INIT_XLIST_HEAD (&mem_pool->slabs);
+        INIT_XLIST_HEAD (&mem_pool->partial);
+        INIT_XLIST_HEAD (&mem_pool->mags);
 
         mem_pool->padded_sizeof_type = padded_sizeof_type;
-        mem_pool->cold_count = count;
         mem_pool->real_sizeof_type = sizeof_type;
-
-        pool = XT_CALLOC (count, padded_sizeof_type);
-        if (!pool) {
-                XT_FREE (mem_pool);
-                return NULL;
+        mem_pool->chunk_off = chunk_off;
+        mem_pool->flags = flags;
+        mem_pool->slab_size = slab_size;
+        mem_pool->slab_hdr = slab_hdr;
+        mem_pool->slab_chunks = chunks;
+
+        if (!(flags & MEM_POOL_NO_MAGAZINE) &&
+            pthread_key_create (&mem_pool->mag_key, mem_mag_release)) {
+                xt_log ("mem-pool", XT_LOG_WARNING, "no magazine for "
+                        "the pool, out of thread keys");
+                mem_pool->flags |= MEM_POOL_NO_MAGAZINE;
         }
 
-        for (i = 0; i < count; i++) {
-                list = pool + (i * (padded_sizeof_type));
-                INIT_XLIST_HEAD (list);
-                xlist_add_tail (list, &mem_pool->list);
+        /*
+         * the slabs for count chunks stay with the pool
+         */
+        for (i = 0; i < count; i += mem_pool->slab_chunks) {
+                if (mem_slab_new (mem_pool, 1)) {
+                        mem_pool_destroy (mem_pool);
+                        return NULL;
+                }
         }
 
-        mem_pool->pool = pool;
-        mem_pool->pool_end = pool + (count * (padded_sizeof_type));
-
         return mem_pool;
 }
 
@@ -140,61 +689,58 @@ mem_get0 (struct mem_pool *mem_pool)
 void *
 mem_get (struct mem_pool *mem_pool)
 {
-        struct xlist_head *list = NULL;
+        struct mem_mag   *mag = NULL;
         void             *ptr = NULL;
-        int             *in_use = NULL;
 
         if (!mem_pool) {
                 xt_log ("mem-pool", XT_LOG_ERROR, "invalid argument");
                 return NULL;
         }
 
-        LOCK (&mem_pool->lock);
-        {
-                if (mem_pool->cold_count) {
-                        list = mem_pool->list.next;
-                        xlist_del (list);
-
-                        mem_pool->hot_count++;
-                        mem_pool->cold_count--;
-
-                        ptr = list;
-                        in_use = (ptr + XT_MEM_POOL_XLIST_BOUNDARY);
-                        *in_use = 1;
-			
-
-                        goto fwd_addr_out;
+        mag = mem_mag_get (mem_pool);
+        if (mag) {
+                if (!mag->count) {
+                        LOCK (&mem_pool->lock);
+                        mem_mag_refill (mem_pool, mag);
+                        UNLOCK (&mem_pool->lock);
                 }
 
-                ptr = MALLOC (mem_pool->real_sizeof_type);
+                if (!mag->count)
+                        return NULL;
 
-                /* Memory coming from the heap need not be transformed from a
-                 * chunkhead to a usable pointer since it is not coming from
-                 * the pool.
-                 */
-                goto unlocked_out;
+                ptr = mag->chunks[--mag->count];
+                goto out;
         }
-fwd_addr_out:
-        ptr = mem_pool_chunkhead2ptr (ptr);
-unlocked_out:
+
+        LOCK (&mem_pool->lock);
+        ptr = mem_pool_take (mem_pool);
         UNLOCK (&mem_pool->lock);
 
+        if (!ptr)
+                return NULL;
+out:
+        mem_chunk_take (mem_pool, ptr);
         return ptr;
 }
 
 
 static int
-__is_member (struct mem_pool *pool, void *ptr)
+__is_member (struct mem_pool *pool, struct mem_mag *mag, void *ptr)
 {
+        struct mem_slab *slab = NULL;
+
         if (!pool || !ptr) {
                 xt_log ("mem-pool", XT_LOG_ERROR, "invalid argument");
                 return -1;
         }
 
-        if (ptr < pool->pool || ptr >= pool->pool_end)
+        slab = mem_slab_lookup (pool, mag, ptr);
+        if (!slab || ptr < slab->chunks + pool->chunk_off ||
+            ptr >= slab->chunks + pool->slab_chunks *
+            pool->padded_sizeof_type)
                 return 0;
 
-        if ((mem_pool_ptr2chunkhead (ptr) - pool->pool)
+        if ((mem_pool_ptr2chunkhead (pool, ptr) - slab->chunks)
             % pool->padded_sizeof_type)
                 return -1;
 
@@ -205,59 +751,62 @@ __is_member (struct mem_pool *pool, void *ptr)
 void
 mem_put (struct mem_pool *pool, void *ptr)
 {
-        struct xlist_head *list = NULL;
-        int    *in_use = NULL;
-        void   *head = NULL;
+        struct mem_mag *mag = NULL;
 
         if (!pool || !ptr) {
                 xt_log ("mem-pool", XT_LOG_ERROR, "invalid argument");
                 return;
         }
 
-        LOCK (&pool->lock);
+        mag = mem_mag_get (pool);
+        switch (__is_member (pool, mag, ptr))
         {
+        case 1:
+                if (!mem_chunk_release (pool, ptr)) {
+                        xt_log ("mem-pool", XT_LOG_CRITICAL,
+                                "mem_put called on freed ptr %p of mem "
+                                "pool %p", ptr, pool);
+                        return;
+                }
+                break;
+        case -1:
+                /* For some reason, the address given is within
+                 * the address range of the mem-pool but does not align
+                 * with the expected start of a chunk that includes
+                 * the list headers also. Sounds like a problem in
+                 * layers of clouds up above us. ;)
+                 */
+                abort ();
+                return;
+        case 0:
+                /* The address is outside the slabs of the mem-pool,
+                 * the programmer has made a mistake by calling the
+                 * wrong de-allocation interface.
+                 */
+                FREE (ptr);
+                return;
+        default:
+                /* log error */
+                return;
+        }
 
-                switch (__is_member (pool, ptr))
-                {
-                case 1:
-                        list = head = mem_pool_ptr2chunkhead (ptr);
-                        in_use = (head + XT_MEM_POOL_XLIST_BOUNDARY);
-                        if (!is_mem_chunk_in_use(in_use)) {
-                                xt_log ("mem-pool", XT_LOG_CRITICAL,
-					"mem_put called on freed ptr %p of mem "
-					"pool %p", ptr, pool);
-                                break;
-                        }
-                        pool->hot_count--;
-                        pool->cold_count++;
-                        *in_use = 0;
-                        xlist_add (list, &pool->list);
-                        break;
-                case -1:
-                        /* For some reason, the address given is within
-                         * the address range of the mem-pool but does not align
-                         * with the expected start of a chunk that includes
-                         * the list headers also. Sounds like a problem in
-                         * layers of clouds up above us. ;)
-                         */
-                        abort ();
-                        break;
-                case 0:
-                        /* The address is outside the range of the mem-pool. We
-                         * assume here that this address was allocated at a
-                         * point when the mem-pool was out of chunks in mem_get
-                         * or the programmer has made a mistake by calling the
-                         * wrong de-allocation interface. We do
-                         * not have enough info to distinguish between the two
-                         * situations.
-                         */
-                        FREE (ptr);
-                        break;
-                default:
-                        /* log error */
-                        break;
+        /*
+         * the chunks of the pool go to the magazine without the lock
+         */
+        if (mag) {
+                if (mag->count == MEM_MAG_SIZE) {
+                        LOCK (&pool->lock);
+                        mem_mag_flush (pool, mag, MEM_MAG_BATCH);
+                        mem_slab_reap (pool);
+                        UNLOCK (&pool->lock);
                 }
+                mag->chunks[mag->count++] = ptr;
+                return;
         }
+
+        LOCK (&pool->lock);
+        mem_pool_give (pool, ptr);
+        mem_slab_reap (pool);
         UNLOCK (&pool->lock);
 }
 
@@ -265,11 +814,36 @@ mem_put (struct mem_pool *pool, void *ptr)
 void
 mem_pool_destroy (struct mem_pool *pool)
 {
+        struct mem_slab_dir *dir = NULL;
+        struct mem_slab *slab = NULL;
+        struct mem_slab *stmp = NULL;
+        struct mem_mag *mag = NULL;
+        struct mem_mag *tmp = NULL;
+
         if (!pool)
                 return;
 
+        /*
+         * the threads still running drop their magazines with the key
+         */
+        if (!(pool->flags & MEM_POOL_NO_MAGAZINE)) {
+                pthread_key_delete (pool->mag_key);
+                xlist_for_each_entry_safe (mag, tmp, &pool->mags, list) {
+                        xlist_del (&mag->list);
+                        XT_FREE (mag);
+                }
+        }
+
+        xlist_for_each_entry_safe (slab, stmp, &pool->slabs, list)
+                mem_slab_dealloc (pool, slab);
+
+        while (pool->dir) {
+                dir = pool->dir;
+                pool->dir = dir->retired;
+                XT_FREE (dir);
+        }
+
         LOCK_DESTROY (&pool->lock);
-        XT_FREE (pool->pool);
         XT_FREE (pool);
 
         return;
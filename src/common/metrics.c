@@ -0,0 +1,669 @@
+/*
+ * Copyright (c) 2016 XTAO Technology <www.xtaotech.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "mem.h"
+#include "logging.h"
+#include "stats.h"
+#include "hunter.h"
+#include "processor.h"
+#include "metrics.h"
+
+#define MH_METRICS "MH_METRICS"
+
+#define METRICS_IO_TIMEOUT	1 /* seconds, per client */
+#define METRICS_POLL_INTERVAL	500 /* ms, to check the exiting flag */
+#define METRICS_REQ_MAX		4096
+
+struct metrics_buf {
+	char *data;
+	int len;
+	int size;
+	int failed;
+};
+
+static void metrics_printf(struct metrics_buf *b, const char *fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+
+static void metrics_printf(struct metrics_buf *b, const char *fmt, ...)
+{
+	va_list ap;
+	char *data = NULL;
+	int n = 0;
+
+	if (b->failed)
+		return;
+
+	for (;;) {
+		va_start(ap, fmt);
+		n = vsnprintf(b->data + b->len, b->size - b->len, fmt, ap);
+		va_end(ap);
+
+		if (n < 0) {
+			b->failed = 1;
+			return;
+		}
+
+		if (b->len + n < b->size) {
+			b->len += n;
+			return;
+		}
+
+		data = XT_REALLOC(b->data, b->size * 2 + n);
+		if (data == NULL) {
+			b->failed = 1;
+			return;
+		}
+		b->data = data;
+		b->size = b->size * 2 + n;
+	}
+}
+
+/*
+ * samples of a summary from the histogram, @stage is NULL for the
+ * summary without label
+ */
+static void metrics_quantiles(struct metrics_buf *b, const char *metric,
+    const char *stage, const xt_hist_t *h)
+{
+	static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+	char label[128] = "";
+	unsigned int i = 0;
+
+	for (i = 0; i < sizeof(quantiles) / sizeof(quantiles[0]); i++) {
+		metrics_printf(b, "%s{%s%s%squantile=\"%g\"} %.9f\n",
+		    metric, stage ? "stage=\"" : "", stage ? stage : "",
+		    stage ? "\"," : "", quantiles[i],
+		    xt_hist_percentile(h, quantiles[i] * 100) / 1e9);
+	}
+
+	if (stage)
+		snprintf(label, sizeof(label), "{stage=\"%s\"}", stage);
+
+	metrics_printf(b, "%s_sum%s %.9f\n", metric, label, h->sum / 1e9);
+	metrics_printf(b, "%s_count%s %llu\n", metric, label,
+	    (unsigned long long)h->count);
+}
+
+/*
+ * the samples of a metric family must be grouped, every family is
+ * emitted for all the stages at once.
+ */
+static void metrics_summary(struct metrics_buf *b, const char *metric,
+    processor_t *pl, stage_hist_t *hist, size_t offset)
+{
+	int s = 0;
+
+	metrics_printf(b, "# TYPE %s summary\n", metric);
+	for (s = 0; s < pl->stage_count; s++) {
+		metrics_quantiles(b, metric, pl->stages_desc[s].stage_name,
+		    (const xt_hist_t *)((char *)&hist[s] + offset));
+	}
+}
+
+#define METRICS_STAGE(b, pl, stat, type, metric, fmt, field) do {	\
+	int __s = 0;							\
+	metrics_printf(b, "# TYPE " metric " " type "\n");		\
+	for (__s = 0; __s < (pl)->stage_count; __s++)			\
+		metrics_printf(b, metric "{stage=\"%s\"} " fmt "\n",	\
+		    (pl)->stages_desc[__s].stage_name, stat[__s].field);	\
+} while (0)
+
+static void metrics_render_processor(struct metrics_buf *b,
+    processor_t *pl)
+{
+	stage_hist_t *hist = NULL;
+	stage_stat_t *stat = NULL;
+	lag_hist_t *lag = NULL;
+	uint64_t age = 0;
+	int window = pl->window;
+	int inflight = pl->inflight;
+	int i = 0;
+
+	metrics_printf(b, "# TYPE metahunter_outstanding_window gauge\n"
+	    "metahunter_outstanding_window %d\n", window);
+	metrics_printf(b, "# TYPE metahunter_outstanding_min gauge\n"
+	    "metahunter_outstanding_min %d\n", pl->outstanding_min);
+	metrics_printf(b, "# TYPE metahunter_outstanding_max gauge\n"
+	    "metahunter_outstanding_max %d\n", pl->outstanding_max);
+	metrics_printf(b, "# TYPE metahunter_outstanding_ops gauge\n"
+	    "metahunter_outstanding_ops %d\n", inflight);
+	metrics_printf(b, "# TYPE metahunter_credit_available gauge\n"
+	    "metahunter_credit_available %d\n",
+	    window > inflight ? window - inflight : 0);
+	metrics_printf(b, "# TYPE metahunter_credit_stalls_total counter\n"
+	    "metahunter_credit_stalls_total %llu\n", pl->credit_stalls);
+
+	/*
+	 * the pool lock is not taken, the counts are hints
+	 */
+	metrics_printf(b, "# TYPE metahunter_mem_pool_hot gauge\n"
+	    "metahunter_mem_pool_hot{pool=\"op\"} %d\n",
+	    pl->op_pool->hot_count);
+	metrics_printf(b, "# TYPE metahunter_mem_pool_cold gauge\n"
+	    "metahunter_mem_pool_cold{pool=\"op\"} %d\n",
+	    pl->op_pool->cold_count);
+
+	stat = XT_CALLOC(pl->stage_count, sizeof(stage_stat_t));
+	hist = XT_CALLOC(pl->stage_count, sizeof(stage_hist_t));
+	lag = XT_MALLOC(sizeof(lag_hist_t));
+	if (stat == NULL || hist == NULL || lag == NULL) {
+		b->failed = 1;
+		goto out;
+	}
+
+	for (i = 0; i < pl->stage_count; i++) {
+		if (processor_stage_stat(pl, i, &stat[i], &hist[i])) {
+			b->failed = 1;
+			goto out;
+		}
+	}
+
+	METRICS_STAGE(b, pl, stat, "gauge", "metahunter_stage_queued",
+	    "%u", nb_unprocessed_entries);
+	METRICS_STAGE(b, pl, stat, "gauge", "metahunter_stage_current",
+	    "%u", nb_current_entries);
+	METRICS_STAGE(b, pl, stat, "counter",
+	    "metahunter_stage_processed_total", "%llu", total_processed);
+	METRICS_STAGE(b, pl, stat, "counter",
+	    "metahunter_stage_batches_total", "%llu", nb_batches);
+	METRICS_STAGE(b, pl, stat, "counter",
+	    "metahunter_stage_batched_ops_total", "%llu",
+	    total_batched_entries);
+
+	metrics_printf(b, "# TYPE metahunter_stage_busy_seconds_total "
+	    "counter\n");
+	for (i = 0; i < pl->stage_count; i++) {
+		metrics_printf(b, "metahunter_stage_busy_seconds_total"
+		    "{stage=\"%s\"} %ld.%06ld\n", pl->stages_desc[i].stage_name,
+		    (long)stat[i].total_processing_time.tv_sec,
+		    (long)stat[i].total_processing_time.tv_usec);
+	}
+
+	metrics_summary(b, "metahunter_stage_wait_seconds", pl, hist,
+	    offsetof(stage_hist_t, wait));
+	metrics_summary(b, "metahunter_stage_service_seconds", pl, hist,
+	    offsetof(stage_hist_t, service));
+	metrics_summary(b, "metahunter_stage_blocked_seconds", pl, hist,
+	    offsetof(stage_hist_t, blocked));
+
+	/*
+	 * replication lag from the journal entry being held
+	 */
+	age = processor_lag_stat(pl, lag);
+	metrics_printf(b, "# TYPE metahunter_lag_seconds gauge\n"
+	    "metahunter_lag_seconds %.3f\n", age / 1e9);
+	metrics_printf(b, "# TYPE metahunter_lag_admit_seconds summary\n");
+	metrics_quantiles(b, "metahunter_lag_admit_seconds", NULL,
+	    &lag->admit);
+	metrics_printf(b, "# TYPE metahunter_lag_commit_seconds summary\n");
+	metrics_quantiles(b, "metahunter_lag_commit_seconds", NULL,
+	    &lag->commit);
+	metrics_printf(b, "# TYPE metahunter_lag_release_seconds summary\n");
+	metrics_quantiles(b, "metahunter_lag_release_seconds", NULL,
+	    &lag->release);
+out:
+	XT_FREE(stat);
+	XT_FREE(hist);
+	XT_FREE(lag);
+}
+
+/*
+ * progress of the namespace scan
+ */
+static void metrics_render_scan(struct metrics_buf *b, scan_ctrl_t *scan)
+{
+	metrics_printf(b, "# TYPE metahunter_scan_dirs_total counter\n"
+	    "metahunter_scan_dirs_total %llu\n", scan->dirs);
+	metrics_printf(b, "# TYPE metahunter_scan_entries_total counter\n"
+	    "metahunter_scan_entries_total %llu\n", scan->entries);
+	metrics_printf(b, "# TYPE metahunter_scan_errors_total counter\n"
+	    "metahunter_scan_errors_total %llu\n", scan->errors);
+	metrics_printf(b, "# TYPE metahunter_scan_open_dirs gauge\n"
+	    "metahunter_scan_open_dirs %d\n", scan->open_dirs);
+	metrics_printf(b, "# TYPE metahunter_scan_queued_dirs gauge\n"
+	    "metahunter_scan_queued_dirs %ld\n", scan->queued_dirs);
+	metrics_printf(b, "# TYPE metahunter_scan_walkers gauge\n"
+	    "metahunter_scan_walkers %d\n", scan->walkers);
+	metrics_printf(b, "# TYPE metahunter_scan_bulk_loaded_total counter\n"
+	    "metahunter_scan_bulk_loaded_total %llu\n", scan->loaded);
+	metrics_printf(b, "# TYPE metahunter_scan_bulk_batches_total counter\n"
+	    "metahunter_scan_bulk_batches_total %llu\n", scan->batches);
+}
+
+int metrics_render(struct metahunter *info, char **text)
+{
+	struct metrics_buf b;
+	unsigned long long read = 0;
+	unsigned long long committed = 0;
+
+	memset(&b, 0, sizeof(b));
+	b.size = 4096;
+	b.data = XT_MALLOC(b.size);
+	if (b.data == NULL)
+		return -1;
+
+	/*
+	 * the reader counters are updated without lock, they are
+	 * read once and the lag is computed from the copies
+	 */
+	read = info->last_read_record;
+	committed = info->last_committed_record;
+
+	metrics_printf(&b, "# TYPE metahunter_records_read_total counter\n"
+	    "metahunter_records_read_total %llu\n", info->nb_read);
+	metrics_printf(&b, "# TYPE metahunter_last_read_time_seconds gauge\n"
+	    "metahunter_last_read_time_seconds %ld\n",
+	    (long)info->last_read_time);
+	metrics_printf(&b, "# TYPE metahunter_last_read_record gauge\n"
+	    "metahunter_last_read_record %llu\n", read);
+	metrics_printf(&b, "# TYPE metahunter_last_pushed_record gauge\n"
+	    "metahunter_last_pushed_record %llu\n", info->last_pushed);
+	metrics_printf(&b, "# TYPE metahunter_last_committed_record gauge\n"
+	    "metahunter_last_committed_record %llu\n", committed);
+	metrics_printf(&b, "# TYPE metahunter_last_cleared_record gauge\n"
+	    "metahunter_last_cleared_record %llu\n",
+	    info->last_cleared_record);
+	metrics_printf(&b, "# TYPE metahunter_records_skipped_total counter\n"
+	    "metahunter_records_skipped_total %llu\n", info->nb_skipped);
+	metrics_printf(&b, "# TYPE metahunter_records_dropped_total counter\n"
+	    "metahunter_records_dropped_total %llu\n", info->nb_dropped);
+	if (info->checkpoint)
+		metrics_printf(&b, "# TYPE metahunter_checkpoint_record "
+		    "gauge\nmetahunter_checkpoint_record %llu\n",
+		    (unsigned long long)info->checkpoint->stored);
+	metrics_printf(&b, "# TYPE metahunter_lag_records gauge\n"
+	    "metahunter_lag_records %llu\n",
+	    read > committed ? read - committed : 0);
+
+	if (info->scan)
+		metrics_render_scan(&b, info->scan);
+
+	if (info->processor && info->processor->stages)
+		metrics_render_processor(&b, info->processor);
+
+	if (b.failed) {
+		XT_FREE(b.data);
+		return -1;
+	}
+
+	*text = b.data;
+	return b.len;
+}
+
+static int metrics_send(int fd, const char *data, int len)
+{
+	ssize_t n = 0;
+
+	while (len > 0) {
+		n = send(fd, data, len, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		data += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+/*
+ * read the request header of the HTTP client and return the path of
+ * its GET, 1 for other methods.
+ */
+static int metrics_http_request(int fd, char *path, int size)
+{
+	char req[METRICS_REQ_MAX + 1];
+	char *end = NULL;
+	ssize_t n = 0;
+	int len = 0;
+
+	while (len < METRICS_REQ_MAX) {
+		n = recv(fd, req + len, METRICS_REQ_MAX - len, 0);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+
+		len += n;
+		req[len] = '\0';
+		if (strstr(req, "\r\n\r\n") || strstr(req, "\n\n"))
+			break;
+	}
+
+	req[len] = '\0';
+	if (strncmp(req, "GET /", 5))
+		return 1;
+
+	end = strchr(req + 4, ' ');
+	if (end == NULL || end - (req + 4) >= size)
+		return 1;
+
+	memcpy(path, req + 4, end - (req + 4));
+	path[end - (req + 4)] = '\0';
+	return 0;
+}
+
+/*
+ * GET /loglevel lists the log levels, GET /loglevel?DOMAIN=LEVEL&...
+ * sets the level of the domains first, "default" is the global level
+ * and NONE drops the level of a domain.
+ */
+static int metrics_loglevel(char *query, char *text, int size)
+{
+	xt_loglevel_t level = XT_LOG_NONE;
+	char *save = NULL;
+	char *arg = NULL;
+	char *val = NULL;
+
+	for (arg = strtok_r(query, "&", &save); arg;
+	    arg = strtok_r(NULL, "&", &save)) {
+		val = strchr(arg, '=');
+		if (val == NULL)
+			return -1;
+		*val++ = '\0';
+
+		level = xt_str2loglvl(val);
+		if (strcasecmp(xt_loglvl2str(level), val))
+			return -1;
+
+		if (!strcmp(arg, "default")) {
+			xt_log_set_loglevel(level);
+		} else if (xt_log_set_domain_level(arg, level)) {
+			return -1;
+		}
+
+		xt_log(MH_METRICS, XT_LOG_NOTICE, "log level of %s set to %s",
+		    arg, xt_loglvl2str(level));
+	}
+
+	return xt_log_domain_levels(text, size);
+}
+
+static void metrics_serve(metrics_server_t *ms, int listen_fd, int http)
+{
+	struct timeval tv = {METRICS_IO_TIMEOUT, 0};
+	char header[256];
+	char path[256];
+	char levels[2048];
+	char *text = NULL;
+	int len = 0;
+	int fd = -1;
+	int ret = 0;
+
+	fd = accept(listen_fd, NULL, NULL);
+	if (fd < 0)
+		return;
+
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+	if (http) {
+		ret = metrics_http_request(fd, path, sizeof(path));
+		if (ret < 0)
+			goto out;
+
+		if (ret == 0 && !strncmp(path, "/loglevel", 9) &&
+		    (path[9] == '\0' || path[9] == '?')) {
+			len = metrics_loglevel(path[9] ? path + 10 : path + 9,
+			    levels, sizeof(levels));
+			if (len < 0) {
+				len = snprintf(header, sizeof(header),
+				    "HTTP/1.0 400 Bad Request\r\n"
+				    "Content-Length: 0\r\n\r\n");
+				metrics_send(fd, header, len);
+				goto out;
+			}
+
+			ret = snprintf(header, sizeof(header),
+			    "HTTP/1.0 200 OK\r\n"
+			    "Content-Type: text/plain\r\n"
+			    "Content-Length: %d\r\n\r\n", len);
+			if (!metrics_send(fd, header, ret))
+				metrics_send(fd, levels, len);
+			goto out;
+		}
+
+		if (ret > 0 || (strcmp(path, "/metrics") && strcmp(path, "/"))) {
+			len = snprintf(header, sizeof(header),
+			    "HTTP/1.0 404 Not Found\r\n"
+			    "Content-Length: 0\r\n\r\n");
+			metrics_send(fd, header, len);
+			goto out;
+		}
+	}
+
+	len = metrics_render(ms->info, &text);
+	if (len < 0) {
+		xt_log(MH_METRICS, XT_LOG_WARNING, "failed to render metrics");
+		if (http) {
+			len = snprintf(header, sizeof(header),
+			    "HTTP/1.0 500 Internal Server Error\r\n"
+			    "Content-Length: 0\r\n\r\n");
+			metrics_send(fd, header, len);
+		}
+		goto out;
+	}
+
+	if (http) {
+		ret = snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\n"
+		    "Content-Type: text/plain; version=0.0.4\r\n"
+		    "Content-Length: %d\r\n\r\n", len);
+		if (metrics_send(fd, header, ret))
+			goto out;
+	}
+
+	metrics_send(fd, text, len);
+out:
+	XT_FREE(text);
+	close(fd);
+}
+
+static void *metrics_thr(void *arg)
+{
+	metrics_server_t *ms = (metrics_server_t *)arg;
+	struct pollfd fds[2];
+	int nfds = 0;
+	int i = 0;
+
+	xt_log(MH_METRICS, XT_LOG_INFO, "metrics server started");
+
+	if (ms->sock_fd >= 0) {
+		fds[nfds].fd = ms->sock_fd;
+		fds[nfds].events = POLLIN;
+		nfds++;
+	}
+
+	if (ms->http_fd >= 0) {
+		fds[nfds].fd = ms->http_fd;
+		fds[nfds].events = POLLIN;
+		nfds++;
+	}
+
+	while (!ms->exiting) {
+		if (poll(fds, nfds, METRICS_POLL_INTERVAL) <= 0)
+			continue;
+
+		for (i = 0; i < nfds; i++) {
+			if (fds[i].revents & POLLIN)
+				metrics_serve(ms, fds[i].fd,
+				    fds[i].fd == ms->http_fd);
+		}
+	}
+
+	return NULL;
+}
+
+static int metrics_listen_unix(const char *path)
+{
+	struct sockaddr_un addr;
+	int fd = -1;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		xt_log(MH_METRICS, XT_LOG_ERROR, "metrics socket path %s too "
+		    "long", path);
+		return -1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		goto err;
+
+	/*
+	 * left by a previous run
+	 */
+	unlink(path);
+
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+	    listen(fd, 8))
+		goto err;
+
+	return fd;
+err:
+	xt_log(MH_METRICS, XT_LOG_ERROR, "failed to listen on %s: %s", path,
+	    strerror(errno));
+	if (fd >= 0)
+		close(fd);
+	return -1;
+}
+
+static int metrics_listen_http(int port)
+{
+	struct sockaddr_in addr;
+	int one = 1;
+	int fd = -1;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		goto err;
+
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+	    listen(fd, 8))
+		goto err;
+
+	return fd;
+err:
+	xt_log(MH_METRICS, XT_LOG_ERROR, "failed to listen on port %d: %s",
+	    port, strerror(errno));
+	if (fd >= 0)
+		close(fd);
+	return -1;
+}
+
+int metrics_start(metrics_server_t *ms, struct metahunter *info)
+{
+	ms->info = info;
+	ms->sock_fd = -1;
+	ms->http_fd = -1;
+	ms->exiting = 0;
+
+	if (ms->sock_path) {
+		ms->sock_fd = metrics_listen_unix(ms->sock_path);
+		if (ms->sock_fd < 0)
+			goto err;
+	}
+
+	if (ms->http_port) {
+		ms->http_fd = metrics_listen_http(ms->http_port);
+		if (ms->http_fd < 0)
+			goto err;
+	}
+
+	if (ms->sock_fd < 0 && ms->http_fd < 0)
+		return 0;
+
+	if (pthread_create(&ms->tid, NULL, metrics_thr, ms)) {
+		xt_log(MH_METRICS, XT_LOG_ERROR, "failed to create metrics "
+		    "thread");
+		goto err;
+	}
+	ms->running = 1;
+
+	return 0;
+err:
+	if (ms->sock_fd >= 0) {
+		close(ms->sock_fd);
+		unlink(ms->sock_path);
+		ms->sock_fd = -1;
+	}
+	if (ms->http_fd >= 0) {
+		close(ms->http_fd);
+		ms->http_fd = -1;
+	}
+	return -1;
+}
+
+void metrics_stop(metrics_server_t *ms)
+{
+	void *ret = NULL;
+
+	/*
+	 * the hunter is stopped either by the reader or by signal
+	 */
+	if (!__sync_bool_compare_and_swap(&ms->running, 1, 0))
+		return;
+
+	ms->exiting = 1;
+	pthread_join(ms->tid, &ret);
+
+	if (ms->sock_fd >= 0) {
+		close(ms->sock_fd);
+		unlink(ms->sock_path);
+		ms->sock_fd = -1;
+	}
+
+	if (ms->http_fd >= 0) {
+		close(ms->http_fd);
+		ms->http_fd = -1;
+	}
+
+	xt_log(MH_METRICS, XT_LOG_INFO, "metrics server stopped");
+}
@@ -0,0 +1,277 @@
+/*
+ * Copyright (c) 2016 XTAO Technology <www.xtaotech.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "mem.h"
+#include "logging.h"
+#include "xlist.h"
+#include "obj-table.h"
+
+#define OBJTBL "obj_table"
+
+#define OBJ_TBL_MIN_SLOTS	64
+
+/*
+ * the table is never filled over 3/4, there is always a free slot
+ * to terminate the probing.
+ */
+static inline int obj_tbl_full(unsigned int mask, unsigned int count)
+{
+	return count > ((mask + 1) >> 2) * 3;
+}
+
+static unsigned int obj_tbl_slots(unsigned int min, unsigned int count)
+{
+	unsigned int slots = min;
+
+	while (slots < count * 2)
+		slots <<= 1;
+
+	return slots;
+}
+
+static op_obj_t *obj_slot_find(op_obj_t *slots, unsigned int mask, ino_t ino)
+{
+	unsigned int i = obj_hash(ino) & mask;
+
+	for (;;) {
+		op_obj_t *s = &slots[i];
+
+		if (s->slot == OBJ_SLOT_FREE)
+			return NULL;
+		if (s->slot == OBJ_SLOT_USED && s->obj == ino)
+			return s;
+		i = (i + 1) & mask;
+	}
+}
+
+static op_obj_t *obj_slot_alloc(op_obj_t *slots, unsigned int mask, ino_t ino,
+    unsigned int *dead)
+{
+	unsigned int i = obj_hash(ino) & mask;
+
+	while (slots[i].slot == OBJ_SLOT_USED)
+		i = (i + 1) & mask;
+
+	if (slots[i].slot == OBJ_SLOT_DEAD)
+		(*dead)--;
+
+	return &slots[i];
+}
+
+/*
+ * release a slot. The slot is marked dead, unless the probing of
+ * other objects can not pass it, in which case it is freed together
+ * with the dead slots just before it.
+ */
+static void obj_slot_release(op_obj_t *slots, unsigned int mask, op_obj_t *s,
+    unsigned int *dead)
+{
+	unsigned int i = s - slots;
+
+	if (slots[(i + 1) & mask].slot != OBJ_SLOT_FREE) {
+		s->slot = OBJ_SLOT_DEAD;
+		(*dead)++;
+		return;
+	}
+
+	s->slot = OBJ_SLOT_FREE;
+	i = (i - 1) & mask;
+	while (slots[i].slot == OBJ_SLOT_DEAD) {
+		slots[i].slot = OBJ_SLOT_FREE;
+		(*dead)--;
+		i = (i - 1) & mask;
+	}
+}
+
+/*
+ * move the object to another slot, the pending list head is embedded
+ * in the object, fix up the neighbours.
+ */
+static void obj_relocate(op_obj_t *dst, op_obj_t *src)
+{
+	*dst = *src;
+	if (xlist_empty(&src->pending)) {
+		INIT_XLIST_HEAD(&dst->pending);
+	} else {
+		dst->pending.next->prev = &dst->pending;
+		dst->pending.prev->next = &dst->pending;
+	}
+}
+
+static void obj_tbl_migrate(obj_table_t *tbl, unsigned int count)
+{
+	op_obj_t *s = NULL;
+	op_obj_t *d = NULL;
+
+	while (tbl->old && count--) {
+		s = &tbl->old[tbl->old_pos];
+		if (s->slot == OBJ_SLOT_USED) {
+			d = obj_slot_alloc(tbl->slots, tbl->mask, s->obj,
+			    &tbl->dead);
+			obj_relocate(d, s);
+			s->slot = OBJ_SLOT_DEAD;
+			tbl->used++;
+			tbl->old_used--;
+		}
+
+		if (tbl->old_pos++ == tbl->old_mask) {
+			XT_FREE(tbl->old);
+			tbl->old = NULL;
+			tbl->old_mask = 0;
+			tbl->old_pos = 0;
+		}
+	}
+}
+
+obj_table_t *obj_tbl_new(unsigned int expected)
+{
+	obj_table_t *tbl = NULL;
+	unsigned int slots = obj_tbl_slots(OBJ_TBL_MIN_SLOTS, expected);
+
+	tbl = XT_CALLOC(1, sizeof(obj_table_t));
+	if (tbl == NULL)
+		return NULL;
+
+	tbl->slots = XT_CALLOC(slots, sizeof(op_obj_t));
+	if (tbl->slots == NULL) {
+		XT_FREE(tbl);
+		return NULL;
+	}
+	tbl->mask = slots - 1;
+	tbl->min_slots = slots;
+
+	return tbl;
+}
+
+void obj_tbl_destroy(obj_table_t *tbl)
+{
+	if (tbl == NULL)
+		return;
+
+	if (tbl->used || tbl->old_used)
+		xt_log(OBJTBL, XT_LOG_WARNING, "destroy table with %u "
+		    "outstanding objects.", tbl->used + tbl->old_used);
+
+	XT_FREE(tbl->old);
+	XT_FREE(tbl->slots);
+	XT_FREE(tbl);
+}
+
+op_obj_t *obj_tbl_get(obj_table_t *tbl, ino_t ino)
+{
+	op_obj_t *obj = obj_slot_find(tbl->slots, tbl->mask, ino);
+
+	if (obj == NULL && tbl->old)
+		obj = obj_slot_find(tbl->old, tbl->old_mask, ino);
+
+	return obj;
+}
+
+/*
+ * insert a zeroed object of the inode, the caller makes sure it is
+ * not in the table yet and reserved the room by obj_tbl_maint().
+ */
+op_obj_t *obj_tbl_insert(obj_table_t *tbl, ino_t ino)
+{
+	op_obj_t *obj = obj_slot_alloc(tbl->slots, tbl->mask, ino, &tbl->dead);
+
+	memset(obj, 0, sizeof(*obj));
+	obj->obj = ino;
+	obj->slot = OBJ_SLOT_USED;
+	INIT_XLIST_HEAD(&obj->pending);
+	tbl->used++;
+
+	return obj;
+}
+
+void obj_tbl_remove(obj_table_t *tbl, op_obj_t *obj)
+{
+	unsigned int dead = 0;
+
+	if (obj >= tbl->slots && obj <= &tbl->slots[tbl->mask]) {
+		obj_slot_release(tbl->slots, tbl->mask, obj, &tbl->dead);
+		tbl->used--;
+	} else {
+		/*
+		 * dead slots of the old table are dropped with it
+		 */
+		obj_slot_release(tbl->old, tbl->old_mask, obj, &dead);
+		tbl->old_used--;
+	}
+}
+
+/*
+ * move a few objects from the old table, and make sure there is room
+ * for the next @room insertions. A new table is allocated when the
+ * slots are running out, at least twice the live objects, and never
+ * smaller than the initial size, so a table full of dead slots is
+ * rebuilt at the same size. Returns -1 if the table can not be grown,
+ * no insertion must be done then.
+ */
+int obj_tbl_maint(obj_table_t *tbl, unsigned int room)
+{
+	op_obj_t *slots = NULL;
+	unsigned int count = 0;
+
+	obj_tbl_migrate(tbl, OBJ_TBL_MIGRATE);
+
+	if (!obj_tbl_full(tbl->mask,
+	    tbl->used + tbl->dead + tbl->old_used + room))
+		return 0;
+
+	/*
+	 * the previous table is not drained yet, finish it now
+	 */
+	obj_tbl_migrate(tbl, tbl->old_mask + 1);
+
+	count = obj_tbl_slots(tbl->min_slots, tbl->used + room);
+	slots = XT_CALLOC(count, sizeof(op_obj_t));
+	if (slots == NULL) {
+		xt_log(OBJTBL, XT_LOG_ERROR, "failed to resize the table "
+		    "of %u slots.", tbl->mask + 1);
+		return -1;
+	}
+
+	tbl->old = tbl->slots;
+	tbl->old_mask = tbl->mask;
+	tbl->old_used = tbl->used;
+	tbl->old_pos = 0;
+
+	tbl->slots = slots;
+	tbl->mask = count - 1;
+	tbl->used = 0;
+	tbl->dead = 0;
+
+	xt_log(OBJTBL, XT_LOG_DEBUG, "resize the table from %u to %u "
+	    "slots, %u objects.", tbl->old_mask + 1, tbl->mask + 1,
+	    tbl->old_used);
+
+	return 0;
+}
@@ -27,20 +27,23 @@
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <errno.h>
 #include <libgen.h>
 #include <pthread.h>
-#include <semaphore.h>
+#include <sched.h>
 #include <dlfcn.h>
 #include <netdb.h>
 #include <fnmatch.h>
+#include <limits.h>
 
 #include "common.h"
 #include "mem.h"
 #include "logging.h"
 #include "xlist.h"
-#include "hashfn.h"
-#include "rbthash.h"
+#include "obj-table.h"
+#include "stats.h"
+#include "trace.h"
 #include "filesystem.h"
 #include "database.h"
 #include "processor.h"
@@ -113,40 +116,262 @@ out:
 	return ret;
 }
 
-static void entry_push(processor_t *pl, entry_proc_op_t *op)
+/*
+ * shard of the object, the high bits of the hash select the shard,
+ * the object table of the shard indexes the slots with the low bits.
+ */
+static inline pipeline_shard_t *stage_shard(pipeline_stage_t *stage,
+    ino_t ino)
+{
+	uint32_t h = obj_hash(ino);
+
+	return &stage->shards[((uint64_t)h * stage->shard_count) >> 32];
+}
+
+/*
+ * lock the shards of the object and its parent, the shard with the
+ * lower index is locked first. @b could be NULL or the same as @a.
+ */
+static void shard_lock2(pipeline_shard_t *a, pipeline_shard_t *b)
+{
+	if (b == NULL || a == b) {
+		LOCK(&a->mutex);
+	} else if (a < b) {
+		LOCK(&a->mutex);
+		LOCK(&b->mutex);
+	} else {
+		LOCK(&b->mutex);
+		LOCK(&a->mutex);
+	}
+}
+
+static void shard_unlock2(pipeline_shard_t *a, pipeline_shard_t *b)
+{
+	if (b && a != b)
+		UNLOCK(&b->mutex);
+	UNLOCK(&a->mutex);
+}
+
+/*
+ * the worker running on the current thread, NULL for the journal
+ * reader and other threads pushing ops to the processor.
+ */
+static __thread worker_info_t *entry_cur_worker;
+
+/*
+ * wake up to @wakeup idle workers of the group after ops of its
+ * stages are made runnable.
+ *
+ * an idle worker sets its parked word and counts itself idle with
+ * full barriers before the last scan of the queues, the barrier here
+ * pairs with it so either the worker sees the op or we see the worker.
+ * The waker clears the parked word of the worker it picks, so every
+ * idle worker is woken by one waker only.
+ */
+static void entry_kick_group(processor_t *pl, worker_group_t *group,
+    int wakeup)
+{
+	worker_info_t *worker = NULL;
+	unsigned int start = 0;
+	unsigned int i = 0;
+
+	if (!wakeup)
+		return;
+
+	__sync_synchronize();
+	if (!group->idle)
+		return;
+
+	if (entry_cur_worker && entry_cur_worker->group == group)
+		start = entry_cur_worker->index - group->first + 1;
+
+	for (i = 0; i < group->count && wakeup > 0; i++) {
+		worker = &pl->workers[group->first +
+		    (start + i) % group->count];
+		if (!worker->parked ||
+		    !__sync_bool_compare_and_swap(&worker->parked, 1, 0))
+			continue;
+
+		atomic_dec(&group->idle);
+		XT_FUTEX_WAKE(&worker->parked, 1);
+		wakeup--;
+	}
+}
+
+/*
+ * queue the runnable op. A worker keeps the ops it makes runnable in
+ * its own deque, the objects are still hot in its cache, idle workers
+ * of the group steal from the deque. The ops pushed by other threads,
+ * or by the workers of another group, are queued at the tail of the
+ * shard ready queue. The caller holds the shard mutex.
+ */
+static inline void entry_ready(pipeline_shard_t *shard, entry_proc_op_t *op)
+{
+	worker_info_t *worker = entry_cur_worker;
+
+	if (worker && worker_serves_stage(worker, op->stage) &&
+	    !wsdeque_push(&worker->deque, op))
+		return;
+
+	xlist_add_tail(&op->list, &shard->ready);
+	shard->queued++;
+}
+
+/*
+ * the op is merged with later ops of the object, it is not necessary
+ * to wait any more. Dequeue it from the pending list and let a worker
+ * run its post handler without invoking the stage function.
+ */
+static void entry_skip(pipeline_shard_t *shard, entry_proc_op_t *op)
+{
+	op->can_skip = 1;
+	MH_TRACE(MH_TR_SKIP, op, op->id, op->stage, 0);
+
+	if (!op->wait_parent_add && !op->wait_obj_proc && !op->wait_chld_del)
+		return;
+
+	op->wait_parent_add = 0;
+	op->wait_obj_proc = 0;
+	op->wait_chld_del = 0;
+	xlist_del_init(&op->waitq);
+
+	xt_log(MHPROC, XT_LOG_TRACE, "skip pending op: %p", op);
+	op->ts_ready = xt_now_ns();
+	entry_ready(shard, op);
+}
+
+/*
+ * the object state changed, resume the ops pending on the object.
+ *
+ * children creation ops waiting for the directory are resumed as soon
+ * as the directory is created. The ops about the object itself are
+ * resumed in the order of arriving, at most one of them can proceed
+ * at the same time.
+ *
+ * return the number of resumed ops. The caller holds the mutex of
+ * the shard of the object.
+ */
+static int entry_obj_kick(pipeline_shard_t *shard, op_obj_t *obj)
+{
+	entry_proc_op_t *o = NULL;
+	entry_proc_op_t *t = NULL;
+	int blocked = 0;
+	int wakeup = 0;
+
+	xlist_for_each_entry_safe(o, t, &obj->pending, waitq) {
+		if (o->wait_parent_add) {
+			if (obj->being_created)
+				continue;
+
+			o->wait_parent_add = 0;
+		} else {
+			if (blocked)
+				continue;
+
+			if (obj->being_proceed || obj->being_created) {
+				blocked = 1;
+				continue;
+			}
+
+			if (o->op == op_rmdir && obj->deleting_children) {
+				/*
+				 * children deletion is still outstanding
+				 */
+				o->wait_obj_proc = 0;
+				o->wait_chld_del = 1;
+				blocked = 1;
+				continue;
+			}
+
+			o->wait_obj_proc = 0;
+			o->wait_chld_del = 0;
+			o->proceeding = 1;
+			obj->being_proceed = 1;
+			blocked = 1;
+		}
+
+		xlist_del_init(&o->waitq);
+		o->woke_up = 1;
+		o->ts_ready = xt_now_ns();
+		entry_ready(shard, o);
+		wakeup++;
+		MH_TRACE(MH_TR_RESUME, o, o->id, o->stage, 0);
+
+		xt_log(MHPROC, XT_LOG_TRACE, "object %lu wakeup op: %p",
+		    obj->obj, o);
+	}
+
+	return wakeup;
+}
+
+/*
+ * return 1 if the op references the parent object at the stage
+ */
+static inline int entry_ref_parent(entry_proc_op_t *op)
+{
+	return op->op == op_create || op->op == op_mkdir ||
+	    op->op == op_unlink || op->op == op_rmdir;
+}
+
+/*
+ * back off of a push when the object table can not grow
+ */
+#define PL_OBJ_RETRY_US		1000
+
+static int entry_push(processor_t *pl, entry_proc_op_t *op)
 {
 	op_obj_t *obj = NULL;
  	pipeline_stage_t *stage = &pl->stages[op->stage];
-	ino_t parentid = op->pid;
+	step_valid_op_function_t validate = pl->stages_desc[op->stage].valid_op;
+	pipeline_shard_t *shard = stage_shard(stage, op->id);
+	pipeline_shard_t *pshard = NULL;
 	op_obj_t *parent = NULL;
+	int ready = 0;
+
+	if (entry_ref_parent(op))
+		pshard = stage_shard(stage, op->pid);
+
+	op->claim = PL_OP_FREE;
+	op->ts_push = xt_now_ns();
+
+	/*
+	 * an op inserts the object and its parent at most, reserve
+	 * the room before looking up the tables. If a table can not
+	 * grow, back off out of the locks and retry, the op is already
+	 * admitted and has nowhere else to go.
+	 */
+	for (;;) {
+		shard_lock2(shard, pshard);
+		if (obj_tbl_maint(shard->obj_tbl, 2) == 0 &&
+		    (!pshard || pshard == shard ||
+		     obj_tbl_maint(pshard->obj_tbl, 1) == 0))
+			break;
+		shard_unlock2(shard, pshard);
+
+		xt_log(MHPROC, XT_LOG_WARNING, "no room for object %lu at "
+		    "stage:%d, retry.", op->id, op->stage);
+		usleep(PL_OBJ_RETRY_US);
+	}
 
-	LOCK(&stage->mutex);
-	xlist_add_tail(&op->list, &stage->entries);
 	/*
-	 * search wether the object exists in rbtree at the current stage
+	 * search wether the object exists in the table at the current stage
 	 * if the object exists which means there are outstanding ops
 	 * about the object at current stage.
 	 */
-	obj = rbthash_get(stage->obj_tbl, &op->id, sizeof(op->id));
+	obj = obj_tbl_get(shard->obj_tbl, op->id);
 	if (obj == NULL) {
-		obj = mem_get0(pl->obj_pool);
-		INIT_XLIST_HEAD(&obj->pending);
-		rbthash_insert(stage->obj_tbl, obj, &op->id, sizeof(op->id));
-		obj->obj = op->id;
+		obj = obj_tbl_insert(shard->obj_tbl, op->id);
 		xt_log(MHPROC, XT_LOG_TRACE, "object: %lu does not exist at "
-		       "stage:%d create rbentry :%p.", op->id, op->stage, obj);
+		       "stage:%d create entry :%p.", op->id, op->stage, obj);
 	} else {
 		xt_log(MHPROC, XT_LOG_TRACE, "object: %lu has outstanding, "
 		    "op at stage: %d already.", op->id, op->stage);		
 	}
 
 	obj->ref++;
-	stage->outstanding++;
-	op->obj = obj;
 
-	xt_log(MHPROC, XT_LOG_TRACE, "stage:%d object %lu ref %u, stage "
-	    "outstanding %d.", op->stage, op->id, obj->ref,
-	    stage->outstanding);
+	xt_log(MHPROC, XT_LOG_TRACE, "stage:%d object %lu ref %u.",
+	    op->stage, op->id, obj->ref);
 
 	/*
 	 * set mark for obj or parent according the op
@@ -155,6 +380,8 @@ static void entry_push(processor_t *pl, entry_proc_op_t *op)
 	case op_create:
 	case op_mkdir:
 		obj->being_created = 1;
+		if (stage->coalesce)
+			obj->creator = op;
 		break;
 	case op_unlink:
 	case op_rmdir:
@@ -165,17 +392,13 @@ static void entry_push(processor_t *pl, entry_proc_op_t *op)
 		 * deleting. increase the deleting children
 		 * counter.
 		 */
-		parent = rbthash_get(stage->obj_tbl, &parentid, sizeof(ino_t));
+		parent = obj_tbl_get(pshard->obj_tbl, op->pid);
 		if (parent == NULL) {
 			/*
 			 * If parent is NULL, create a parent obj
 			 * and reference the parent for unlink/rmdir
 			 */
-			parent = mem_get0(pl->obj_pool);
-			INIT_XLIST_HEAD(&parent->pending);
-			rbthash_insert(stage->obj_tbl, parent, &parentid, sizeof(ino_t));
-			parent->obj = parentid;
-			
+			parent = obj_tbl_insert(pshard->obj_tbl, op->pid);
 		}
 		parent->deleting_children++;
 		parent->ref++;
@@ -183,7 +406,213 @@ static void entry_push(processor_t *pl, entry_proc_op_t *op)
 	default:
 		break;
 	}
-	UNLOCK(&stage->mutex);	
+
+	/*
+	 * the ops are validated in the order of arriving. The op either
+	 * joins the ready queue, or is suspended in a pending list and
+	 * resumed by the post handler of the op it depends on.
+	 */
+	if (!validate || validate(stage, op) == 1 || op->can_skip) {
+		op->ts_ready = op->ts_push;
+		entry_ready(shard, op);
+		ready = 1;
+	}
+
+	shard_unlock2(shard, pshard);
+
+	MH_TRACE(MH_TR_PUSH, op, op->id, op->stage, ready);
+	return ready;
+}
+
+/*
+ * count the op in the lag bucket of the second it is held in. A
+ * bucket still used by the ops of an older second keeps its epoch, the
+ * new ops are counted as old ones, the age of the oldest op stays
+ * right. It only happens with an op outstanding for PL_LAG_BUCKETS
+ * seconds.
+ */
+static void entry_lag_enter(processor_t *pl, entry_proc_op_t *op)
+{
+	uint64_t epoch = op->ts_hold / 1000000000ULL;
+	lag_bucket_t *b = NULL;
+
+	op->lag_bucket = epoch % PL_LAG_BUCKETS;
+	b = &pl->lag_buckets[op->lag_bucket];
+
+	if (b->epoch != epoch &&
+	    __atomic_load_n(&b->inflight, __ATOMIC_ACQUIRE) == 0)
+		__atomic_store_n(&b->epoch, epoch, __ATOMIC_RELEASE);
+
+	atomic_inc(&b->inflight);
+}
+
+/*
+ * the op leaves the pipeline, account its replication lag
+ */
+static void entry_lag_leave(processor_t *pl, entry_proc_op_t *op)
+{
+	worker_info_t *worker = entry_cur_worker;
+	uint64_t now = 0;
+
+	atomic_dec(&pl->lag_buckets[op->lag_bucket].inflight);
+
+	if (worker == NULL)
+		return;
+
+	now = xt_now_ns();
+	xt_hist_record(&worker->lag->admit, op->ts_admit - op->ts_hold);
+	if (op->ts_applied)
+		xt_hist_record(&worker->lag->commit,
+		    op->ts_applied - op->ts_hold);
+	xt_hist_record(&worker->lag->release, now - op->ts_hold);
+}
+
+/*
+ * take a credit of the outstanding ops window, sleep until an op
+ * leaves the pipeline or the window grows.
+ */
+static void entry_credit_get(processor_t *pl)
+{
+	int inflight = 0;
+	int gen = 0;
+	int waited = 0;
+
+	for (;;) {
+		gen = __atomic_load_n(&pl->credit_gen, __ATOMIC_ACQUIRE);
+		inflight = __atomic_load_n(&pl->inflight, __ATOMIC_ACQUIRE);
+
+		if (inflight < __atomic_load_n(&pl->window, __ATOMIC_ACQUIRE)) {
+			if (__sync_bool_compare_and_swap(&pl->inflight,
+			    inflight, inflight + 1))
+				break;
+			continue;
+		}
+
+		if (!waited) {
+			/*
+			 * recheck the window after being counted as a
+			 * waiter, the waker checks the waiters after
+			 * releasing the credit.
+			 */
+			atomic_inc(&pl->credit_waiters);
+			atomic_inc(&pl->credit_stalls);
+			waited = 1;
+			continue;
+		}
+
+		XT_FUTEX_WAIT(&pl->credit_gen, gen);
+	}
+
+	if (waited)
+		atomic_dec(&pl->credit_waiters);
+}
+
+static void entry_credit_wake(processor_t *pl, int n)
+{
+	if (__atomic_load_n(&pl->credit_waiters, __ATOMIC_SEQ_CST) == 0)
+		return;
+
+	atomic_inc(&pl->credit_gen);
+	XT_FUTEX_WAKE(&pl->credit_gen, n);
+}
+
+/*
+ * adapt the window every PL_CREDIT_INTERVAL, AIMD on the service time
+ * of the stages:
+ *  + the service time per op goes PL_CREDIT_LAT_FACTOR times above
+ *    the lowest one seen, the database is saturated, or more than
+ *    half of the ops wait for other ops, a larger window only adds
+ *    dependency tracking. Shrink the window by a quarter.
+ *  + otherwise if the pusher waited for credit, the window is too
+ *    small to hide the latency. Grow it by the worker count.
+ */
+#define PL_CREDIT_INTERVAL	100000000ULL /* 100ms */
+#define PL_CREDIT_LAT_FACTOR	2
+
+static void entry_credit_adapt(processor_t *pl, uint64_t now)
+{
+	credit_ctl_t *ctl = &pl->ctl;
+	stage_worker_stat_t *st = NULL;
+	unsigned long long taken = 0;
+	unsigned long long blocked = 0;
+	unsigned long long serviced = 0;
+	unsigned long long service_ns = 0;
+	unsigned long long stalls = 0;
+	uint64_t next = ctl->next;
+	uint64_t lat = 0;
+	int window = 0;
+	int old = 0;
+	int i = 0;
+	int j = 0;
+
+	if (now < next || !__sync_bool_compare_and_swap(&ctl->next, next,
+	    now + PL_CREDIT_INTERVAL))
+		return;
+
+	for (i = 0; i < pl->nr_workers; i++) {
+		for (j = 0; j < pl->stage_count; j++) {
+			st = &pl->workers[i].stats[j];
+			taken += st->taken;
+			blocked += st->hist.blocked.count;
+			serviced += st->hist.service.count;
+			service_ns += st->hist.service.sum;
+		}
+	}
+	stalls = pl->credit_stalls;
+	old = window = pl->window;
+
+	if (serviced > ctl->serviced) {
+		lat = (service_ns - ctl->service_ns) /
+		    (serviced - ctl->serviced);
+		if (ctl->base_ns == 0 || lat < ctl->base_ns)
+			ctl->base_ns = lat;
+		else
+			/*
+			 * forget the lowest one slowly, the database
+			 * could be slower for good
+			 */
+			ctl->base_ns += (lat - ctl->base_ns) / 32;
+	}
+
+	if ((lat && lat > ctl->base_ns * PL_CREDIT_LAT_FACTOR) ||
+	    (blocked - ctl->blocked) * 2 > taken - ctl->taken) {
+		window -= window / 4;
+		if (window < pl->outstanding_min)
+			window = pl->outstanding_min;
+	} else if (stalls > ctl->stalls) {
+		window += pl->nr_workers;
+		if (window > pl->outstanding_max)
+			window = pl->outstanding_max;
+	}
+
+	ctl->taken = taken;
+	ctl->blocked = blocked;
+	ctl->serviced = serviced;
+	ctl->service_ns = service_ns;
+	ctl->stalls = stalls;
+
+	if (window == old)
+		return;
+
+	xt_log(MHPROC, XT_LOG_TRACE, "outstanding window %d -> %d, service "
+	    "%lluns base %lluns", old, window, (unsigned long long)lat,
+	    (unsigned long long)ctl->base_ns);
+
+	__atomic_store_n(&pl->window, window, __ATOMIC_RELEASE);
+	if (window > old)
+		entry_credit_wake(pl, INT_MAX);
+}
+
+/*
+ * the op leaves the pipeline, give the credit back
+ */
+static void entry_credit_put(processor_t *pl)
+{
+	atomic_dec(&pl->inflight);
+	entry_credit_wake(pl, 1);
+
+	if (pl->outstanding_min < pl->outstanding_max)
+		entry_credit_adapt(pl, xt_now_ns());
 }
 
 /*
@@ -192,29 +621,31 @@ static void entry_push(processor_t *pl, entry_proc_op_t *op)
  */
 void entry_proc_push(processor_t *pl, entry_proc_op_t *op)
 {
+	worker_group_t *group = pl->stages[op->stage].group;
+
 	/*
-	 * semphore is to limit the outstanding ops count
+	 * the credit is to limit the outstanding ops count
 	 */
-	sem_wait(&pl->credit);
+	entry_credit_get(pl);
 
-	xt_log(MHPROC, XT_LOG_TRACE, "push the op:%p to processor", op);
+	op->ts_admit = xt_now_ns();
+	if (op->ts_hold == 0)
+		op->ts_hold = op->ts_admit;
+	entry_lag_enter(pl, op);
 
-	entry_push(pl, op);
+	xt_log(MHPROC, XT_LOG_TRACE, "push the op:%p to processor", op);
 
-	LOCK(&pl->lock);
-	if (pl->waiting_workers > 0)
-		COND_SIGNAL(&pl->cond);
-	UNLOCK(&pl->lock);
+	entry_kick_group(pl, group, entry_push(pl, op));
 }
 
 /*
  * check if the op can be merged with pending ops of the
- * object, if merged, mark the op as can_skip, then list
- * into the pending.
+ * object, if merged, mark the op as can_skip. The op which
+ * still has to wait is listed into the pending.
  */
-static void entry_proc_pending(entry_proc_op_t *op)
+static void entry_proc_pending(pipeline_shard_t *shard, op_obj_t *obj,
+    entry_proc_op_t *op)
 {
-	op_obj_t *obj = op->obj;
 	entry_proc_op_t *o = NULL;
 	entry_proc_op_t *t = NULL;
 	struct xlist_head *tail = NULL;
@@ -232,24 +663,15 @@ static void entry_proc_pending(entry_proc_op_t *op)
 	case op_unlink:
 	case op_rmdir:
 		/*
-		 * if pending ops are wait_parent_add
-		 * which means the op_create hasn't be
-		 * executed. the create and the unlink
-		 * can be canncel.
-		 *
-		 * if pending ops are wait_obj_proc,
-		 * unlink means outstanding setattrs
-		 * can be skipped.
+		 * if pending ops are setattrs waiting
+		 * for the object, unlink means outstanding
+		 * setattrs can be skipped. The creation of
+		 * the object is coalesced by entry_coalesce().
 		 */
 		xlist_for_each_entry_safe(o, t, &obj->pending,
 		    waitq) {
-			if (o->wait_parent_add) {
-				o->can_skip = 1;
-				op->can_skip = 1;
-			}
-			if (o->wait_obj_proc) {
-				o->can_skip = 1;
-			}
+			if (o->wait_obj_proc && o->op == op_setattr)
+				entry_skip(shard, o);
 		}
 		break;
 	default:
@@ -259,43 +681,127 @@ static void entry_proc_pending(entry_proc_op_t *op)
 		 * action also setattr, the last can be skipped.
 		 */
 		o = xlist_entry(tail, entry_proc_op_t, waitq);
-		if (o->wait_obj_proc) {
-			o->can_skip = 1;
+		if (o->wait_obj_proc && o->op == op_setattr) {
+			entry_skip(shard, o);
 		}
 			
 		break;
 	}
 
 out:
-
-	/*
-	 * regardless the op can be skipped or not, dequeue
-	 * the pending op from post_op since there would
-	 * deal with dependencies of ops. CANNOT dequeue
-	 * can_skip op here in case some ops depend on the
-	 * can_skip op.
-	 */
+	if (op->can_skip) {
+		/*
+		 * nothing to wait, the op is taken by a worker
+		 * to run its post handler only.
+		 */
+		op->wait_obj_proc = 0;
+		op->wait_chld_del = 0;
+		return;
+	}
 
 	xlist_add_tail(&op->waitq, &obj->pending);
 }
 
+/*
+ * coalesce the op with the outstanding creation of the object across
+ * the window. The creation is claimed first, so it is not taken by a
+ * worker meanwhile, a creation already taken is not coalesced.
+ *
+ * setattr is folded into the creation, so the object is inserted with
+ * the final attributes. unlink/rmdir cancel the creation, and the op
+ * itself is marked coalesced, the stage function only applies the side
+ * effects on the parent. A directory is only merged if it has no
+ * outstanding children.
+ *
+ * an op which is not merged is queued after the creation, the creation
+ * is not coalesced any more, so a later setattr is not applied before
+ * the ops queued in between.
+ *
+ * return 1 if the op is folded and can be skipped.
+ */
+static int entry_coalesce(pipeline_stage_t *stage, op_obj_t *obj,
+    entry_proc_op_t *op)
+{
+	entry_proc_op_t *prev = obj->creator;
+	entry_proc_op_t *o = NULL;
+	int ret = 0;
+
+	switch (op->op) {
+	case op_setattr:
+	case op_unlink:
+		break;
+	case op_rmdir:
+		if (obj->deleting_children)
+			goto out;
+
+		xlist_for_each_entry(o, &obj->pending, waitq) {
+			if (o->wait_parent_add)
+				goto out;
+		}
+		break;
+	default:
+		goto out;
+	}
+
+	if (!__sync_bool_compare_and_swap(&prev->claim, PL_OP_FREE,
+	    PL_OP_COALESCING))
+		goto out;
+
+	switch (stage->coalesce(stage->pl, prev, op)) {
+	case PL_COALESCE_FOLD:
+		xt_log(MHPROC, XT_LOG_TRACE, "op:%p folded into op:%p",
+		    op, prev);
+		MH_TRACE(MH_TR_FOLD, op, op->id, op->stage, 0);
+		op->can_skip = 1;
+		ret = 1;
+		__atomic_store_n(&prev->claim, PL_OP_FREE, __ATOMIC_RELEASE);
+		break;
+	case PL_COALESCE_CANCEL:
+		xt_log(MHPROC, XT_LOG_TRACE, "op:%p cancels op:%p",
+		    op, prev);
+		op->coalesced = 1;
+		obj->creator = NULL;
+		__atomic_store_n(&prev->claim, PL_OP_CANCELLED,
+		    __ATOMIC_RELEASE);
+		break;
+	default:
+		__atomic_store_n(&prev->claim, PL_OP_FREE, __ATOMIC_RELEASE);
+		goto out;
+	}
+
+	return ret;
+out:
+	obj->creator = NULL;
+	return 0;
+}
+
 /*
  * validate whether the op can be taken by worker to proceed
  * return 0 means the op should be suspend
  * return 1 means the op can be taken by worker
  * return -1 means something error happens.
+ *
+ * a suspended op is listed in the pending list of the object
+ * it depends on, unless it is marked can_skip. The caller holds
+ * the shard mutex of the object, and of the parent for the ops
+ * referencing the parent.
  */
 int entry_valid_op(pipeline_stage_t *stage, entry_proc_op_t *op)
 {
 	int ret = 0;
-	op_obj_t *obj = op->obj;
-	ino_t parentid = op->pid;
-	op_obj_t *parent = rbthash_get(stage->obj_tbl, &parentid,
-	    sizeof(ino_t));
+	pipeline_shard_t *shard = stage_shard(stage, op->id);
+	op_obj_t *obj = obj_tbl_get(shard->obj_tbl, op->id);
+	op_obj_t *parent = NULL;
+
+	if (stage->coalesce && obj->creator && obj->creator != op &&
+	    entry_coalesce(stage, obj, op))
+		return 1;
 
 	switch (op->op) {
 	case op_create:
 	case op_mkdir:
+		parent = obj_tbl_get(stage_shard(stage, op->pid)->obj_tbl,
+		    op->pid);
 		if (parent) {
 			if (parent == obj) {
 				/*
@@ -324,7 +830,7 @@ int entry_valid_op(pipeline_stage_t *stage, entry_proc_op_t *op)
 			 * until the previous operation complete.
 			 */
 			op->wait_obj_proc = 1;
-			entry_proc_pending(op);
+			entry_proc_pending(shard, obj, op);
 		}
 
 		break;
@@ -333,7 +839,7 @@ int entry_valid_op(pipeline_stage_t *stage, entry_proc_op_t *op)
 		if (obj->being_created || !xlist_empty(&obj->pending) ||
 		    obj->being_proceed) {
 			op->wait_obj_proc = 1;
-			entry_proc_pending(op);
+			entry_proc_pending(shard, obj, op);
 			break;
 		}
 
@@ -342,7 +848,7 @@ int entry_valid_op(pipeline_stage_t *stage, entry_proc_op_t *op)
 			 * If children deletion outstanding
 			 */
 			op->wait_chld_del = 1;
-			entry_proc_pending(op);
+			entry_proc_pending(shard, obj, op);
 		}
 		break;
 	case op_init:
@@ -351,7 +857,7 @@ int entry_valid_op(pipeline_stage_t *stage, entry_proc_op_t *op)
 		if (obj->being_created || !xlist_empty(&obj->pending) ||
 		    obj->being_proceed) {
 			op->wait_obj_proc = 1;
-			entry_proc_pending(op);
+			entry_proc_pending(shard, obj, op);
 		}
 
 		break;
@@ -367,25 +873,91 @@ int entry_valid_op(pipeline_stage_t *stage, entry_proc_op_t *op)
 
 	if (!op->can_skip && !op->wait_obj_proc && !op->wait_chld_del
 	    && !op->wait_parent_add) {
-		obj->being_proceed = 1;
+		/*
+		 * creation is ordered by being_created of the object,
+		 * other ops take the object until post handler.
+		 */
+		if (op->op != op_create && op->op != op_mkdir) {
+			obj->being_proceed = 1;
+			op->proceeding = 1;
+		}
 		ret = 1;
 	}
 
 	return ret;
 }
 
+/*
+ * account the op taken by the worker at @now, the statistics of the
+ * worker are not shared with other writers.
+ */
+static inline void entry_stat_taken(worker_info_t *worker,
+    entry_proc_op_t *op, uint64_t now)
+{
+	stage_worker_stat_t *st = &worker->stats[op->stage];
+
+	st->taken++;
+	xt_hist_record(&st->hist.wait, now - op->ts_ready);
+	if (op->ts_ready != op->ts_push)
+		xt_hist_record(&st->hist.blocked, op->ts_ready - op->ts_push);
+}
+
+/*
+ * run the fused stage of the op in the current worker, the op is not
+ * queued and does not take its object at the stage.
+ */
+static void entry_proc_fused(processor_t *pl, entry_proc_op_t *op)
+{
+	step_function_t func = pl->stages_desc[op->stage].function;
+	worker_info_t *worker = entry_cur_worker;
+	stage_worker_stat_t *st = NULL;
+	uint64_t now = xt_now_ns();
+
+	op->ts_push = now;
+	op->ts_ready = now;
+	MH_TRACE(MH_TR_FUSED, op, op->id, op->stage, op->op);
+	if (worker) {
+		st = &worker->stats[op->stage];
+		entry_stat_taken(worker, op, now);
+	}
+
+	if (func && !op->can_skip) {
+		xt_log(MHPROC, XT_LOG_TRACE, "fused stage:%d op:%p",
+		    op->stage, op);
+		op->worker = worker;
+		func((void *)pl, op);
+	}
+
+	if (st) {
+		now = xt_now_ns() - now;
+		xt_hist_record(&st->hist.service, now);
+		st->processing_ns += now;
+		st->processed++;
+	}
+}
+
 static void _entry_stage_cmplt(void *processor, struct entry_proc_op *op)
 {
 	processor_t *pl = (processor_t *)processor;
+	worker_group_t *group = NULL;
+	int ready = 0;
 
 	op->stage++;
+	while (!op->invalid && op->stage < pl->stage_count &&
+	    pl->stages[op->stage].fused) {
+		entry_proc_fused(pl, op);
+		op->stage++;
+	}
+
 	if (op->invalid || op->stage == pl->stage_count) {
 		/*
 		 * last stage, no need to move to next stage
 		 */
-		sem_post(&pl->credit);
+		entry_lag_leave(pl, op);
+		entry_credit_put(pl);
 
 		xt_log(MHPROC, XT_LOG_TRACE, "release op:%p", op);
+		MH_TRACE(MH_TR_DONE, op, op->id, op->stage, op->invalid);
 
 		/*
 		 * release op
@@ -397,13 +969,17 @@ static void _entry_stage_cmplt(void *processor, struct entry_proc_op *op)
 		 * push to next stage of pipeline
 		 */
 		xt_log(MHPROC, XT_LOG_TRACE, "push to next stage:%d op:%p", op->stage, op);
-		entry_push(pl, op);
+		group = pl->stages[op->stage].group;
+		ready = entry_push(pl, op);
 		/*
 		 * don't need wakeup /signal other threads for
 		 * the next journey of the op entry at the next
 		 * stage since the current thread would loop
-		 * back to the begining check available entries.
+		 * back to the begining check available entries,
+		 * unless the stage is served by another group.
 		 */
+		if (!entry_cur_worker || entry_cur_worker->group != group)
+			entry_kick_group(pl, group, ready);
 	}
 }
 
@@ -415,40 +991,40 @@ void entry_stage_cmplt(void *processor, struct entry_proc_op *op)
 {
 	processor_t *pl = (processor_t *)processor;
 	pipeline_stage_t *stage = &pl->stages[op->stage];
-	op_obj_t *obj = op->obj;
-	ino_t parentid = op->pid;
+	pipeline_shard_t *shard = stage_shard(stage, op->id);
+	pipeline_shard_t *pshard = NULL;
+	op_obj_t *obj = NULL;
 	op_obj_t *parent = NULL;
 
-	LOCK(&stage->mutex);
+	if (op->op == op_unlink || op->op == op_rmdir)
+		pshard = stage_shard(stage, op->pid);
+
+	shard_lock2(shard, pshard);
 
+	obj = obj_tbl_get(shard->obj_tbl, op->id);
 	obj->ref--;
 	if (!obj->ref) {
 		/*
 		 * all outstanding op about the object has already been proceed,
-		 * release the rbthash entry at the current stage.
+		 * release the table entry at the current stage.
 		 */
-		rbthash_remove(stage->obj_tbl, &op->id, sizeof(op->id));
-		mem_put(pl->obj_pool, obj);
+		obj_tbl_remove(shard->obj_tbl, obj);
 	}
 
-	if (op->op == op_unlink || op->op == op_rmdir) {
+	if (pshard) {
 		/*
 		 * unlink/rmdir reference parent obj, should
 		 * cleanup is reference back to 0.
 		 */
-		parent = rbthash_get(stage->obj_tbl, &parentid,
-		    sizeof(ino_t));
+		parent = obj_tbl_get(pshard->obj_tbl, op->pid);
 		if (parent) {
 			parent->ref--;
-			if (!parent->ref) {
-				rbthash_remove(stage->obj_tbl, &parentid,
-				    sizeof(ino_t));
-				mem_put(pl->obj_pool, parent);
-			}
+			if (!parent->ref)
+				obj_tbl_remove(pshard->obj_tbl, parent);
 		}
 	}
 
-	UNLOCK(&stage->mutex);
+	shard_unlock2(shard, pshard);
 
 	_entry_stage_cmplt(processor, op);
 }
@@ -462,16 +1038,19 @@ void entry_post_op(void *processor, struct entry_proc_op *op)
 {
 	processor_t *pl = (processor_t *)processor;
 	pipeline_stage_t *stage = &pl->stages[op->stage];
-	op_obj_t *obj = op->obj;
-	entry_proc_op_t *o = NULL;
-	entry_proc_op_t *t = NULL;
-	ino_t parentid = op->pid;
+	pipeline_shard_t *shard = stage_shard(stage, op->id);
+	pipeline_shard_t *pshard = NULL;
+	op_obj_t *obj = NULL;
+	op_obj_t *parent = NULL;
 	int wakeup = 0;
 
-	LOCK(&stage->mutex);
+	if (op->op == op_unlink || op->op == op_rmdir)
+		pshard = stage_shard(stage, op->pid);
+
+	MH_TRACE(MH_TR_POST, op, op->id, op->stage, op->can_skip);
+	shard_lock2(shard, pshard);
 
-	op_obj_t *parent = rbthash_get(stage->obj_tbl, &parentid,
-	    sizeof(ino_t));
+	obj = obj_tbl_get(shard->obj_tbl, op->id);
 
 	/*
 	 * reset can_skip whatever it is
@@ -480,27 +1059,21 @@ void entry_post_op(void *processor, struct entry_proc_op *op)
 
 	switch (op->op) {
 	case op_mkdir:
-		obj->being_created = 0;
+	case op_create:
 		/*
-		 * wakeup op include different children creation
+		 * creation complete, ops about the object and
+		 * the children creation can go ahead.
 		 */
-		xlist_for_each_entry_safe(o, t, &obj->pending,
-		    waitq) {
-			if (o->wait_parent_add) {
-				o->wait_parent_add = 0;
-				wakeup++;
-				xt_log(MHPROC, XT_LOG_TRACE, "mkdir complete "
-				    "wakeup op: %p", o);
-				o->woke_up = 1;
-				xlist_del(&o->waitq);
-			}
-		}
+		obj->being_created = 0;
+		if (obj->creator == op)
+			obj->creator = NULL;
 		break;
 
 	case op_unlink:
 
 	case op_rmdir:
 		obj->being_removed = 0;
+		parent = obj_tbl_get(pshard->obj_tbl, op->pid);
 		if (parent == NULL) {
 			xt_log(MHPROC, XT_LOG_ERROR, "impossible "
 			    "parent is NULL during deleting. ");
@@ -513,147 +1086,317 @@ void entry_post_op(void *processor, struct entry_proc_op *op)
 			/*
 			 * wakeup parent deletion
 			 */
-			xlist_for_each_entry_safe(o, t, &parent->pending,
-			    waitq) {
-				if (o->wait_chld_del) {
-					o->wait_chld_del = 0;
-					xlist_del(&o->waitq);
-					wakeup = 1;
-					o->woke_up = 1;
-					xt_log(MHPROC, XT_LOG_TRACE, "chld "
-					    "deleting complete, wakeup del "
-					    "parent op :%p", o);
-					break;
-				}
-			}
+			wakeup += entry_obj_kick(pshard, parent);
 		}
 
 		/*
 		 * unlink/rmdir reference parent obj, so post_op should
 		 * check if the ref is 0, if so, cleanup the parent
 		 */
-		if (!parent->ref) {
-			rbthash_remove(stage->obj_tbl, &parentid, sizeof(ino_t));
-			mem_put(pl->obj_pool, parent);
-		}
+		if (!parent->ref)
+			obj_tbl_remove(pshard->obj_tbl, parent);
 		break;
 
-	case op_create:
-		obj->being_created = 0;
-		/*
-		 * fall through
-		 */
-	case op_setattr:
-	case op_init:
-		if (!xlist_empty(&obj->pending)) {
-			/*
-			 * wake up a following op
-			 */
-			xlist_for_each_entry_safe(o, t, &obj->pending, waitq) {
-				if (o->wait_obj_proc) {
-					o->wait_obj_proc = 0;
-					xlist_del(&o->waitq);
-					o->woke_up = 1;
-					xt_log(MHPROC, XT_LOG_TRACE, "creat/"
-					    "setattr/init complete, wakeup "
-					    "op :%p", o);
-					wakeup = 1;
-					break;
-				}
-			}
-		}
-		break;
 	default:
 		/*
-		 * invalid op
+		 * setattr/init or invalid op
 		 */
 		break;
 	}
 
 	/*
-	 * clean up being_proceed flag
+	 * clean up being_proceed flag if the op took the object,
+	 * then resume the ops pending on the object.
 	 */
-	obj->being_proceed = 0;
+	if (op->proceeding) {
+		obj->being_proceed = 0;
+		op->proceeding = 0;
+	}
+
+	wakeup += entry_obj_kick(shard, obj);
 
 	obj->ref--;
 	if (!obj->ref) {
 		/*
 		 * all outstanding op about the object has already been prceed,
-		 * release the rbthash entry.
+		 * release the table entry.
 		 */
-		rbthash_remove(stage->obj_tbl, &op->id, sizeof(op->id));
-		mem_put(pl->obj_pool, obj);
+		obj_tbl_remove(shard->obj_tbl, obj);
 	}
 
-	UNLOCK(&stage->mutex);
+	shard_unlock2(shard, pshard);
 
 	_entry_stage_cmplt(pl, op);
 
-	LOCK(&pl->lock);
-	if (pl->waiting_workers > 0 && (wakeup == 1))
-		COND_SIGNAL(&pl->cond);
-	if (pl->waiting_workers > 1 && (wakeup > 1))
-		COND_BROADCAST(&pl->cond);
-	
-	UNLOCK(&pl->lock);
+	entry_kick_group(pl, stage->group, wakeup);
 	xt_log(MHPROC, XT_LOG_TRACE, "post op:%p, stage:%d", op, op->stage);
 }
 
-static entry_proc_op_t *entry_next_op(processor_t *pl)
+/*
+ * take the first op from the shard ready queues, the later stage
+ * first. Blocked ops are not in the ready queues, so the cost does
+ * not depend on how many ops are outstanding.
+ *
+ * workers start from different shards. The empty shards are skipped
+ * without taking their mutex, idle workers issue a full barrier before
+ * the last scan ahead of sleeping, see entry_kick_group().
+ */
+static entry_proc_op_t *entry_next_ready(processor_t *pl,
+    worker_info_t *worker)
 {
 	int i = 0;
+	unsigned int j = 0;
 	pipeline_stage_t *stage = NULL;
+	pipeline_shard_t *shard = NULL;
 	entry_proc_op_t *processing_op = NULL;
-	step_valid_op_function_t validate = NULL;
 
 	for (i = pl->stage_count-1; i >= 0; i--) {
-		entry_proc_op_t *op = NULL;
-		entry_proc_op_t *tmp = NULL;
-
 		stage = &pl->stages[i];
-		validate = pl->stages_desc[i].valid_op;
-
-		LOCK(&stage->mutex);
-		if (stage->outstanding) {
-			xlist_for_each_entry_safe(op, tmp, &stage->entries,
-			    list) {
-				if (!validate) {
-					processing_op = op;
-					break;
-				}
-
-				if (op->can_skip) {
-					processing_op = op;
-					break;
-				}
-
-				if (op->wait_parent_add || op->wait_chld_del ||
-				    op->wait_obj_proc)
-					continue;
-
-				if (op->woke_up) {
-					processing_op = op;
-					break;
-				}
-
-				if (validate(stage, op)) {
-					processing_op = op;
-					break;
-				}
+		if (stage->group != worker->group)
+			continue;
+
+		for (j = 0; j < stage->shard_count; j++) {
+			shard = &stage->shards[(worker->index + j) %
+			    stage->shard_count];
+			if (xlist_empty(&shard->ready))
+				continue;
+
+			LOCK(&shard->mutex);
+			if (!xlist_empty(&shard->ready)) {
+				processing_op = xlist_entry(shard->ready.next,
+				    entry_proc_op_t, list);
+				xlist_del_init(&processing_op->list);
+				shard->queued--;
 			}
+			UNLOCK(&shard->mutex);
+
+			if (processing_op)
+				return processing_op;
 		}
+	}
+	return NULL;
+}
+
+/*
+ * steal an op from the deque of other workers of the group, starting
+ * from a random victim.
+ */
+static entry_proc_op_t *entry_steal_op(processor_t *pl,
+    worker_info_t *worker)
+{
+	worker_group_t *group = worker->group;
+	worker_info_t *victim = NULL;
+	entry_proc_op_t *op = NULL;
+	unsigned int start = 0;
+	unsigned int i = 0;
+
+	if (group->count < 2)
+		return NULL;
+
+	worker->seed ^= worker->seed << 13;
+	worker->seed ^= worker->seed >> 17;
+	worker->seed ^= worker->seed << 5;
+	start = worker->seed % group->count;
+
+	for (i = 0; i < group->count; i++) {
+		victim = &pl->workers[group->first +
+		    (start + i) % group->count];
+		if (victim == worker)
+			continue;
+
+		op = wsdeque_steal(&victim->deque);
+		if (op)
+			return op;
+	}
+
+	return NULL;
+}
+
+/*
+ * the ops made runnable by the worker itself first, then the ops
+ * pushed by the reader, then the ops of other workers.
+ */
+static entry_proc_op_t *entry_next_op(processor_t *pl, worker_info_t *worker)
+{
+	entry_proc_op_t *op = NULL;
+
+	op = wsdeque_pop(&worker->deque);
+	if (op)
+		return op;
+
+	op = entry_next_ready(pl, worker);
+	if (op)
+		return op;
+
+	return entry_steal_op(pl, worker);
+}
+
+/*
+ * claim the op taken from the ready queues, against the coalescing of
+ * later ops, see entry_coalesce(). A cancelled op is skipped.
+ */
+static void entry_op_claim(processor_t *pl, entry_proc_op_t *op)
+{
+	int claim = PL_OP_FREE;
+
+	if (!pl->stages[op->stage].coalesce)
+		return;
 
-		if (processing_op) {
-			xlist_del_init(&processing_op->list);
-			stage->outstanding--;
+	for (;;) {
+		claim = __atomic_load_n(&op->claim, __ATOMIC_ACQUIRE);
+		if (claim == PL_OP_COALESCING) {
+			sched_yield();
+			continue;
 		}
+		if (__sync_bool_compare_and_swap(&op->claim, claim,
+		    PL_OP_TAKEN))
+			break;
+	}
+
+	if (claim == PL_OP_CANCELLED)
+		op->can_skip = 1;
+}
+
+/*
+ * gather up to @max more ready ops of the stage for a batch, from the
+ * deque of the worker and then the shard ready queues. All the ready
+ * ops are independent, they took their objects at validation.
+ */
+static int entry_next_batch(processor_t *pl, worker_info_t *worker,
+    unsigned int stage_index, entry_proc_op_t **ops, int max)
+{
+	pipeline_stage_t *stage = &pl->stages[stage_index];
+	pipeline_shard_t *shard = NULL;
+	entry_proc_op_t *op = NULL;
+	unsigned int j = 0;
+	int i = 0;
+	int n = 0;
 
-		UNLOCK(&stage->mutex);
+	while (n < max) {
+		op = wsdeque_pop(&worker->deque);
+		if (op == NULL)
+			break;
 
-		if (processing_op)
+		if (op->stage != stage_index) {
+			/*
+			 * put it back to where it was
+			 */
+			wsdeque_push(&worker->deque, op);
 			break;
+		}
+		ops[n++] = op;
+	}
+
+	for (j = 0; j < stage->shard_count && n < max; j++) {
+		shard = &stage->shards[(worker->index + j) %
+		    stage->shard_count];
+		if (xlist_empty(&shard->ready))
+			continue;
+
+		LOCK(&shard->mutex);
+		while (n < max && !xlist_empty(&shard->ready)) {
+			op = xlist_entry(shard->ready.next, entry_proc_op_t,
+			    list);
+			xlist_del_init(&op->list);
+			shard->queued--;
+			ops[n++] = op;
+		}
+		UNLOCK(&shard->mutex);
+	}
+
+	for (i = 0; i < n; i++)
+		entry_op_claim(pl, ops[i]);
+
+	return n;
+}
+
+/*
+ * hand the op together with other ready ops of the stage to the
+ * batch function, then run the post handler of every op.
+ */
+static void entry_proc_batch(processor_t *pl, worker_info_t *worker,
+    entry_proc_op_t *op)
+{
+	pipeline_stage_desc_t *desc = &pl->stages_desc[op->stage];
+	stage_worker_stat_t *st = &worker->stats[op->stage];
+	entry_proc_op_t *batch[PL_MAX_BATCH];
+	entry_proc_op_t *apply[PL_MAX_BATCH];
+	int max = desc->max_batch;
+	uint64_t now = 0;
+	uint64_t spent = 0;
+	int count = 0;
+	int napply = 0;
+	int i = 0;
+
+	if (max > PL_MAX_BATCH)
+		max = PL_MAX_BATCH;
+
+	batch[0] = op;
+	count = 1 + entry_next_batch(pl, worker, op->stage, batch + 1,
+	    max - 1);
+
+	now = xt_now_ns();
+	for (i = 1; i < count; i++) {
+		entry_stat_taken(worker, batch[i], now);
+		MH_TRACE(MH_TR_TAKE, batch[i], batch[i]->id, batch[i]->stage,
+		    batch[i]->op);
+	}
+
+	for (i = 0; i < count; i++) {
+		batch[i]->worker = worker;
+		/*
+		 * skipped ops only run the post handler
+		 */
+		if (!batch[i]->can_skip && !batch[i]->invalid)
+			apply[napply++] = batch[i];
+	}
+
+	if (napply) {
+		xt_log(MHPROC, XT_LOG_TRACE, "worker %d proceed batch of "
+		    "%d ops", worker->index, napply);
+		desc->batch_function((void *)pl, apply, napply);
+
+		/*
+		 * every op of the batch waits for the whole batch
+		 */
+		spent = xt_now_ns() - now;
+		for (i = 0; i < napply; i++)
+			xt_hist_record(&st->hist.service, spent);
+		st->processing_ns += spent;
+		st->nb_batches++;
+		st->total_batched_entries += napply;
+	}
+
+	if (desc->post_function) {
+		for (i = 0; i < count; i++)
+			desc->post_function((void *)pl, batch[i]);
+	}
+	st->processed += count;
+}
+
+/*
+ * nothing to do, sleep on the parked word of the worker until a waker
+ * picks it. return NULL if the processor is exiting.
+ */
+static entry_proc_op_t *entry_worker_park(processor_t *pl,
+    worker_info_t *worker)
+{
+	entry_proc_op_t *op = NULL;
+
+	for (;;) {
+		__atomic_store_n(&worker->parked, 1, __ATOMIC_SEQ_CST);
+		atomic_inc(&worker->group->idle);
+
+		op = entry_next_op(pl, worker);
+		if (op || pl->exiting) {
+			if (__sync_bool_compare_and_swap(&worker->parked, 1, 0))
+				atomic_dec(&worker->group->idle);
+			return op;
+		}
+
+		while (__atomic_load_n(&worker->parked, __ATOMIC_ACQUIRE))
+			XT_FUTEX_WAIT(&worker->parked, 1);
 	}
-	return processing_op;
 }
 
 static void *entry_proc_worker(void *arg)
@@ -663,7 +1406,9 @@ static void *entry_proc_worker(void *arg)
 	entry_proc_op_t *op;
 	step_function_t func;
 	step_post_function_t post_func;
-	int wait = 0;
+	stage_worker_stat_t *st;
+	uint64_t now = 0;
+	uint64_t spent = 0;
 	int ret = -1;
 	
 	ret = pl->worker_init(worker);
@@ -672,33 +1417,38 @@ static void *entry_proc_worker(void *arg)
 
 	xt_log(MHPROC, XT_LOG_TRACE, "worker %d start...", worker->index);
 
+	entry_cur_worker = worker;
+
 	while (1) {
-		LOCK(&pl->lock);
-		while(!(op = entry_next_op(pl))) {
-			pl->waiting_workers++;
-			wait = 1;
-			if (pl->exiting) {
+		op = entry_next_op(pl, worker);
+		if (op == NULL) {
+			op = entry_worker_park(pl, worker);
+			if (op == NULL) {
 				/*
 				 * thread exiting
 				 */
 				xt_log(MHPROC, XT_LOG_TRACE, "worker %d "
 				    "exiting...", worker->index);
-				UNLOCK(&pl->lock);
 				goto out;
 			}
-			COND_WAIT(&pl->cond, &pl->lock);
-		}
-		if (wait) {
-			pl->waiting_workers--;
-			wait = 0;
 		}
 
-		UNLOCK(&pl->lock);
-
 		xt_log(MHPROC, XT_LOG_TRACE, "worker %d take op:%p",
 		       worker->index, op);
 
+		now = xt_now_ns();
+		entry_stat_taken(worker, op, now);
+		entry_op_claim(pl, op);
+		MH_TRACE(MH_TR_TAKE, op, op->id, op->stage, op->op);
+
+		if (pl->stages_desc[op->stage].batch_function &&
+		    pl->stages_desc[op->stage].max_batch > 1) {
+			entry_proc_batch(pl, worker, op);
+			continue;
+		}
+
 		func = pl->stages_desc[op->stage].function;
+		st = &worker->stats[op->stage];
 		
 		/*
 		 * if can_skip is set, skip function
@@ -708,6 +1458,10 @@ static void *entry_proc_worker(void *arg)
 			    worker->index, op);
 			op->worker = worker;
 			func((void *)pl, op);
+
+			spent = xt_now_ns() - now;
+			xt_hist_record(&st->hist.service, spent);
+			st->processing_ns += spent;
 		}
 		
 		post_func = pl->stages_desc[op->stage].post_function;
@@ -716,90 +1470,220 @@ static void *entry_proc_worker(void *arg)
 			    worker->index, op);
 			post_func((void *)pl, op);
 		}
+		st->processed++;
 	}
 
 out:
+	entry_cur_worker = NULL;
 	pl->worker_fini(worker);
 	xt_log(MHPROC, XT_LOG_INFO, "worker %d exit...", worker->index);
 	return NULL;
 }
 
+static void processor_stage_destroy(pipeline_stage_t *stage)
+{
+	unsigned int i = 0;
+
+	for (i = 0; i < stage->shard_count; i++) {
+		pipeline_shard_t *shard = &stage->shards[i];
+
+		LOCK_DESTROY(&shard->mutex);
+		obj_tbl_destroy(shard->obj_tbl);
+	}
+
+	XT_FREE(stage->shards);
+}
+
 /*
- * pipeline initialization
+ * split the workers into groups. A stage runs on a group of its own
+ * with the workers configured for it, or with max_thread_count
+ * workers, the configured workers are bounded by max_thread_count.
+ * The other stages share a group of workercnt workers, the fused
+ * stages don't have workers of their own.
  */
-int processor_init(processor_t *pl)
+static int processor_groups_init(processor_t *pl)
 {
+	pipeline_stage_desc_t *desc = NULL;
+	worker_group_t *group = NULL;
+	unsigned long shared = 0;
+	unsigned int n = 0;
 	int i = 0;
-	int ret = 0;
-	worker_info_t *workers = NULL;
+
+	if (pl->stage_count > (int)PL_MAX_STAGES) {
+		xt_log(MHPROC, XT_LOG_ERROR, "too many stages: %d",
+		    pl->stage_count);
+		return EINVAL;
+	}
 
 	/*
-	 * obj_tbl_pool is pipeline-wise, but tbl is stage wise
+	 * a group per stage and the shared group at most
 	 */
-	pl->obj_tbl_pool = mem_pool_new(sizeof(rbthash_entry_t),
-	    pl->outstanding_ops);
+	pl->groups = XT_CALLOC(pl->stage_count + 1, sizeof(worker_group_t));
+	if (pl->groups == NULL)
+		return ENOMEM;
 
-	if (pl->obj_tbl_pool == NULL) {
-		ret = ENOMEM;
-		goto err;
+	pl->group_count = 0;
+	pl->nr_workers = 0;
+
+	for (i = 0; i < pl->stage_count; i++) {
+		desc = &pl->stages_desc[i];
+		if (pl->stages[i].fused)
+			continue;
+
+		n = pl->stage_workers ? pl->stage_workers[i] : 0;
+
+		if (n == 0) {
+			n = desc->max_thread_count;
+		} else if (desc->max_thread_count &&
+		    n > desc->max_thread_count) {
+			xt_log(MHPROC, XT_LOG_WARNING, "stage %s runs on %u "
+			    "workers at most", desc->stage_name,
+			    desc->max_thread_count);
+			n = desc->max_thread_count;
+		}
+
+		if (n == 0) {
+			shared |= 1UL << i;
+			continue;
+		}
+
+		group = &pl->groups[pl->group_count++];
+		group->first = pl->nr_workers;
+		group->count = n;
+		group->stage_mask = 1UL << i;
+		pl->stages[i].group = group;
+		pl->nr_workers += n;
 	}
 
-	/*
-	 * intialize op memory pool
-	 */
-	pl->op_pool = mem_pool_new(sizeof(entry_proc_op_t),
-	    pl->outstanding_ops);
-	if (pl->op_pool == NULL) {
-		ret = ENOMEM;
-		goto err;
+	if (shared) {
+		if (pl->workercnt <= 0) {
+			xt_log(MHPROC, XT_LOG_ERROR, "no worker for the "
+			    "stages without workers configured");
+			return EINVAL;
+		}
+
+		group = &pl->groups[pl->group_count++];
+		group->first = pl->nr_workers;
+		group->count = pl->workercnt;
+		group->stage_mask = shared;
+		pl->nr_workers += pl->workercnt;
+
+		for (i = 0; i < pl->stage_count; i++) {
+			if (shared & (1UL << i))
+				pl->stages[i].group = group;
+		}
 	}
 
 	/*
-	 * intialize object pool associated to the outstanding ops
+	 * a fused stage runs on the workers of the previous stage
 	 */
-	pl->obj_pool = mem_pool_new(sizeof(op_obj_t),
-	    pl->outstanding_ops);
-	if (pl->obj_pool == NULL) {
-		ret = ENOMEM;
-		goto err;		
+	for (i = 1; i < pl->stage_count; i++) {
+		if (pl->stages[i].fused)
+			pl->stages[i].group = pl->stages[i - 1].group;
 	}
 
+	for (i = 0; i < pl->stage_count; i++) {
+		xt_log(MHPROC, XT_LOG_INFO, "stage %s: %u workers",
+		    pl->stages_desc[i].stage_name,
+		    pl->stages[i].group->count);
+	}
+
+	return 0;
+}
+
+/*
+ * pipeline initialization
+ */
+int processor_init(processor_t *pl)
+{
+	int i = 0;
+	int j = 0;
+	int ret = 0;
+	worker_info_t *workers = NULL;
+
 	/*
-	 * initialize pipeline outstanding op count limit
+	 * initialize pipeline outstanding op count limit, the window
+	 * is fixed unless the bounds are configured.
 	 */
-        sem_init(&pl->credit, 0, pl->outstanding_ops);
-
-	LOCK_INIT(&pl->lock);
-	COND_INIT(&pl->cond);
+	if (pl->outstanding_min <= 0 ||
+	    pl->outstanding_min > pl->outstanding_ops)
+		pl->outstanding_min = pl->outstanding_ops;
+	if (pl->outstanding_max < pl->outstanding_ops)
+		pl->outstanding_max = pl->outstanding_ops;
+
+	pl->window = pl->outstanding_ops;
+	pl->inflight = 0;
+	memset(&pl->ctl, 0, sizeof(credit_ctl_t));
+
+	pl->lag_buckets = XT_CALLOC(PL_LAG_BUCKETS, sizeof(lag_bucket_t));
+	if (pl->lag_buckets == NULL) {
+		ret = ENOMEM;
+		goto err;
+	}
 
 	/*
 	 * initialize pipeline stages
 	 */
 	pl->stages = XT_CALLOC(pl->stage_count,
 	    sizeof(pipeline_stage_t));
+	if (pl->stages == NULL) {
+		ret = ENOMEM;
+		goto err;
+	}
+
+	if (pl->shard_count <= 0)
+		pl->shard_count = 1;
 
 	/*
 	 * initialize stage of pipeline
 	 */
 	for (i = 0; i < pl->stage_count; i++) {
 		/*
-		 * object rbtree is per stage. object is unqiue
+		 * object table is per shard of stage. object is unqiue
 		 * only in single stage. But different could have
-		 * object with the same id in different rbtree of
-		 * stages.
+		 * object with the same id in different table of
+		 * stages. An op references two objects at most.
 		 */
 		pipeline_stage_t *stage = &pl->stages[i];
+		pipeline_stage_desc_t *desc = &pl->stages_desc[i];
+
+		stage->pl = pl;
+		if (!pl->no_coalesce)
+			stage->coalesce = desc->coalesce;
 
-		stage->obj_tbl = rbthash_table_init(1,
-		    (rbt_hasher_t)SuperFastHash, NULL, 
-	            0, pl->obj_tbl_pool);
+		/*
+		 * the first stage is pushed by the reader, a stage
+		 * ordering, coalescing or batching its ops is queued.
+		 */
+		if (desc->flags & PL_STAGE_FUSABLE) {
+			if (i == 0 || desc->valid_op || desc->coalesce ||
+			    desc->batch_function)
+				xt_log(MHPROC, XT_LOG_WARNING, "stage %s can "
+				    "not be fused", desc->stage_name);
+			else
+				stage->fused = 1;
+		}
 
-		if (stage->obj_tbl == NULL) {
+		stage->shards = XT_CALLOC(pl->shard_count,
+		    sizeof(pipeline_shard_t));
+		if (stage->shards == NULL) {
 			ret = ENOMEM;
 			goto err;
 		}
-		INIT_XLIST_HEAD(&stage->entries);
-		LOCK_INIT(&stage->mutex);
+
+		for (j = 0; j < pl->shard_count; j++) {
+			pipeline_shard_t *shard = &stage->shards[j];
+
+			shard->obj_tbl = obj_tbl_new(pl->outstanding_max * 2 /
+			    pl->shard_count);
+			if (shard->obj_tbl == NULL) {
+				ret = ENOMEM;
+				goto err;
+			}
+			INIT_XLIST_HEAD(&shard->ready);
+			LOCK_INIT(&shard->mutex);
+			stage->shard_count++;
+		}
 	}
 
 	if (pl->init) {
@@ -816,22 +1700,65 @@ int processor_init(processor_t *pl)
 	/*
 	 * initialize worker threads
 	 */
-	workers = XT_CALLOC(pl->workercnt,
+	ret = processor_groups_init(pl);
+	if (ret)
+		goto err;
+
+	/*
+	 * intialize op memory pool, the magazines of the workers and
+	 * the reader keep some free ops. The ops are updated by different
+	 * workers, keep them on their own cache lines.
+	 */
+	pl->op_pool = mem_pool_new_flags(sizeof(entry_proc_op_t),
+	    pl->outstanding_max + (pl->nr_workers + 1) * MEM_MAG_SIZE,
+	    MEM_POOL_CACHE_ALIGNED | MEM_POOL_HUGEPAGE);
+	if (pl->op_pool == NULL) {
+		ret = ENOMEM;
+		goto err;
+	}
+
+	workers = XT_CALLOC(pl->nr_workers,
 	    sizeof(worker_info_t));
 	if (workers == NULL) {
 		ret = ENOMEM;
 		goto err;
 	}
 
-	memset(workers, 0, sizeof (worker_info_t) * pl->workercnt);
+	memset(workers, 0, sizeof (worker_info_t) * pl->nr_workers);
 	
 	pl->workers = workers;
-	pl->waiting_workers = pl->workercnt;
 
-	for (i = 0; i < pl->workercnt; i++) {
+	for (i = 0; i < pl->group_count; i++) {
+		worker_group_t *group = &pl->groups[i];
+
+		for (j = 0; j < (int)group->count; j++)
+			workers[group->first + j].group = group;
+	}
+
+	/*
+	 * all outstanding ops fit in a single deque
+	 */
+	for (i = 0; i < pl->nr_workers; i++) {
 		worker_info_t *info = &workers[i];
 		info->index = i;
 		info->pl = (void *)pl;
+		info->seed = i * 2654435761U + 1;
+		if (wsdeque_init(&info->deque, pl->outstanding_max)) {
+			ret = ENOMEM;
+			goto err;
+		}
+
+		info->stats = XT_CALLOC(pl->stage_count,
+		    sizeof(stage_worker_stat_t));
+		info->lag = XT_CALLOC(1, sizeof(lag_hist_t));
+		if (info->stats == NULL || info->lag == NULL) {
+			ret = ENOMEM;
+			goto err;
+		}
+	}
+
+	for (i = 0; i < pl->nr_workers; i++) {
+		worker_info_t *info = &workers[i];
 		ret = pthread_create(&info->tid, NULL,
 		    entry_proc_worker, info);
 		if (ret) {
@@ -843,26 +1770,24 @@ int processor_init(processor_t *pl)
 	return 0;
 err:
 	if (workers) {
+		for (i = 0; i < pl->nr_workers; i++) {
+			wsdeque_destroy(&workers[i].deque);
+			XT_FREE(workers[i].stats);
+			XT_FREE(workers[i].lag);
+		}
 		XT_FREE(workers);
+		pl->workers = NULL;
 	}
 
-	if (pl->obj_tbl_pool)
-		mem_pool_destroy(pl->obj_tbl_pool);
-
 	if (pl->op_pool)
 		mem_pool_destroy(pl->op_pool);
 
-	if (pl->obj_pool)
-		mem_pool_destroy(pl->obj_pool);
+	XT_FREE(pl->lag_buckets);
+	XT_FREE(pl->groups);
 
 	if (pl->stages) {
-		for (i = 0; i < pl->stage_count; i++) {
-			pipeline_stage_t *stage = &pl->stages[i];
-			if (stage->obj_tbl) {
-				LOCK_DESTROY(&stage->mutex);
-				rbthash_table_destroy(stage->obj_tbl);
-			}
-		}
+		for (i = 0; i < pl->stage_count; i++)
+			processor_stage_destroy(&pl->stages[i]);
 		XT_FREE(pl->stages);
 	}
 	
@@ -877,17 +1802,25 @@ void processor_cleanup(processor_t *pl)
 	if (!pl || !pl->stages)
 		return;
 
-	LOCK(&pl->lock);
+	/*
+	 * wake up all the idle workers, they exit when no op is left
+	 */
 	pl->exiting = 1;
-	COND_BROADCAST(&pl->cond);
-	UNLOCK(&pl->lock);
+	for (i = 0; i < pl->group_count; i++)
+		entry_kick_group(pl, &pl->groups[i], pl->groups[i].count);
 
-	for (i = 0; i < pl->workercnt; i++) {
+	for (i = 0; i < pl->nr_workers; i++) {
 		pthread_join(pl->workers[i].tid, &ret);
 	}
 
 	if (pl->workers) {
+		for (i = 0; i < pl->nr_workers; i++) {
+			wsdeque_destroy(&pl->workers[i].deque);
+			XT_FREE(pl->workers[i].stats);
+			XT_FREE(pl->workers[i].lag);
+		}
 		XT_FREE(pl->workers);
+		pl->workers = NULL;
 	}
 
 	if (pl->fini) {
@@ -898,24 +1831,176 @@ void processor_cleanup(processor_t *pl)
 	}
 
 	if (pl->stages) {
-		for (i = 0; i < pl->stage_count; i++) {
-			pipeline_stage_t *stage = &pl->stages[i];
-			if (stage->obj_tbl) {
-				LOCK_DESTROY(&stage->mutex);
-				rbthash_table_destroy(stage->obj_tbl);
-			}
-		}
+		for (i = 0; i < pl->stage_count; i++)
+			processor_stage_destroy(&pl->stages[i]);
 		XT_FREE(pl->stages);
 		pl->stages = NULL;
 	}
-	if (pl->obj_tbl_pool)
-		mem_pool_destroy(pl->obj_tbl_pool);
 
 	if (pl->op_pool)
 		mem_pool_destroy(pl->op_pool);
 
-	if (pl->obj_pool)
-		mem_pool_destroy(pl->obj_pool);
+	XT_FREE(pl->lag_buckets);
+	XT_FREE(pl->groups);
+	XT_FREE(pl->stage_workers);
+}
+
+int processor_stage_stat(processor_t *pl, int stage_index,
+    stage_stat_t *stat, stage_hist_t *hist)
+{
+	pipeline_stage_t *stage = NULL;
+	stage_worker_stat_t *st = NULL;
+	unsigned long long taken = 0;
+	unsigned long long processed = 0;
+	unsigned long long ns = 0;
+	unsigned int i = 0;
+
+	if (!pl->stages || !pl->workers || stage_index < 0 ||
+	    stage_index >= pl->stage_count)
+		return -1;
+
+	stage = &pl->stages[stage_index];
+
+	memset(stat, 0, sizeof(stage_stat_t));
+	if (hist)
+		memset(hist, 0, sizeof(stage_hist_t));
+
+	stat->nb_threads = stage->group->count;
+
+	/*
+	 * the ops in the deques of the workers are not counted, the
+	 * deques are shared by all the stages.
+	 */
+	for (i = 0; i < stage->shard_count; i++)
+		stat->nb_unprocessed_entries += stage->shards[i].queued;
+
+	for (i = 0; i < (unsigned int)pl->nr_workers; i++) {
+		st = &pl->workers[i].stats[stage_index];
+
+		processed += st->processed;
+		taken += st->taken;
+		ns += st->processing_ns;
+		stat->nb_batches += st->nb_batches;
+		stat->total_batched_entries += st->total_batched_entries;
+
+		if (hist) {
+			xt_hist_merge(&hist->wait, &st->hist.wait);
+			xt_hist_merge(&hist->service, &st->hist.service);
+			xt_hist_merge(&hist->blocked, &st->hist.blocked);
+		}
+	}
+
+	/*
+	 * counters are read while the workers update them
+	 */
+	stat->nb_current_entries = taken > processed ? taken - processed : 0;
+	stat->nb_processed_entries = processed;
+	stat->total_processed = processed;
+	stat->total_processing_time.tv_sec = ns / 1000000000ULL;
+	stat->total_processing_time.tv_usec = ns % 1000000000ULL / 1000;
+
+	return 0;
+}
+
+uint64_t processor_lag_stat(processor_t *pl, lag_hist_t *hist)
+{
+	lag_bucket_t *b = NULL;
+	uint64_t oldest = 0;
+	uint64_t epoch = 0;
+	uint64_t now = 0;
+	int i = 0;
+
+	memset(hist, 0, sizeof(lag_hist_t));
+
+	if (!pl->workers || !pl->lag_buckets)
+		return 0;
+
+	for (i = 0; i < pl->nr_workers; i++) {
+		xt_hist_merge(&hist->admit, &pl->workers[i].lag->admit);
+		xt_hist_merge(&hist->commit, &pl->workers[i].lag->commit);
+		xt_hist_merge(&hist->release, &pl->workers[i].lag->release);
+	}
+
+	for (i = 0; i < PL_LAG_BUCKETS; i++) {
+		b = &pl->lag_buckets[i];
+		if (__atomic_load_n(&b->inflight, __ATOMIC_ACQUIRE) <= 0)
+			continue;
+
+		epoch = __atomic_load_n(&b->epoch, __ATOMIC_ACQUIRE);
+		if (oldest == 0 || epoch < oldest)
+			oldest = epoch;
+	}
+
+	if (oldest == 0)
+		return 0;
+
+	now = xt_now_ns();
+	oldest *= 1000000000ULL;
+	return now > oldest ? now - oldest : 0;
+}
+
+static void processor_hist_dump(const char *what, const char *name,
+    const xt_hist_t *h)
+{
+	if (h->count == 0)
+		return;
+
+	xt_log(MHPROC, XT_LOG_INFO, "%s %s(us): count %llu avg %.1f "
+	    "p50 %.1f p90 %.1f p99 %.1f p99.9 %.1f max %.1f", what,
+	    name, (unsigned long long)h->count,
+	    (double)h->sum / h->count / 1000.0,
+	    xt_hist_percentile(h, 50) / 1000.0,
+	    xt_hist_percentile(h, 90) / 1000.0,
+	    xt_hist_percentile(h, 99) / 1000.0,
+	    xt_hist_percentile(h, 99.9) / 1000.0,
+	    h->max / 1000.0);
+}
+
+void processor_stats_dump(processor_t *pl)
+{
+	stage_hist_t *hist = NULL;
+	lag_hist_t *lag = NULL;
+	stage_stat_t stat;
+	const char *name = NULL;
+	uint64_t age = 0;
+	int i = 0;
+
+	hist = XT_MALLOC(sizeof(stage_hist_t));
+	if (hist == NULL)
+		return;
+
+	for (i = 0; i < pl->stage_count; i++) {
+		if (processor_stage_stat(pl, i, &stat, hist))
+			break;
+
+		name = pl->stages_desc[i].stage_name;
+		xt_log(MHPROC, XT_LOG_INFO, "stage %s: processed %llu "
+		    "current %u queued %u batches %llu(%llu ops) "
+		    "busy %ld.%06lds", name, stat.total_processed,
+		    stat.nb_current_entries, stat.nb_unprocessed_entries,
+		    stat.nb_batches, stat.total_batched_entries,
+		    (long)stat.total_processing_time.tv_sec,
+		    (long)stat.total_processing_time.tv_usec);
+
+		processor_hist_dump(name, "wait", &hist->wait);
+		processor_hist_dump(name, "service", &hist->service);
+		processor_hist_dump(name, "blocked", &hist->blocked);
+	}
+
+	XT_FREE(hist);
+
+	lag = XT_MALLOC(sizeof(lag_hist_t));
+	if (lag == NULL)
+		return;
+
+	age = processor_lag_stat(pl, lag);
+	xt_log(MHPROC, XT_LOG_INFO, "oldest op in pipeline: %.3fs",
+	    age / 1e9);
+	processor_hist_dump("lag", "admit", &lag->admit);
+	processor_hist_dump("lag", "commit", &lag->commit);
+	processor_hist_dump("lag", "release", &lag->release);
+
+	XT_FREE(lag);
 }
 
 /*
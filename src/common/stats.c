@@ -0,0 +1,95 @@
+/*
+ * Copyright (c) 2016 XTAO Technology <www.xtaotech.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <string.h>
+
+#include "stats.h"
+
+/*
+ * the values of 2^(XT_HIST_MAX_SHIFT - 1) to 2^XT_HIST_MAX_SHIFT - 1 fill
+ * the last XT_HIST_SUB buckets, the larger ones are clamped to the last
+ */
+_Static_assert(((XT_HIST_MAX_SHIFT - 1) - XT_HIST_SUB_BITS + 1) *
+    XT_HIST_SUB + XT_HIST_SUB - 1 == XT_HIST_BUCKETS - 1,
+    "xt_hist buckets do not end at 2^XT_HIST_MAX_SHIFT");
+
+void xt_hist_merge(xt_hist_t *dst, const xt_hist_t *src)
+{
+	unsigned int i = 0;
+
+	for (i = 0; i < XT_HIST_BUCKETS; i++)
+		dst->buckets[i] += src->buckets[i];
+
+	dst->count += src->count;
+	dst->sum += src->sum;
+	if (src->max > dst->max)
+		dst->max = src->max;
+}
+
+uint64_t xt_hist_bucket_low(unsigned int bucket)
+{
+	unsigned int shift = 0;
+
+	if (bucket < XT_HIST_SUB)
+		return bucket;
+
+	if (bucket >= XT_HIST_BUCKETS)
+		bucket = XT_HIST_BUCKETS - 1;
+
+	shift = bucket / XT_HIST_SUB + XT_HIST_SUB_BITS - 1;
+	return (uint64_t)(XT_HIST_SUB + bucket % XT_HIST_SUB) <<
+	    (shift - XT_HIST_SUB_BITS);
+}
+
+uint64_t xt_hist_percentile(const xt_hist_t *h, double p)
+{
+	uint64_t rank = 0;
+	uint64_t seen = 0;
+	uint64_t high = 0;
+	unsigned int i = 0;
+
+	if (h->count == 0)
+		return 0;
+
+	rank = (uint64_t)(h->count * p / 100.0);
+	if (rank >= h->count)
+		rank = h->count - 1;
+
+	for (i = 0; i < XT_HIST_BUCKETS; i++) {
+		seen += h->buckets[i];
+		if (seen > rank)
+			break;
+	}
+
+	if (i >= XT_HIST_BUCKETS - 1)
+		return h->max;
+
+	/*
+	 * the max is exact, it tightens the bound of the last buckets
+	 */
+	high = xt_hist_bucket_low(i + 1) - 1;
+	return high < h->max ? high : h->max;
+}
@@ -29,23 +29,30 @@
 #endif
 
 #include <errno.h>
+#include <time.h>
+#include <sched.h>
 #include "common.h"
 #include "mem.h"
 #include "thread-pool.h"
 #include "logging.h"
 
-static int
-log_base2 (unsigned long x)
-{
-        int val = 0;
+/*
+ * the worker run by the current thread, to push the tasks it enqueues
+ * to its own deque.
+ */
+static __thread tp_worker_t *tp_cur_worker;
 
-        while (x > 1) {
-                x /= 2;
-                val++;
-        }
+static void *tp_worker (void *data);
 
-        return val;
-};
+static inline uint32_t
+tp_rand (tp_worker_t *w)
+{
+        /* xorshift32 */
+        w->seed ^= w->seed << 13;
+        w->seed ^= w->seed >> 17;
+        w->seed ^= w->seed << 5;
+        return w->seed;
+}
 
 static tp_t *
 __tp_dequeue (tp_ctrl_t *ctrl)
@@ -55,177 +62,341 @@ __tp_dequeue (tp_ctrl_t *ctrl)
 	if (xlist_empty(&ctrl->queue))
 		return NULL;
 
-	tp = xlist_entry (&ctrl->queue, tp_t, list);
-	ctrl->qsize--;
+	tp = xlist_entry (ctrl->queue.next, tp_t, list);
+	__atomic_sub_fetch (&ctrl->qsize, 1, __ATOMIC_RELAXED);
 	xlist_del_init(&tp->list);
+	if (ctrl->inject_waiters && ctrl->qsize <= ctrl->inject_max / 2)
+		pthread_cond_broadcast (&ctrl->not_full);
 	return tp;
 }
 
+/*
+ * start a worker in a free slot, with the mutex held
+ */
+static int
+__tp_worker_add (tp_ctrl_t *ctrl)
+{
+        tp_worker_t *w = NULL;
+        pthread_t thread;
+        int i = 0;
+        int ret = 0;
+
+        for (i = 0; i < ctrl->max_thread_count; i++) {
+                if (!ctrl->workers[i].active) {
+                        w = &ctrl->workers[i];
+                        break;
+                }
+        }
+        if (w == NULL)
+                return -1;
+
+        w->active = 1;
+        tp_ctrl_ref (ctrl);
+        ret = pthread_create (&thread, &ctrl->w_attr, tp_worker, w);
+        if (ret) {
+                w->active = 0;
+                atomic_sub_and_fetch (&ctrl->refcount, 1);
+                xt_log ("thread-pool", XT_LOG_ERROR, "%s: failed to "
+                        "start a worker: %s", ctrl->name, strerror (ret));
+                return -1;
+        }
+
+        __atomic_add_fetch (&ctrl->curr_thread_count, 1, __ATOMIC_RELAXED);
+        xt_log ("thread-pool", XT_LOG_INFO, "scaled threads for %s to %d",
+                ctrl->name, ctrl->curr_thread_count);
+        return 0;
+}
+
+/*
+ * wake an idle worker, otherwise add one when none is idle and the
+ * pending tasks outnumber the workers.
+ */
+static void
+tp_threads_scale (tp_ctrl_t *ctrl, xt_boolean_t locked)
+{
+        if (__atomic_load_n (&ctrl->sleep_thread_count, __ATOMIC_SEQ_CST)) {
+                if (!locked)
+                        pthread_mutex_lock (&ctrl->mutex);
+                pthread_cond_signal (&ctrl->cond);
+                if (!locked)
+                        pthread_mutex_unlock (&ctrl->mutex);
+                return;
+        }
+
+        if (__atomic_load_n (&ctrl->curr_thread_count, __ATOMIC_RELAXED) >=
+            ctrl->max_thread_count ||
+            __atomic_load_n (&ctrl->pending, __ATOMIC_RELAXED) <=
+            __atomic_load_n (&ctrl->curr_thread_count, __ATOMIC_RELAXED))
+                return;
+
+        if (!locked)
+                pthread_mutex_lock (&ctrl->mutex);
+        if (!ctrl->exit_asked &&
+            ctrl->curr_thread_count < ctrl->max_thread_count)
+                __tp_worker_add (ctrl);
+        if (!locked)
+                pthread_mutex_unlock (&ctrl->mutex);
+}
+
+/*
+ * take a batch of the injection queue, a share of the workers at most.
+ * The first task is returned, the others go to the deque of the worker
+ * in reverse, so they are still run in the order of the queue.
+ */
+static tp_t *
+tp_take_injected (tp_ctrl_t *ctrl, tp_worker_t *w)
+{
+        tp_t *batch[TP_INJECT_BATCH];
+        int32_t n = 0;
+        int32_t i = 0;
+
+        pthread_mutex_lock (&ctrl->mutex);
+        n = ctrl->qsize / (ctrl->curr_thread_count ?
+                           ctrl->curr_thread_count : 1);
+        if (n < 1)
+                n = 1;
+        else if (n > TP_INJECT_BATCH)
+                n = TP_INJECT_BATCH;
+        for (i = 0; i < n; i++) {
+                batch[i] = __tp_dequeue (ctrl);
+                if (batch[i] == NULL)
+                        break;
+        }
+        n = i;
+
+        /*
+         * the deque is empty, it takes the batch unless resized down
+         * below it, put the rest back then
+         */
+        for (i = n - 1; i > 0; i--) {
+                if (wsdeque_push (&w->deque, batch[i]))
+                        break;
+        }
+        for (; i > 0; i--) {
+                xlist_add (&batch[i]->list, &ctrl->queue);
+                __atomic_add_fetch (&ctrl->qsize, 1, __ATOMIC_RELAXED);
+        }
+        pthread_mutex_unlock (&ctrl->mutex);
+
+        if (n > 1)
+                tp_threads_scale (ctrl, _xt_false);
+
+        return n ? batch[0] : NULL;
+}
+
+/*
+ * take a task, from the deque of the worker, the injection queue, and
+ * then the deque of a random victim.
+ */
+static tp_t *
+tp_next (tp_ctrl_t *ctrl, tp_worker_t *w)
+{
+        tp_t *tp = NULL;
+        int32_t start = 0;
+        int32_t i = 0;
+
+        tp = wsdeque_pop (&w->deque);
+        if (tp)
+                return tp;
+
+        if (__atomic_load_n (&ctrl->qsize, __ATOMIC_RELAXED)) {
+                tp = tp_take_injected (ctrl, w);
+                if (tp)
+                        return tp;
+        }
+
+        start = tp_rand (w) % ctrl->max_thread_count;
+        for (i = 0; i < ctrl->max_thread_count; i++) {
+                tp_worker_t *v = &ctrl->workers[(start + i) %
+                                                ctrl->max_thread_count];
+
+                if (v == w)
+                        continue;
+
+                tp = wsdeque_steal (&v->deque);
+                if (tp) {
+                        __atomic_add_fetch (&w->stolen, 1,
+                                            __ATOMIC_RELAXED);
+                        return tp;
+                }
+        }
+
+        return NULL;
+}
+
 static void *
 tp_worker (void *data)
 {
+        tp_worker_t *w = data;
         tp_ctrl_t *ctrl = NULL;
         tp_t *tp = NULL;
         struct timespec sleep_till = {0, };
-        int timeout = 0;
         int ret = 0;
-        int bye = 0;
 
         if (data == NULL) {
                 xt_log ("tp", XT_LOG_ERROR, "invalid argument");
                 return NULL;
         }
 
-        ctrl = (tp_ctrl_t*)data;
+        ctrl = w->ctrl;
+        tp_cur_worker = w;
 
         while (1) {
-                tp = NULL;
-                sleep_till.tv_sec = time (NULL) + (uint32_t) ctrl->idle_time;
+                tp = tp_next (ctrl, w);
+                if (tp) {
+                        __atomic_sub_fetch (&ctrl->pending, 1,
+                                            __ATOMIC_RELAXED);
+                        __atomic_add_fetch (&w->processed, 1,
+                                            __ATOMIC_RELAXED);
+                        if (tp->handler)
+                                tp->handler (tp);
+                        continue;
+                }
 
+                /*
+                 * nothing to run, sleep until a task is enqueued. The
+                 * sleeper is counted before pending is checked, the
+                 * producers increase pending before they check the
+                 * sleepers, one of them sees the other.
+                 */
                 pthread_mutex_lock (&ctrl->mutex);
-                if (ctrl->exit_asked) {
-                        ctrl->curr_thread_count -- ;
-                        pthread_mutex_unlock (&ctrl->mutex);
+                if (ctrl->exit_asked)
                         break;
-                }
 
-                while (ctrl->qsize == 0) {
-                        ctrl->sleep_thread_count ++;
-                        ret = pthread_cond_timedwait (&ctrl->cond, 
-                                                      &ctrl->mutex,
-                                                      &sleep_till);
-                        ctrl->sleep_thread_count --;
-                        if (ret == ETIMEDOUT) {
-                                timeout = 1;
-                                break;
-                        }
+                __atomic_add_fetch (&ctrl->sleep_thread_count, 1,
+                                    __ATOMIC_SEQ_CST);
+                if (__atomic_load_n (&ctrl->pending, __ATOMIC_SEQ_CST) > 0) {
+                        __atomic_sub_fetch (&ctrl->sleep_thread_count, 1,
+                                            __ATOMIC_SEQ_CST);
+                        pthread_mutex_unlock (&ctrl->mutex);
+                        sched_yield ();
+                        continue;
                 }
 
-                if (timeout) {
-                        if (ctrl->curr_thread_count > ctrl->min_thread_count) {
-                                ctrl->curr_thread_count --;
-                                bye = 1;
-                        } else {
-                                timeout = 0;
-                        }
-                } 
-
-                if (ctrl->qsize > 0) {
-                        tp = __tp_dequeue (ctrl);
-                        ctrl->tp_processed ++;
-                }
-                pthread_mutex_unlock (&ctrl->mutex);
+                sleep_till.tv_sec = time (NULL) + (uint32_t) ctrl->idle_time;
+                ret = pthread_cond_timedwait (&ctrl->cond, &ctrl->mutex,
+                                              &sleep_till);
+                __atomic_sub_fetch (&ctrl->sleep_thread_count, 1,
+                                    __ATOMIC_SEQ_CST);
 
-                if (tp && tp->handler) {
-                        tp->handler (tp);
-                }
+                if (ctrl->exit_asked)
+                        break;
+
+                /*
+                 * idle for idle_time, shrink down to the minimum
+                 */
+                if (ret == ETIMEDOUT &&
+                    ctrl->curr_thread_count > ctrl->min_thread_count &&
+                    wsdeque_size (&w->deque) == 0)
+                        break;
 
-                if (bye) break;
+                pthread_mutex_unlock (&ctrl->mutex);
         }
 
+        /*
+         * with the mutex held
+         */
+        __atomic_sub_fetch (&ctrl->curr_thread_count, 1, __ATOMIC_RELAXED);
+        w->active = 0;
+        pthread_mutex_unlock (&ctrl->mutex);
+
+        tp_cur_worker = NULL;
         tp_ctrl_free (ctrl);
 
         return NULL;
 }
 
-static inline int
-__tp_threads_scale (tp_ctrl_t *ctrl, int task_count)
+int tp_enqueue (tp_ctrl_t *ctrl, tp_t *tp)
 {
-        int log2 = 0;
-        int scale = 0;
-        int diff = 0;
-        int ret = 0;
-        pthread_t thread;
+        tp_worker_t *w = tp_cur_worker;
+
+        __atomic_add_fetch (&ctrl->pending, 1, __ATOMIC_SEQ_CST);
+
+        /*
+         * a worker keeps its tasks, it does not wait for the injection
+         * queue, a full queue would block the pool.
+         */
+        if (w && w->ctrl == ctrl) {
+                if (!wsdeque_push (&w->deque, tp)) {
+                        tp_threads_scale (ctrl, _xt_false);
+                        return 0;
+                }
 
-        log2 = log_base2 (task_count);
-        scale = log2;
-        if (scale < ctrl->min_thread_count) {
-                scale = ctrl->min_thread_count;
-        }
-        if (scale > ctrl->max_thread_count) {
-                scale = ctrl->max_thread_count;
+                pthread_mutex_lock (&ctrl->mutex);
+                xlist_add_tail (&tp->list, &ctrl->queue);
+                __atomic_add_fetch (&ctrl->qsize, 1, __ATOMIC_RELAXED);
+                tp_threads_scale (ctrl, _xt_true);
+                pthread_mutex_unlock (&ctrl->mutex);
+                return 0;
         }
 
-        if ( scale > ctrl->curr_thread_count) {
-                diff = scale - ctrl->curr_thread_count;
-        }
-        while (diff > 0) {
-                diff --;
-
-                tp_ctrl_ref (ctrl);
-                ret = pthread_create (&thread, &ctrl->w_attr, 
-                                      tp_worker, ctrl);
-                if (ret == 0) {
-                        ctrl->curr_thread_count ++;
-                        xt_log ("thread-pool", XT_LOG_INFO, 
-                                "scaled threads for %s to %d",
-                                ctrl->name, ctrl->curr_thread_count);
-                } else {
-                        tp_ctrl_free (ctrl);
-                        return -1;
-                }
+        pthread_mutex_lock (&ctrl->mutex);
+        while (ctrl->qsize >= ctrl->inject_max && !ctrl->exit_asked) {
+                ctrl->inject_waiters++;
+                pthread_cond_wait (&ctrl->not_full, &ctrl->mutex);
+                ctrl->inject_waiters--;
         }
 
-        return diff;
-}
-
-static int
-__tp_enqueue (tp_ctrl_t *ctrl, tp_t *tp)
-{
-
-	struct xlist_head *queue = &ctrl->queue;
- 
-        xlist_add_tail (&tp->list, queue);
-        ctrl->qsize ++;
+        xlist_add_tail (&tp->list, &ctrl->queue);
+        __atomic_add_fetch (&ctrl->qsize, 1, __ATOMIC_RELAXED);
         xt_log ("thread-pool", XT_LOG_TRACE,
                 "%s ctrl->qsize++ %d. curr_count %d",
                 ctrl->name, ctrl->qsize,
                 ctrl->curr_thread_count);
-
-        pthread_cond_signal (&ctrl->cond);
-        __tp_threads_scale (ctrl, ctrl->qsize);
+        tp_threads_scale (ctrl, _xt_true);
+        pthread_mutex_unlock (&ctrl->mutex);
 
         return 0;
 }
 
-int tp_enqueue (tp_ctrl_t *ctrl, tp_t *tp)
-{
-	int ret;
-
-	pthread_mutex_lock (&ctrl->mutex);
-	ret = __tp_enqueue(ctrl, tp);
-	pthread_mutex_unlock (&ctrl->mutex);
-
-	return ret;
-}
-
 tp_ctrl_t *
 tp_ctrl_new (char *name, int32_t stack_size, int32_t idle_time,
 	     int32_t min_thread_count, int32_t max_thread_count)
 {
         tp_ctrl_t *ctrl = NULL;
+        int i = 0;
         int ret;
 
+        if (max_thread_count <= 0 || min_thread_count > max_thread_count)
+                return NULL;
+
         ctrl = CALLOC (1, sizeof(tp_ctrl_t));
         if (ctrl == NULL) return NULL;
 
         pthread_mutex_init (&ctrl->mutex, NULL);
+        pthread_cond_init (&ctrl->cond, NULL);
+        pthread_cond_init (&ctrl->not_full, NULL);
         ctrl->stack_size = stack_size;
         ctrl->idle_time = idle_time;
         ctrl->max_thread_count = max_thread_count;
         ctrl->min_thread_count = min_thread_count;
+        ctrl->inject_max = TP_DEFAULT_INJECT_MAX;
         ctrl->refcount = 1;
         ctrl->name = name? xt_strdup (name) : xt_strdup ("anon-worker");
         ctrl->exit_asked = _xt_false;
 
         INIT_XLIST_HEAD (&ctrl->queue);
 
-        if (!ctrl->name) {
+        ctrl->workers = XT_CALLOC (max_thread_count, sizeof(tp_worker_t));
+        if (!ctrl->name || !ctrl->workers) {
                 tp_ctrl_free (ctrl);
                 return NULL;
         }
 
+        for (i = 0; i < max_thread_count; i++) {
+                tp_worker_t *w = &ctrl->workers[i];
+
+                w->ctrl = ctrl;
+                w->index = i;
+                w->seed = 2654435761U * (i + 1);
+                if (wsdeque_init (&w->deque, TP_DEQUE_SIZE)) {
+                        tp_ctrl_free (ctrl);
+                        return NULL;
+                }
+        }
+
         pthread_attr_init (&ctrl->w_attr);
+        pthread_attr_setdetachstate (&ctrl->w_attr, PTHREAD_CREATE_DETACHED);
         ret = pthread_attr_setstacksize (&ctrl->w_attr, ctrl->stack_size);
         if (ret == EINVAL) {
                 xt_log ("", XT_LOG_WARNING,
@@ -244,6 +415,7 @@ tp_ctrl_free (tp_ctrl_t *ctrl)
 {
         int refcount;
 	tp_t *tp = NULL;
+        int i = 0;
 
         refcount = atomic_sub_and_fetch(&((ctrl)->refcount), 1);
         if (refcount > 0) {
@@ -259,12 +431,29 @@ tp_ctrl_free (tp_ctrl_t *ctrl)
 		}
 	}
 
+        /*
+         * the tasks left by the workers asked to exit
+         */
+        for (i = 0; ctrl->workers && i < ctrl->max_thread_count; i++) {
+                if (!ctrl->workers[i].deque.buf)
+                        continue;
+                while ((tp = wsdeque_pop (&ctrl->workers[i].deque))) {
+                        if (tp->cleanup)
+                                tp->cleanup (tp);
+                }
+                wsdeque_destroy (&ctrl->workers[i].deque);
+        }
+
         if (ctrl->name) {
                 XT_FREE (ctrl->name);
         }
 
 	pthread_mutex_unlock(&ctrl->mutex);
 	pthread_cond_destroy(&ctrl->cond);
+	pthread_cond_destroy(&ctrl->not_full);
+        pthread_mutex_destroy(&ctrl->mutex);
+        if (ctrl->workers)
+                XT_FREE (ctrl->workers);
         FREE(ctrl);
 
         return 0;
@@ -273,13 +462,20 @@ tp_ctrl_free (tp_ctrl_t *ctrl)
 int
 tp_threads_start (tp_ctrl_t *ctrl)
 {
+        int ret = 0;
+
         if (!ctrl) return -1;
 
         pthread_mutex_lock (&ctrl->mutex);
-        __tp_threads_scale (ctrl, 0);
+        while (ctrl->curr_thread_count < ctrl->min_thread_count ||
+               ctrl->curr_thread_count == 0) {
+                ret = __tp_worker_add (ctrl);
+                if (ret)
+                        break;
+        }
         pthread_mutex_unlock (&ctrl->mutex);
 
-        return 0;
+        return ret;
 }
 
 int
@@ -290,6 +486,7 @@ tp_threads_finish (tp_ctrl_t *ctrl)
         pthread_mutex_lock (&ctrl->mutex);
         ctrl->exit_asked = _xt_true;
 	pthread_cond_broadcast (&ctrl->cond);
+	pthread_cond_broadcast (&ctrl->not_full);
         pthread_mutex_unlock (&ctrl->mutex);
 
         return 0;
@@ -305,12 +502,15 @@ tp_purge (tp_ctrl_t *ctrl, tp_match_t match, void *data)
         INIT_XLIST_HEAD (&purge_list);
 
         pthread_mutex_lock (&ctrl->mutex);
-        xlist_for_each_entry (tp, &ctrl->queue, list) {
+        xlist_for_each_entry_safe (tp, tmp, &ctrl->queue, list) {
 		if (match (tp, data)) {
 			xlist_move_tail(&tp->list, &purge_list);
-			ctrl->qsize--;
+			__atomic_sub_fetch (&ctrl->qsize, 1, __ATOMIC_RELAXED);
+                        __atomic_sub_fetch (&ctrl->pending, 1,
+                                            __ATOMIC_RELAXED);
 		}
         }
+        pthread_cond_broadcast (&ctrl->not_full);
         pthread_mutex_unlock (&ctrl->mutex);
 
         xlist_for_each_entry_safe (tp, tmp, &purge_list, list) {
@@ -322,3 +522,22 @@ tp_purge (tp_ctrl_t *ctrl, tp_match_t match, void *data)
         return 0;
 }
 
+uint64_t
+tp_processed (tp_ctrl_t *ctrl, uint64_t *stolen)
+{
+        uint64_t processed = 0;
+        int i = 0;
+
+        if (stolen)
+                *stolen = 0;
+
+        for (i = 0; i < ctrl->max_thread_count; i++) {
+                processed += __atomic_load_n (&ctrl->workers[i].processed,
+                                              __ATOMIC_RELAXED);
+                if (stolen)
+                        *stolen += __atomic_load_n (&ctrl->workers[i].stolen,
+                                                    __ATOMIC_RELAXED);
+        }
+
+        return processed;
+}
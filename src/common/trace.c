@@ -0,0 +1,275 @@
+/*
+ * Copyright (c) 2016 XTAO Technology <www.xtaotech.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "mem.h"
+#include "logging.h"
+#include "trace.h"
+
+#define MHTRACE "MH_TRACE"
+
+#define MH_TRACE_CALIBRATE_NS	20000000L
+
+typedef struct mh_trace_ring {
+	mh_trace_hdr_t *hdr;
+	mh_trace_rec_t *recs;
+	uint64_t mask;
+	size_t size;
+} mh_trace_ring_t;
+
+int mh_trace_enabled;
+
+static char *mh_trace_dir;
+static unsigned int mh_trace_records;
+static uint64_t mh_trace_tsc_hz;
+static uint64_t mh_trace_tsc_base;
+static uint64_t mh_trace_time_base;
+static pthread_key_t mh_trace_key;
+
+/*
+ * the ring of the thread, (void *)-1 if it failed to map one
+ */
+static __thread mh_trace_ring_t *mh_trace_cur;
+
+static const char *mh_trace_names[MH_TR_MAX] = {
+	[MH_TR_PUSH] = "push",
+	[MH_TR_RESUME] = "resume",
+	[MH_TR_SKIP] = "skip",
+	[MH_TR_FOLD] = "fold",
+	[MH_TR_TAKE] = "take",
+	[MH_TR_FUSED] = "fused",
+	[MH_TR_POST] = "post",
+	[MH_TR_DONE] = "done",
+};
+
+const char *mh_trace_event_name(unsigned int event)
+{
+	if (event >= MH_TR_MAX || !mh_trace_names[event])
+		return "unknown";
+
+	return mh_trace_names[event];
+}
+
+static inline uint64_t mh_trace_clock(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+static uint64_t mh_trace_ns(clockid_t clock)
+{
+	struct timespec ts;
+
+	clock_gettime(clock, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * ticks per second of the trace clock, against CLOCK_MONOTONIC
+ */
+static uint64_t mh_trace_calibrate(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	struct timespec ts = {0, MH_TRACE_CALIBRATE_NS};
+	uint64_t tsc = 0;
+	uint64_t ns = 0;
+
+	ns = mh_trace_ns(CLOCK_MONOTONIC);
+	tsc = mh_trace_clock();
+	nanosleep(&ts, NULL);
+	tsc = mh_trace_clock() - tsc;
+	ns = mh_trace_ns(CLOCK_MONOTONIC) - ns;
+
+	return ns ? tsc * 1000000000ULL / ns : 0;
+#else
+	return 1000000000ULL;
+#endif
+}
+
+static void mh_trace_ring_release(void *data)
+{
+	mh_trace_ring_t *ring = data;
+
+	munmap(ring->hdr, ring->size);
+	XT_FREE(ring);
+}
+
+/*
+ * map the ring file of the calling thread
+ */
+static mh_trace_ring_t *mh_trace_ring_new(void)
+{
+	mh_trace_ring_t *ring = NULL;
+	mh_trace_hdr_t *hdr = NULL;
+	char path[PATH_MAX];
+	pid_t tid = syscall(SYS_gettid);
+	size_t size = 0;
+	int fd = -1;
+
+	size = MH_TRACE_HDR_SIZE +
+	    (size_t)mh_trace_records * sizeof(mh_trace_rec_t);
+	snprintf(path, sizeof(path), "%s/mh-trace.%d.%d", mh_trace_dir,
+	    (int)getpid(), (int)tid);
+
+	fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		xt_log(MHTRACE, XT_LOG_ERROR, "open trace file %s: %s",
+		    path, strerror(errno));
+		return NULL;
+	}
+
+	if (ftruncate(fd, size)) {
+		xt_log(MHTRACE, XT_LOG_ERROR, "size trace file %s: %s",
+		    path, strerror(errno));
+		close(fd);
+		return NULL;
+	}
+
+	hdr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_POPULATE, fd, 0);
+	close(fd);
+	if (hdr == MAP_FAILED) {
+		xt_log(MHTRACE, XT_LOG_ERROR, "map trace file %s: %s",
+		    path, strerror(errno));
+		return NULL;
+	}
+
+	ring = XT_CALLOC(1, sizeof(mh_trace_ring_t));
+	if (ring == NULL) {
+		munmap(hdr, size);
+		return NULL;
+	}
+
+	hdr->version = MH_TRACE_VERSION;
+	hdr->rec_size = sizeof(mh_trace_rec_t);
+	hdr->nr_recs = mh_trace_records;
+	hdr->tsc_hz = mh_trace_tsc_hz;
+	hdr->tsc_base = mh_trace_tsc_base;
+	hdr->time_base = mh_trace_time_base;
+	hdr->pid = getpid();
+	hdr->tid = tid;
+	pthread_getname_np(pthread_self(), hdr->name, sizeof(hdr->name));
+	__atomic_store_n(&hdr->magic, MH_TRACE_MAGIC, __ATOMIC_RELEASE);
+
+	ring->hdr = hdr;
+	ring->recs = (void *)hdr + MH_TRACE_HDR_SIZE;
+	ring->mask = mh_trace_records - 1;
+	ring->size = size;
+	pthread_setspecific(mh_trace_key, ring);
+
+	xt_log(MHTRACE, XT_LOG_INFO, "tracing into %s", path);
+	return ring;
+}
+
+int mh_trace_init(const char *dir, unsigned int records)
+{
+	unsigned int n = 1;
+
+	if (mh_trace_enabled)
+		return 0;
+
+	while (n < records)
+		n <<= 1;
+
+	if (mkdir(dir, 0755) && errno != EEXIST) {
+		xt_log(MHTRACE, XT_LOG_ERROR, "create trace directory %s: %s",
+		    dir, strerror(errno));
+		return errno;
+	}
+
+	mh_trace_dir = xt_strdup(dir);
+	if (mh_trace_dir == NULL)
+		return ENOMEM;
+
+	if (pthread_key_create(&mh_trace_key, mh_trace_ring_release)) {
+		XT_FREE(mh_trace_dir);
+		return ENOMEM;
+	}
+
+	mh_trace_records = n;
+	mh_trace_tsc_hz = mh_trace_calibrate();
+	mh_trace_time_base = mh_trace_ns(CLOCK_REALTIME);
+	mh_trace_tsc_base = mh_trace_clock();
+
+	xt_log(MHTRACE, XT_LOG_INFO, "trace %u records per thread in %s, "
+	    "clock %llu Hz", n, dir, (unsigned long long)mh_trace_tsc_hz);
+
+	__atomic_store_n(&mh_trace_enabled, 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+void mh_trace_event(unsigned int event, uint64_t op, uint64_t ino,
+    unsigned int stage, uint32_t arg)
+{
+	mh_trace_ring_t *ring = mh_trace_cur;
+	mh_trace_rec_t *rec = NULL;
+	uint64_t head = 0;
+
+	if (ring == NULL) {
+		ring = mh_trace_ring_new();
+		mh_trace_cur = ring ? ring : (void *)-1;
+		if (ring == NULL)
+			return;
+	} else if (ring == (void *)-1) {
+		return;
+	}
+
+	head = ring->hdr->head;
+	rec = &ring->recs[head & ring->mask];
+	rec->tsc = mh_trace_clock();
+	rec->op = op;
+	rec->ino = ino;
+	rec->event = event;
+	rec->stage = stage;
+	rec->arg = arg;
+
+	/*
+	 * a reader of a live ring takes the records below head
+	 */
+	__atomic_store_n(&ring->hdr->head, head + 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,134 @@
+/*
+ * Copyright (c) 2016 XTAO Technology <www.xtaotech.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+
+#include "mem.h"
+#include "wsdeque.h"
+
+/*
+ * the memory ordering follows "Correct and Efficient Work-Stealing
+ * for Weak Memory Models" (Le, Pop, Cohen, Zappa Nardelli, PPoPP'13).
+ */
+
+int wsdeque_init(wsdeque_t *q, unsigned long capacity)
+{
+	unsigned long size = 16;
+
+	while (size < capacity)
+		size <<= 1;
+
+	q->buf = XT_CALLOC(size, sizeof(void *));
+	if (q->buf == NULL)
+		return -1;
+
+	q->mask = size - 1;
+	q->top = 0;
+	q->bottom = 0;
+
+	return 0;
+}
+
+void wsdeque_destroy(wsdeque_t *q)
+{
+	XT_FREE(q->buf);
+	q->buf = NULL;
+}
+
+int wsdeque_push(wsdeque_t *q, void *item)
+{
+	long b = __atomic_load_n(&q->bottom, __ATOMIC_RELAXED);
+	long t = __atomic_load_n(&q->top, __ATOMIC_ACQUIRE);
+
+	if (b - t > (long)q->mask)
+		return -1;
+
+	__atomic_store_n(&q->buf[b & q->mask], item, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store_n(&q->bottom, b + 1, __ATOMIC_RELAXED);
+
+	return 0;
+}
+
+void *wsdeque_pop(wsdeque_t *q)
+{
+	long b = __atomic_load_n(&q->bottom, __ATOMIC_RELAXED) - 1;
+	long t = 0;
+	void *item = NULL;
+
+	__atomic_store_n(&q->bottom, b, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	t = __atomic_load_n(&q->top, __ATOMIC_RELAXED);
+
+	if (t > b) {
+		/*
+		 * empty
+		 */
+		__atomic_store_n(&q->bottom, b + 1, __ATOMIC_RELAXED);
+		return NULL;
+	}
+
+	item = __atomic_load_n(&q->buf[b & q->mask], __ATOMIC_RELAXED);
+	if (t == b) {
+		/*
+		 * the last item, race against the stealers
+		 */
+		if (!__atomic_compare_exchange_n(&q->top, &t, t + 1, 0,
+		    __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+			item = NULL;
+		__atomic_store_n(&q->bottom, b + 1, __ATOMIC_RELAXED);
+	}
+
+	return item;
+}
+
+void *wsdeque_steal(wsdeque_t *q)
+{
+	long t = __atomic_load_n(&q->top, __ATOMIC_ACQUIRE);
+	long b = 0;
+	void *item = NULL;
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	b = __atomic_load_n(&q->bottom, __ATOMIC_ACQUIRE);
+
+	if (t >= b)
+		return NULL;
+
+	item = __atomic_load_n(&q->buf[t & q->mask], __ATOMIC_RELAXED);
+	if (!__atomic_compare_exchange_n(&q->top, &t, t + 1, 0,
+	    __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+		return NULL;
+
+	return item;
+}
+
+long wsdeque_size(wsdeque_t *q)
+{
+	long b = __atomic_load_n(&q->bottom, __ATOMIC_RELAXED);
+	long t = __atomic_load_n(&q->top, __ATOMIC_RELAXED);
+
+	return b > t ? b - t : 0;
+}
@@ -281,6 +281,115 @@ static int rbh_rm_inode(void *hdl, char *name, mattr_t *attrs)
 
 }
 
+/*
+ * the inserts of the batch are sent in one multi-row statement, they
+ * are of different objects and independent of the other changes. The
+ * updates and removals are applied after in order, one by one: every
+ * ListMgr call begins and commits its own transaction, so the batch
+ * cannot be wrapped in an outer one.
+ */
+static int rbh_apply_batch(void *hdl, db_batch_op_t *ops, int count)
+{
+	int ret = 0;
+	int err = 0;
+	int i = 0;
+	int n = 0;
+	attr_set_t *as = NULL;
+	attr_set_t **asp = NULL;
+	entry_id_t **idp = NULL;
+	int *idx = NULL;
+
+	xt_log(MH_RBH_DB, XT_LOG_TRACE, "enter rbh_apply_batch");
+
+	for (i = 0; i < count; i++)
+		ops[i].status = -1;
+
+	as = XT_CALLOC(count, sizeof (attr_set_t));
+	asp = XT_CALLOC(count, sizeof (attr_set_t *));
+	idp = XT_CALLOC(count, sizeof (entry_id_t *));
+	idx = XT_CALLOC(count, sizeof (int));
+	if (!as || !asp || !idp || !idx) {
+		xt_log(MH_RBH_DB, XT_LOG_ERROR, "batch allocation failed");
+		err = -1;
+		goto out;
+	}
+
+	for (i = 0; i < count; i++) {
+		if (ops[i].type != db_op_insert || !ops[i].attr)
+			continue;
+
+		mattr_to_rbattr(ops[i].attr, ops[i].name, &as[n]);
+		asp[n] = &as[n];
+		idp[n] = (entry_id_t *)&ops[i].attr->fid;
+		idx[n] = i;
+		n++;
+	}
+
+	/*
+	 * an existing entry fails the insert, as rbh_insert does. If the
+	 * statement fails, the entries it wrote are not inserted again,
+	 * an entry found in the database is reported as rbh_insert would
+	 * report it.
+	 */
+	if (n) {
+		ret = ListMgr_BatchInsert(hdl, idp, asp, n, FALSE);
+		if (ret == 0) {
+			for (i = 0; i < n; i++)
+				ops[idx[i]].status = 0;
+		} else {
+			xt_log(MH_RBH_DB, XT_LOG_WARNING, "rbh batch insert of "
+			    "%u entries failed, insert one by one", n);
+			for (i = 0; i < n; i++) {
+				if (ListMgr_Exists(hdl, idp[i])) {
+					xt_log(MH_RBH_DB, XT_LOG_ERROR,
+					    "rbh_insert of an existing entry");
+					err = -1;
+					continue;
+				}
+
+				ret = ListMgr_Insert(hdl, idp[i], asp[i], FALSE);
+				if (ret) {
+					xt_log(MH_RBH_DB, XT_LOG_ERROR,
+					    "rbh_insert failed");
+					err = ret;
+				}
+				ops[idx[i]].status = ret;
+			}
+		}
+	}
+
+	for (i = 0; i < count; i++) {
+		switch (ops[i].type) {
+		case db_op_insert:
+			continue;
+		case db_op_update:
+			ret = rbh_update(hdl, ops[i].name, ops[i].attr);
+			break;
+		case db_op_rm_dentry:
+			ret = rbh_rm_dentry(hdl, ops[i].name, ops[i].attr);
+			break;
+		case db_op_rm_inode:
+			ret = rbh_rm_inode(hdl, ops[i].name, ops[i].attr);
+			break;
+		default:
+			ret = -1;
+			break;
+		}
+
+		ops[i].status = ret;
+		if (ret)
+			err = ret;
+	}
+
+out:
+	XT_FREE(idx);
+	XT_FREE(idp);
+	XT_FREE(asp);
+	XT_FREE(as);
+	xt_log(MH_RBH_DB, XT_LOG_TRACE, "exit rbh_apply_batch");
+	return err;
+}
+
 struct database_ops db_ops = {
 	.db_conf_parse = rbh_conf_parse,
 	.db_init = rbh_init,
@@ -290,4 +399,5 @@ struct database_ops db_ops = {
 	.db_update = rbh_update,
 	.db_rm_dentry = rbh_rm_dentry,
 	.db_rm_inode = rbh_rm_inode,
+	.db_apply_batch = rbh_apply_batch,
 };
@@ -24,12 +24,36 @@
  * SUCH DAMAGE.
  */
 
+#include <errno.h>
+#include <string.h>
 #include "mem.h"
 #include "logging.h"
 #include "ceph-api.h"
 
 
 #define MH_MAX_NAME 256
+#define CEPH_JENTRY_POOL 4096
+
+/*
+ * a journal entry with its attrs and names in one block of the arena,
+ * one allocation and one free for each record.
+ */
+typedef struct ceph_jentry {
+	journal_entry_t entry;
+	mattr_t attr;
+	mattr_t pattr;
+	mattr_t pattr2;
+	char name[MH_MAX_NAME];
+	char name2[MH_MAX_NAME];
+} ceph_jentry_t;
+
+/*
+ * journal handle
+ */
+typedef struct ceph_journal {
+	struct ceph_mount_info *cmount;
+	struct mem_pool *arena;
+} ceph_journal_t;
 
 
 int ceph_connect_mds_journal(char *cluster, char *mds, char *fs, void **hdl,
@@ -38,6 +62,7 @@ int ceph_connect_mds_journal(char *cluster, char *mds, char *fs, void **hdl,
 	int ret = 0;
 	char conf_path[256] = "";
 	struct ceph_mount_info *cmount = NULL;
+	ceph_journal_t *journal = NULL;
 	uint32_t mds_num = 0;
 	
 	snprintf(conf_path, sizeof(conf_path), "/etc/ceph/%s.conf",
@@ -64,7 +89,19 @@ int ceph_connect_mds_journal(char *cluster, char *mds, char *fs, void **hdl,
 		return ret;
 	}
 	ret = ceph_mh_open_journal(cmount, mds_num);
-	*hdl = (void *)cmount;
+
+	journal = XT_CALLOC(1, sizeof(ceph_journal_t));
+	if (journal == NULL)
+		return ENOMEM;
+
+	journal->cmount = cmount;
+	journal->arena = mem_pool_new_flags(sizeof(ceph_jentry_t),
+	    CEPH_JENTRY_POOL, MEM_POOL_CACHE_ALIGNED);
+	if (journal->arena == NULL) {
+		XT_FREE(journal);
+		return ENOMEM;
+	}
+	*hdl = (void *)journal;
 	
 	ret = ceph_mh_get_root(cmount, (void*)root_ent, sizeof(struct mattr));
 	if (ret) {
@@ -77,29 +114,86 @@ int ceph_connect_mds_journal(char *cluster, char *mds, char *fs, void **hdl,
 
 int ceph_disconnect_mds_journal(void *hdl)
 {
+	ceph_journal_t *journal = hdl;
+
 	xt_log(XT_CEPH_API, XT_LOG_DEBUG, "hunter disconnect %p", hdl);
 
+	/*
+	 * all the entries are freed or released
+	 */
+	mem_pool_destroy(journal->arena);
+	XT_FREE(journal);
 	return 0;
 }
 
+/*
+ * keep a field of the entry in its block, the MDS client fills the
+ * inline buffers the entry points to; a field it points elsewhere is
+ * copied back to the block.
+ */
+static void ceph_jentry_inline(ceph_jentry_t *blk)
+{
+	journal_entry_t *entry = &blk->entry;
+
+	if (entry->name && entry->name != blk->name) {
+		strncpy(blk->name, entry->name, MH_MAX_NAME - 1);
+		blk->name[MH_MAX_NAME - 1] = '\0';
+		entry->name = blk->name;
+	}
+	if (entry->name2 && entry->name2 != blk->name2) {
+		strncpy(blk->name2, entry->name2, MH_MAX_NAME - 1);
+		blk->name2[MH_MAX_NAME - 1] = '\0';
+		entry->name2 = blk->name2;
+	}
+	if (entry->attr && entry->attr != &blk->attr) {
+		blk->attr = *entry->attr;
+		entry->attr = &blk->attr;
+	}
+	if (entry->pattr && entry->pattr != &blk->pattr) {
+		blk->pattr = *entry->pattr;
+		entry->pattr = &blk->pattr;
+	}
+	if (entry->pattr2 && entry->pattr2 != &blk->pattr2) {
+		blk->pattr2 = *entry->pattr2;
+		entry->pattr2 = &blk->pattr2;
+	}
+}
+
 int ceph_hold_journal_entry(void *hdl, journal_entry_t **ppentry)
 {
 	int ret = -1;
-	void * raw_pjentry = NULL;
+	ceph_jentry_t *blk = NULL;
 	int len = 0;
-	struct ceph_mount_info *cmount = (struct ceph_mount_info *)hdl;
+	ceph_journal_t *journal = hdl;
+	struct ceph_mount_info *cmount = journal->cmount;
 	
 	// mh_journal_entry was defined in libcephfs.h
-	//pmhentry = XT_CALLOC(1, sizeof(struct mh_journal_entry));
-	raw_pjentry = XT_CALLOC(1, sizeof(struct journal_entry));
+	blk = mem_get(journal->arena);
+	if (blk == NULL) {
+		xt_log(XT_CEPH_API, XT_LOG_ERROR, "journal entry allocation "
+		    "failed");
+		return ENOMEM;
+	}
+
+	memset(&blk->entry, 0, sizeof(journal_entry_t));
+	blk->name[0] = '\0';
+	blk->name2[0] = '\0';
+	blk->entry.name = blk->name;
+	blk->entry.name2 = blk->name2;
+	blk->entry.attr = &blk->attr;
+	blk->entry.pattr = &blk->pattr;
+	blk->entry.pattr2 = &blk->pattr2;
+
 	len = sizeof(struct journal_entry);
-	ret = ceph_mh_hold_journal_entry(cmount, raw_pjentry, len);
+	ret = ceph_mh_hold_journal_entry(cmount, &blk->entry, len);
 	if (ret) {
+		mem_put(journal->arena, blk);
 		xt_log(XT_CEPH_API, XT_LOG_ERROR, "reach ceph journal end");
 		sleep(120);
 		return ret;
 	}
-	*ppentry = (struct journal_entry *)raw_pjentry;
+	ceph_jentry_inline(blk);
+	*ppentry = &blk->entry;
 	/*
 	*ppentry = (journal_entry_t *)XT_CALLOC(1, sizeof(journal_entry_t));
 	strcpy((*ppentry)->attr.path, "/");
@@ -150,9 +244,9 @@ int ceph_hold_journal_entry(void *hdl, journal_entry_t **ppentry)
 int ceph_release_journal_entry(void *hdl, journal_entry_t *pentry)
 {
 	int ret = -1;
-	struct ceph_mount_info *cmount = (struct ceph_mount_info *)hdl;
+	ceph_journal_t *journal = hdl;
 
-	ret = ceph_mh_release_journal_entry(cmount, pentry->seq);
+	ret = ceph_mh_release_journal_entry(journal->cmount, pentry->seq);
 
 	if (ret) {
 		xt_log(XT_CEPH_API, XT_LOG_ERROR,
@@ -164,8 +258,38 @@ int ceph_release_journal_entry(void *hdl, journal_entry_t *pentry)
 	xt_log(XT_CEPH_API, XT_LOG_INFO,
 	       "ceph release entry seq %d success", pentry->seq);
 
-	XT_FREE(pentry);
-	pentry = NULL;
+	mem_put(journal->arena, pentry);
+	return 0;
+}
+
+void ceph_free_journal_entry(void *hdl, journal_entry_t *pentry)
+{
+	ceph_journal_t *journal = hdl;
+
+	mem_put(journal->arena, pentry);
+}
+
+int ceph_trim_journal(void *hdl, uint64_t seq)
+{
+	int ret = -1;
+	ceph_journal_t *journal = hdl;
+
+	/*
+	 * only used with release_range, which assumes the MDS trims its
+	 * journal up to the released entry, including the entries never
+	 * released on their own
+	 */
+	ret = ceph_mh_release_journal_entry(journal->cmount, seq);
+	if (ret) {
+		xt_log(XT_CEPH_API, XT_LOG_ERROR,
+		       "ceph trim journal up to seq %llu fail",
+		       (unsigned long long)seq);
+		return ret;
+	}
+
+	xt_log(XT_CEPH_API, XT_LOG_DEBUG,
+	       "ceph trim journal up to seq %llu success",
+	       (unsigned long long)seq);
 	return 0;
 }
 
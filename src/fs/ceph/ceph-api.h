@@ -52,6 +52,14 @@ int ceph_hold_journal_entry(void *hdl, journal_entry_t **entry);
  * tell MDS release journal entry
  */
 int ceph_release_journal_entry(void *hdl, journal_entry_t *entry);
+/*
+ * free journal entry without telling MDS
+ */
+void ceph_free_journal_entry(void *hdl, journal_entry_t *entry);
+/*
+ * tell MDS release all journal entries up to seq
+ */
+int ceph_trim_journal(void *hdl, uint64_t seq);
 /*
  * tell MDS not pending on wait new journal and fail all follwing journal read
  */
@@ -24,6 +24,7 @@
  * SUCH DAMAGE.
  */
 
+#include <errno.h>
 #include <string.h>
 #include <features.h>
 #include <utime.h>
@@ -176,6 +177,22 @@ static int ceph_release_jentry(void *hdl, journal_entry_t *entry)
 	return ret;
 }
 
+static void ceph_free_jentry(void *hdl, journal_entry_t *entry)
+{
+	ceph_free_journal_entry(hdl, entry);
+}
+
+static int ceph_trim_jentry(void *hdl, uint64_t seq)
+{
+	int ret = -1;
+
+	xt_log(MH_CEPH, XT_LOG_TRACE, "ceph trim journal enter");
+	ret = ceph_trim_journal(hdl, seq);
+	xt_log(MH_CEPH, XT_LOG_TRACE, "ceph trim journal exit");
+
+	return ret;
+}
+
 static int ceph_fs_mount(void *conf, void **mount)
 {
         int ret = 0;
@@ -217,32 +234,89 @@ static int ceph_fs_lstat(void *mount, const char *path, struct stat *stbuf)
 static int ceph_fs_opendir(void *mount, const char *path, void **dirpp)
 {
 	struct ceph_mount_info *cmount = mount;
-	struct ceph_dir_result *cdir = NULL;
-	int ret = ceph_opendir(cmount, path, &cdir);
-	if (!ret)
-		*dirpp = cdir;
-	return ret;
+	ceph_dir_t *dir = NULL;
+	int ret = 0;
+
+	dir = XT_CALLOC(1, sizeof (ceph_dir_t));
+	if (dir == NULL)
+		return -ENOMEM;
+
+	ret = ceph_opendir(cmount, path, &dir->cdir);
+	if (ret) {
+		XT_FREE(dir);
+		return ret;
+	}
+
+	*dirpp = dir;
+	return 0;
 }
 
 static int ceph_fs_closedir(void *mount, void *dirp)
 {
-	struct ceph_dir_result *cdir = dirp;
+	ceph_dir_t *dir = dirp;
 	struct ceph_mount_info *cmount = mount;
-	return ceph_closedir(cmount, cdir);
+	int ret = 0;
+
+	ret = ceph_closedir(cmount, dir->cdir);
+	XT_FREE(dir);
+
+	return ret;
 }
 
 static struct dirent *ceph_fs_readdir(void *mount, void *dirp)
 {
-	struct ceph_dir_result *cdir = dirp;
+	ceph_dir_t *dir = dirp;
 	struct ceph_mount_info *cmount = mount;
-	return ceph_readdir(cmount, cdir);
+	return ceph_readdir(cmount, dir->cdir);
 }
 
 static int ceph_fs_readdir_r(void *mount, void *dirp, struct dirent *result)
 {
-	struct ceph_dir_result *cdir = dirp;
+	ceph_dir_t *dir = dirp;
+	struct ceph_mount_info *cmount = mount;
+	return ceph_readdir_r(cmount, dir->cdir, result);
+}
+
+/*
+ * the attributes come with the directory listing from the MDS, no
+ * lstat by path per entry
+ */
+static int ceph_fs_readdirplus(void *mount, void *dirp,
+    fs_dirent_plus_t *ents, int count)
+{
+	ceph_dir_t *dir = dirp;
 	struct ceph_mount_info *cmount = mount;
-	return ceph_readdir_r(cmount, cdir, result);
+	int stmask = 0;
+	int ret = 0;
+	int i = 0;
+
+	if (dir->err) {
+		ret = dir->err;
+		dir->err = 0;
+		return ret;
+	}
+
+	for (i = 0; i < count; i++) {
+		ents[i].err = 0;
+		ret = ceph_readdirplus_r(cmount, dir->cdir, &ents[i].dent,
+		    &ents[i].st, &stmask);
+		if (ret < 0) {
+			xt_log(MH_CEPH, XT_LOG_ERROR, "readdirplus failed: %d",
+			    ret);
+			if (i == 0)
+				return ret;
+			/*
+			 * return the entries read, the error with the next
+			 * call
+			 */
+			dir->err = ret;
+			break;
+		}
+		if (ret == 0)
+			break;
+	}
+
+	return i;
 }
 
 struct filesystem_ops fs_ops = {
@@ -257,4 +331,7 @@ struct filesystem_ops fs_ops = {
 	ceph_fs_closedir,
 	ceph_fs_readdir,
 	ceph_fs_readdir_r,
+	ceph_free_jentry,
+	ceph_trim_jentry,
+	ceph_fs_readdirplus,
 };
@@ -32,5 +32,13 @@ typedef struct ceph_config {
 	char *filesystem;
 } ceph_config_t;
 
+/*
+ * a directory, err is a failure of readdirplus after some entries of a
+ * fs_readdirplus call, returned by the next call.
+ */
+typedef struct ceph_dir {
+	struct ceph_dir_result *cdir;
+	int err;
+} ceph_dir_t;
 
 #endif
@@ -0,0 +1,335 @@
+/*
+ * Copyright (c) 2016 XTAO Technology <www.xtaotech.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * local POSIX filesystem, for the scanner only, it has no journal.
+ * The directories are read with getdents64 and the attributes taken
+ * with fstatat relative to the directory, without resolving the full
+ * path for each entry.
+ */
+
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/syscall.h>
+
+#include "cJSON.h"
+#include "mem.h"
+#include "logging.h"
+#include "filesystem.h"
+#include "mh-posix.h"
+
+#define MH_POSIX "MH_POSIX"
+
+struct linux_dirent64 {
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+
+/*
+ * posix configuration:
+ *
+ * "FileSystem" {
+ *	"name": "posix",
+ *	"root": "/mnt/data"
+ * }
+ */
+static int posix_conf_parse(cJSON *seg, void **config)
+{
+	posix_config_t *conf = NULL;
+	cJSON *c = NULL;
+
+	xt_log(MH_POSIX, XT_LOG_TRACE, "config parse enter");
+
+	conf = XT_CALLOC(1, sizeof (posix_config_t));
+	if (!conf) {
+		xt_log(MH_POSIX, XT_LOG_ERROR, "config allocation failed");
+		return -1;
+	}
+
+	c = cJSON_GetObjectItem(seg, "root");
+	if (c && (c->type != cJSON_String || !c->valuestring)) {
+		xt_log(MH_POSIX, XT_LOG_ERROR, "config root invalid");
+		goto err;
+	}
+
+	conf->root = xt_strdup(c ? c->valuestring : "/");
+	if (!conf->root) {
+		xt_log(MH_POSIX, XT_LOG_ERROR, "config allocation failed");
+		goto err;
+	}
+
+	*config = conf;
+
+	xt_log(MH_POSIX, XT_LOG_TRACE, "config parse root:%s", conf->root);
+	return 0;
+err:
+	XT_FREE(conf);
+	return -1;
+}
+
+static int posix_fs_init(void *conf, void **hdl, mattr_t *root)
+{
+	xt_log(MH_POSIX, XT_LOG_ERROR, "posix has no journal, it can only "
+	    "be scanned");
+	return -ENOTSUP;
+}
+
+static int posix_fs_fini(void *hdl)
+{
+	return 0;
+}
+
+static int posix_hold_jentry(void *hdl, journal_entry_t **entry)
+{
+	return -ENOTSUP;
+}
+
+static int posix_release_jentry(void *hdl, journal_entry_t *entry)
+{
+	return -ENOTSUP;
+}
+
+static int posix_fs_mount(void *conf, void **mount)
+{
+	posix_config_t *posix_conf = conf;
+	posix_mount_t *pmount = NULL;
+	int ret = 0;
+
+	pmount = XT_CALLOC(1, sizeof (posix_mount_t));
+	if (!pmount)
+		return -ENOMEM;
+
+	pmount->fd = open(posix_conf->root, O_RDONLY | O_DIRECTORY);
+	if (pmount->fd < 0) {
+		ret = -errno;
+		xt_log(MH_POSIX, XT_LOG_ERROR, "failed to open %s: %s",
+		    posix_conf->root, strerror(errno));
+		XT_FREE(pmount);
+		return ret;
+	}
+
+	pmount->root = posix_conf->root;
+	*mount = pmount;
+
+	return 0;
+}
+
+/*
+ * the paths are relative to the root, "/" or "" is the root itself
+ */
+static const char *posix_relpath(const char *path)
+{
+	while (*path == '/')
+		path++;
+
+	return *path ? path : ".";
+}
+
+static int posix_fs_lstat(void *mount, const char *path, struct stat *stbuf)
+{
+	posix_mount_t *pmount = mount;
+
+	if (fstatat(pmount->fd, posix_relpath(path), stbuf,
+	    AT_SYMLINK_NOFOLLOW))
+		return -errno;
+
+	return 0;
+}
+
+static int posix_fs_opendir(void *mount, const char *path, void **dirpp)
+{
+	posix_mount_t *pmount = mount;
+	posix_dir_t *pdir = NULL;
+	int ret = 0;
+
+	pdir = XT_MALLOC(sizeof (posix_dir_t));
+	if (!pdir)
+		return -ENOMEM;
+
+	pdir->fd = openat(pmount->fd, posix_relpath(path),
+	    O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+	if (pdir->fd < 0) {
+		ret = -errno;
+		XT_FREE(pdir);
+		return ret;
+	}
+
+	pdir->pos = 0;
+	pdir->len = 0;
+	pdir->err = 0;
+	*dirpp = pdir;
+
+	return 0;
+}
+
+static int posix_fs_closedir(void *mount, void *dirp)
+{
+	posix_dir_t *pdir = dirp;
+	int ret = 0;
+
+	ret = close(pdir->fd);
+	XT_FREE(pdir);
+
+	return ret ? -errno : 0;
+}
+
+/*
+ * next raw entry, NULL at the end with errno 0, or on failure
+ */
+static struct linux_dirent64 *posix_next(posix_dir_t *pdir)
+{
+	struct linux_dirent64 *d = NULL;
+	long len = 0;
+
+	if (pdir->pos >= pdir->len) {
+		len = syscall(SYS_getdents64, pdir->fd, pdir->buf,
+		    sizeof (pdir->buf));
+		if (len <= 0) {
+			errno = len ? errno : 0;
+			return NULL;
+		}
+		pdir->pos = 0;
+		pdir->len = len;
+	}
+
+	d = (struct linux_dirent64 *)(pdir->buf + pdir->pos);
+	pdir->pos += d->d_reclen;
+
+	return d;
+}
+
+static void posix_dirent(struct dirent *dent, struct linux_dirent64 *d)
+{
+	dent->d_ino = d->d_ino;
+	dent->d_off = d->d_off;
+	dent->d_reclen = sizeof (struct dirent);
+	dent->d_type = d->d_type;
+	strncpy(dent->d_name, d->d_name, sizeof (dent->d_name) - 1);
+	dent->d_name[sizeof (dent->d_name) - 1] = '\0';
+}
+
+static struct dirent *posix_fs_readdir(void *mount, void *dirp)
+{
+	posix_dir_t *pdir = dirp;
+	struct linux_dirent64 *d = NULL;
+
+	d = posix_next(pdir);
+	if (!d)
+		return NULL;
+
+	posix_dirent(&pdir->dent, d);
+	return &pdir->dent;
+}
+
+/*
+ * 1 with an entry, 0 at the end, a negative errno on failure
+ */
+static int posix_fs_readdir_r(void *mount, void *dirp, struct dirent *result)
+{
+	posix_dir_t *pdir = dirp;
+	struct linux_dirent64 *d = NULL;
+
+	d = posix_next(pdir);
+	if (!d)
+		return -errno;
+
+	posix_dirent(result, d);
+	return 1;
+}
+
+static int posix_fs_readdirplus(void *mount, void *dirp,
+    fs_dirent_plus_t *ents, int count)
+{
+	posix_dir_t *pdir = dirp;
+	struct linux_dirent64 *d = NULL;
+	int ret = 0;
+	int i = 0;
+
+	if (pdir->err) {
+		ret = pdir->err;
+		pdir->err = 0;
+		return ret;
+	}
+
+	while (i < count) {
+		d = posix_next(pdir);
+		if (!d) {
+			if (!errno)
+				break;
+			if (i == 0)
+				return -errno;
+			/*
+			 * return the entries read, the error with the next
+			 * call
+			 */
+			pdir->err = -errno;
+			break;
+		}
+
+		ents[i].err = 0;
+		if (fstatat(pdir->fd, d->d_name, &ents[i].st,
+		    AT_SYMLINK_NOFOLLOW)) {
+			/*
+			 * removed since it was listed
+			 */
+			if (errno == ENOENT)
+				continue;
+			xt_log(MH_POSIX, XT_LOG_WARNING, "failed to stat %s: %s",
+			    d->d_name, strerror(errno));
+			ents[i].err = -errno;
+		}
+
+		posix_dirent(&ents[i].dent, d);
+		i++;
+	}
+
+	return i;
+}
+
+struct filesystem_ops fs_ops = {
+	posix_conf_parse,
+	posix_fs_init,
+	posix_fs_fini,
+	posix_hold_jentry,
+	posix_release_jentry,
+	posix_fs_mount,
+	posix_fs_lstat,
+	posix_fs_opendir,
+	posix_fs_closedir,
+	posix_fs_readdir,
+	posix_fs_readdir_r,
+	NULL,
+	NULL,
+	posix_fs_readdirplus,
+};
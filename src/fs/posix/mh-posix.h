@@ -0,0 +1,60 @@
+/*
+ * Copyright (c) 2016 XTAO Technology <www.xtaotech.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#ifndef __MH_POSIX_H__
+#define __MH_POSIX_H__
+
+#include <dirent.h>
+
+#define POSIX_DIRBUF	32768
+
+typedef struct posix_config {
+	char *root;
+} posix_config_t;
+
+/*
+ * the mount is the root directory of the scan
+ */
+typedef struct posix_mount {
+	char *root;
+	int fd;
+} posix_mount_t;
+
+/*
+ * a directory read with getdents64, buf holds the raw entries from pos
+ * to len, dent the last entry returned by fs_readdir. err is a failure
+ * of getdents64 after some entries of a fs_readdirplus call, returned
+ * by the next call.
+ */
+typedef struct posix_dir {
+	int fd;
+	long pos;
+	long len;
+	int err;
+	struct dirent dent;
+	char buf[POSIX_DIRBUF];
+} posix_dir_t;
+
+#endif
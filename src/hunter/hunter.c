@@ -42,15 +42,25 @@
 #include "database.h"
 #include "filesystem.h"
 #include "processor.h"
+#include "metrics.h"
+#include "checkpoint.h"
+
+/*
+ * back off of a push when the processor is out of ops
+ */
+#define READER_PUSH_RETRY_US	1000
 
 static pthread_t sigwaiter;
 
 static metahunter_t reader_info;
 
+static char *reader_conf_file = MH_DEFAULT_CONF_FILE;
+
 /*
  * allocated a op and then push the op into pipeline
  */
-static int queue_log_entry(metahunter_t *info, journal_entry_t *entry)
+static int queue_log_entry(metahunter_t *info, journal_entry_t *entry,
+    uint64_t ts_hold)
 {
 	entry_proc_op_t *op;
 	processor_t *pl = info->processor;
@@ -63,7 +73,7 @@ static int queue_log_entry(metahunter_t *info, journal_entry_t *entry)
 	}
 
 	op->stage = 0;
-	op->log_inserted = time(NULL);
+	op->ts_hold = ts_hold;
 	op->extra_info = entry;
 	op->id = entry->attr->fid.inode;
 	op->pid = entry->attr->parentid.inode;
@@ -98,6 +108,8 @@ static void *log_reader_thr(void *arg)
 	filesystem_t *fs = info->fs;
 	mattr_t *rattr = &fs->root;
 	journal_entry_t roent;
+	uint64_t ts_hold = 0;
+	uint64_t skip = 0;
 	int ret = 0;
 
 	xt_log("reader", XT_LOG_INFO, "start log reader thread ...");
@@ -114,17 +126,46 @@ static void *log_reader_thr(void *arg)
 	/*
 	 * queue root entry
 	 */
-	queue_log_entry(info, &roent);
+	queue_log_entry(info, &roent, xt_now_ns());
+
+	if (info->checkpoint)
+		skip = info->checkpoint->loaded;
 
 	while (!info->force_stop) {
 		ret = filesystem_hold_jentry(fs, &entry);
+		ts_hold = xt_now_ns();
 		if (ret == 0) {
 			/*
 			 * got new entry, then queue it
 			 */
 			xt_log("reader", XT_LOG_TRACE, "hold entry entry:%llx",
 			    (unsigned long long)entry->seq);
-			queue_log_entry(info, entry);
+			info->nb_read++;
+			info->last_read_time = time(NULL);
+			info->last_read_record = entry->seq;
+
+			if (entry->seq <= skip) {
+				/*
+				 * committed before the restart
+				 */
+				info->nb_skipped++;
+				filesystem_release_jentry(fs, entry);
+				continue;
+			}
+
+			/*
+			 * the entry holds the release watermark, it is
+			 * pushed or released, never left behind
+			 */
+			while ((ret = queue_log_entry(info, entry, ts_hold)) &&
+			    !info->force_stop)
+				usleep(READER_PUSH_RETRY_US);
+			if (ret) {
+				info->nb_dropped++;
+				filesystem_release_jentry(fs, entry);
+				continue;
+			}
+			info->last_pushed = entry->seq;
 		} else if (ret == -1) {
 			/*
 			 * MDS stops
@@ -202,6 +243,45 @@ static int xt_log_reader_start(metahunter_t *info)
 		goto err;
 	}
 
+	/*
+	 * the stats server is optional, the hunter runs without it
+	 */
+	if (info->metrics && metrics_start(info->metrics, info)) {
+		xt_log("reader", XT_LOG_WARNING, "Failed to start metrics "
+		    "server ...");
+	}
+
+	/*
+	 * the journal is released up to the contiguous watermark of
+	 * the released entries.
+	 */
+	fs->committed_record = &info->last_committed_record;
+	fs->cleared_record = &info->last_cleared_record;
+	ret = filesystem_release_start(fs);
+	if (ret) {
+		ret = -1;
+		xt_log("reader", XT_LOG_ERROR, "Failed to start journal "
+		    "release ...");
+		goto err;
+	}
+
+	/*
+	 * the entries up to the checkpoint are skipped, the committed
+	 * records are stored from now on.
+	 */
+	if (info->checkpoint) {
+		ret = checkpoint_load(info->checkpoint);
+		if (ret == 0)
+			ret = checkpoint_start(info->checkpoint,
+			    &info->last_committed_record);
+		if (ret) {
+			ret = -1;
+			xt_log("reader", XT_LOG_ERROR, "Failed to start "
+			    "checkpoint ...");
+			goto err;
+		}
+	}
+
 	/*
 	 * start the reader main thread
 	 */
@@ -232,7 +312,13 @@ err:
 		mem_pool_destroy(info->attr_pool);
 	}
 
+	if (info->metrics)
+		metrics_stop(info->metrics);
+
 	processor_cleanup(processor);
+	filesystem_release_stop(fs);
+	if (info->checkpoint)
+		checkpoint_stop(info->checkpoint);
 
 	return ret;
 }
@@ -249,7 +335,12 @@ static void xt_log_reader_terminate(metahunter_t *info)
 	/* ask threads to stop */
 	info->force_stop = 1;
 	xt_log_reader_wait(info);
+	if (info->metrics)
+		metrics_stop(info->metrics);
 	processor_cleanup(info->processor);
+	filesystem_release_stop(info->fs);
+	if (info->checkpoint)
+		checkpoint_stop(info->checkpoint);
 }
 
 static int xt_create_pid_file(const char *pid_file)
@@ -303,6 +394,15 @@ static void *xt_sigwaiter (void *arg)
                         break;
                 case SIGUSR1:
 			xt_log("hunter", XT_LOG_ERROR, "handle signal USR1");
+			/*
+			 * reload the log levels, dump the statistics of
+			 * pipeline stages
+			 */
+			if (xt_parse_log_config(reader_conf_file))
+				xt_log("hunter", XT_LOG_WARNING, "failed to "
+				    "reload log levels");
+			if (reader_info.processor)
+				processor_stats_dump(reader_info.processor);
                         break;
                 default:
 
@@ -437,6 +537,15 @@ int main(int argc, char **argv)
 		}
 	}
 
+	/*
+	 * the log writer thread, after the fork of daemon()
+	 */
+	ret = xt_log_async_start();
+	if (ret)
+		xt_log("hunter", XT_LOG_WARNING, "Failed to start log writer, "
+		    "logging synchronously.");
+
+	reader_conf_file = conf_file;
 	ret = xt_parse_config(conf_file, info);
 	if (ret) {
 		xt_log("hunter", XT_LOG_ERROR, "Failed to parse configuration"
@@ -29,5 +29,6 @@
 
 #include "hunter.h"
 int xt_parse_config(char *conffile, metahunter_t *mh);
+int xt_parse_log_config(char *conffile);
 
 #endif
@@ -0,0 +1,88 @@
+/*
+ * Copyright (c) 2016 XTAO Technology <www.xtaotech.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef __MH_CHECKPOINT_H__
+#define __MH_CHECKPOINT_H__
+
+#include <stdint.h>
+#include <pthread.h>
+#include "locking.h"
+
+/*
+ * checkpoint of the committed journal watermark. The watermark is
+ * stored every interval ms if it advanced, the store is durable when
+ * it returns, so the advances of an interval share a single sync. At
+ * startup the reader skips the journal entries up to the loaded
+ * checkpoint.
+ */
+struct checkpoint_ops {
+	const char *name;
+	int (*ck_open) (const char *path, void **hdl);
+	/*
+	 * ENOENT if no checkpoint is stored yet
+	 */
+	int (*ck_load) (void *hdl, uint64_t *seq);
+	int (*ck_store) (void *hdl, uint64_t seq);
+	void (*ck_close) (void *hdl);
+};
+
+typedef struct checkpoint {
+	char *type;
+	char *path;
+	unsigned int interval; /* ms */
+	const struct checkpoint_ops *ops;
+	void *hdl;
+
+	uint64_t loaded; /* the entries up to it are skipped */
+	uint64_t stored;
+	unsigned long long nb_stores;
+	unsigned long long *committed; /* watermark to store */
+
+	xt_lock_t lock;
+	xt_cond_t cond;
+	pthread_t tid;
+	int running;
+	int exiting;
+} checkpoint_t;
+
+/*
+ * open the checkpoint of the configured type and load the stored
+ * watermark into loaded, 0 if none.
+ */
+int checkpoint_load(checkpoint_t *ck);
+
+/*
+ * start storing @committed every interval ms
+ */
+int checkpoint_start(checkpoint_t *ck, unsigned long long *committed);
+
+/*
+ * store the last watermark and close the checkpoint, it is fine to
+ * stop a checkpoint which is not started.
+ */
+void checkpoint_stop(checkpoint_t *ck);
+
+#endif /* __MH_CHECKPOINT_H__ */
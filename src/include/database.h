@@ -71,6 +71,34 @@ typedef int (*database_remove_dentry_t) (void *hdl, char *name, mattr_t *attr);
  */
 typedef int (*database_remove_inode_t) (void *hdl, char *name, mattr_t *attr);
 
+/*
+ * record change of a batch
+ */
+typedef enum {
+	db_op_insert = 0,
+	db_op_update,
+	db_op_rm_dentry,
+	db_op_rm_inode
+} db_op_type_t;
+
+typedef struct db_batch_op {
+	db_op_type_t type;
+	char *name;
+	mattr_t *attr;
+	int status; /* set by the apply, 0 if the change is applied */
+} db_batch_op_t;
+
+/*
+ * apply a batch of record changes, with fewer round trips than one
+ * call per change where the database allows it, the batch is not
+ * atomic. The changes of different objects in a batch are independent,
+ * except the updates of the same object must be applied in order. All
+ * the changes are tried even if some of them fail, the status of each
+ * change is set, return 0 if all the changes are applied.
+ */
+typedef int (*database_apply_batch_t) (void *hdl, db_batch_op_t *ops,
+    int count);
+
 struct database_ops {
 	database_conf_parse_t db_conf_parse;
 	database_init_t db_init;
@@ -80,6 +108,7 @@ struct database_ops {
 	database_update_t db_update;
 	database_remove_dentry_t db_rm_dentry;
 	database_remove_inode_t db_rm_inode;
+	database_apply_batch_t db_apply_batch; /* optional */
 };
 
 typedef struct database_desc {
@@ -106,4 +135,7 @@ int database_remove_dentry(database_t *db, void *hdl, char *name, mattr_t *attr)
 
 int database_remove_inode(database_t *db, void *hdl, char *name, mattr_t *attr);
 
+int database_apply_batch(database_t *db, void *hdl, db_batch_op_t *ops,
+    int count);
+
 #endif
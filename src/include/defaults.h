@@ -30,5 +30,16 @@
 #define MH_DEFAULT_CONF_FILE "/etc/metahunter.conf"
 #define MH_DEFAULT_LOG_FILE "/var/log/metahunter.log"
 #define MH_DEFAULT_PID_FILE "/var/run/metahunter.pid"
+#define MH_DEFAULT_METRICS_SOCK "/var/run/metahunter.sock"
+#define MH_DEFAULT_RELEASE_BATCH 1024
+#define MH_DEFAULT_RELEASE_INTERVAL 100 /* ms */
+#define MH_DEFAULT_CHECKPOINT_TYPE "file"
+#define MH_DEFAULT_CHECKPOINT_FILE "/var/lib/metahunter/checkpoint"
+#define MH_DEFAULT_CHECKPOINT_INTERVAL 1000 /* ms */
+#define MH_DEFAULT_TRACE_DIR "/var/lib/metahunter/trace"
+#define MH_DEFAULT_TRACE_RECORDS 65536 /* per thread */
+#define MH_DEFAULT_SCAN_WALKERS 8
+#define MH_DEFAULT_SCAN_MAX_OPEN_DIRS 64
+#define MH_DEFAULT_SCAN_PROGRESS 10 /* s */
 
 #endif
@@ -26,8 +26,12 @@
 #ifndef __MH_FILESYSTEM_H__
 #define __MH_FILESYSTEM_H__
 
+#include <stdint.h>
 #include <unistd.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include "locking.h"
 #include "cJSON.h"
 #include "mattr.h"
 
@@ -81,6 +85,17 @@ typedef int (*filesystem_hold_journal_entry_t) (void *hdl,
 typedef int (*filesystem_release_journal_entry_t) (void *hdl,
     journal_entry_t *entry);
 
+/*
+ * Free journal entry without releasing it, optional
+ */
+typedef void (*filesystem_free_journal_entry_t) (void *hdl,
+    journal_entry_t *entry);
+
+/*
+ * Release all the journal entries up to seq at once, optional
+ */
+typedef int (*filesystem_trim_journal_t) (void *hdl, uint64_t seq);
+
 typedef int (*filesystem_mount_t) (void *conf, void **mount);
 
 typedef int (*filesystem_lstat_t) (void *mount, const char *path, struct stat *stbuf);
@@ -93,6 +108,25 @@ typedef struct dirent* (*filesystem_readdir_t) (void *mount, void *dirp);
 
 typedef int (*filesystem_readdir_r_t) (void *mount, void *dirp, struct dirent* ent);
 
+/*
+ * a directory entry with its attributes
+ */
+typedef struct fs_dirent_plus {
+	struct dirent dent;
+	struct stat st;
+	int err;	/* negative errno if st could not be read */
+} fs_dirent_plus_t;
+
+/*
+ * Read up to count entries of the directory with their attributes in
+ * one call, optional. Return the number of entries read, 0 at the end
+ * of the directory, a negative errno on failure. A failure after some
+ * entries are read is returned by the next call. An entry whose
+ * attributes could not be read is returned with err set.
+ */
+typedef int (*filesystem_readdirplus_t) (void *mount, void *dirp,
+    fs_dirent_plus_t *ents, int count);
+
 struct filesystem_ops {
 	filesystem_conf_parse_t fs_conf_parse;
 	filesystem_init_t fs_init;
@@ -105,8 +139,40 @@ struct filesystem_ops {
 	filesystem_closedir_t fs_closedir;
 	filesystem_readdir_t fs_readdir;
 	filesystem_readdir_r_t fs_readdir_r;
+	filesystem_free_journal_entry_t fs_free_jentry;
+	filesystem_trim_journal_t fs_trim_journal;
+	filesystem_readdirplus_t fs_readdirplus;
 };
 
+/*
+ * watermark of the released journal entries. The held entries are
+ * appended in seq order, a released entry is marked done and the done
+ * entries at the head advance the watermark. If range release is
+ * configured and the filesystem trims the journal by range, the released
+ * entries are only freed and the
+ * flusher trims the journal up to the watermark every release_batch
+ * entries or release_interval ms.
+ */
+typedef struct fs_wmark_slot {
+	uint64_t seq;
+	int done;
+} fs_wmark_slot_t;
+
+typedef struct fs_wmark {
+	xt_lock_t lock;
+	xt_cond_t cond;
+	fs_wmark_slot_t *slots;
+	unsigned long size; /* power of 2 */
+	unsigned long head;
+	unsigned long tail;
+	uint64_t committed; /* the entries up to it are released */
+	uint64_t cleared; /* the journal is trimmed up to it */
+	unsigned long pending; /* released since the last trim */
+	int trim; /* released by fs_trim_journal */
+	int exiting;
+	pthread_t tid;
+} fs_wmark_t;
+
 typedef struct filesystem_desc {
 	char *name;
 	void *conf;
@@ -114,6 +180,16 @@ typedef struct filesystem_desc {
 	void *private;
 	mattr_t root;
 	struct filesystem_ops *fs_ops;
+
+	/*
+	 * journal release watermark
+	 */
+	fs_wmark_t *wmark;
+	int release_range; /* trim by range if the fs supports it */
+	unsigned int release_batch;
+	unsigned int release_interval; /* ms */
+	unsigned long long *committed_record; /* optional, set to committed */
+	unsigned long long *cleared_record; /* optional, set to cleared */
 } filesystem_t;
 
 int filesystem_load(filesystem_t *fs);
@@ -126,6 +202,10 @@ int filesystem_hold_jentry(filesystem_t *fs, journal_entry_t **entry);
 
 void filesystem_release_jentry(filesystem_t *fs, journal_entry_t *entry);
 
+int filesystem_release_start(filesystem_t *fs);
+
+void filesystem_release_stop(filesystem_t *fs);
+
 int filesystem_mount(filesystem_t *fs);
 
 int filesystem_lstat(filesystem_t *fs, const char *path, struct stat *stbuf);
@@ -138,4 +218,10 @@ struct dirent *filesystem_readdir(filesystem_t *fs, void *dirp);
 
 int filesystem_readdir_r(filesystem_t *fs, void *dirp, struct dirent* ent);
 
+int filesystem_readdirplus(filesystem_t *fs, void *dirp,
+    fs_dirent_plus_t *ents, int count);
+
+#define filesystem_has_readdirplus(fs) \
+	((fs)->fs_ops->fs_readdirplus != NULL)
+
 #endif
@@ -38,6 +38,30 @@
 #include "database.h"
 #include "filesystem.h"
 #include "processor.h"
+#include "metrics.h"
+#include "checkpoint.h"
+
+/*
+ * parallel namespace scan, "walkers" threads read the directories,
+ * at most "max_open_dirs" directories are open at once. With
+ * "bulk_load" the entries of a scan into an empty database bypass the
+ * pipeline. The progress counters are updated atomically by the
+ * walkers.
+ */
+typedef struct scan_ctrl
+{
+	int walkers;
+	int max_open_dirs;
+	int bulk_load;
+
+	unsigned long long dirs;	/* directories read */
+	unsigned long long entries;	/* entries pushed to the pipeline */
+	unsigned long long errors;	/* failed opendir and lstat */
+	int open_dirs;
+	long queued_dirs;		/* directories waiting for a walker */
+	unsigned long long loaded;	/* entries bulk loaded */
+	unsigned long long batches;	/* bulk load batches */
+} scan_ctrl_t;
 
 /* reader thread info, one per MDS */
 typedef struct metahunter
@@ -57,15 +81,21 @@ typedef struct metahunter
 	/** last read record id */
 	unsigned long long last_read_record;
 
-	/** last record id committed to database */
+	/** records up to this id are committed to database */
 	unsigned long long last_committed_record;
 
-	/** last record id cleared with changelog */
+	/** records up to this id are cleared with changelog */
 	unsigned long long last_cleared_record;
 
 	/** last record pushed to the pipeline */
 	unsigned long long last_pushed;
 
+	/** nbr of records skipped up to the checkpoint */
+	unsigned long long nb_skipped;
+
+	/** nbr of records released unprocessed on stop */
+	unsigned long long nb_dropped;
+
 	/** thread was asked to stop */
 	unsigned int force_stop : 1;
 
@@ -92,6 +122,20 @@ typedef struct metahunter
 	struct mem_pool *entry_pool;
 	struct mem_pool *attr_pool;
 
+	/*
+	 * stats server, NULL if not configured
+	 */
+	metrics_server_t *metrics;
+
+	/*
+	 * checkpoint of the committed records, NULL if not configured
+	 */
+	checkpoint_t *checkpoint;
+
+	/*
+	 * namespace scan of the scanner, NULL in the hunter
+	 */
+	scan_ctrl_t *scan;
 
 } metahunter_t;
 
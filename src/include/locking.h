@@ -33,6 +33,9 @@
 #endif
 
 #include <pthread.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 
 #define LOCK_INIT(x)    pthread_mutex_init (x, 0)
 #define LOCK(x)         pthread_mutex_lock (x)
@@ -46,6 +49,15 @@
 #define COND_SIGNAL(x)		pthread_cond_signal(x)
 #define COND_DESTROY(x)		pthread_cond_destroy(x)
 
+/*
+ * sleep while the 32 bit word at x equals val, and wake up n
+ * waiters of the word. Both are process private.
+ */
+#define XT_FUTEX_WAIT(x, val)	\
+	syscall(SYS_futex, x, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0)
+#define XT_FUTEX_WAKE(x, n)	\
+	syscall(SYS_futex, x, FUTEX_WAKE_PRIVATE, n, NULL, NULL, 0)
+
 typedef pthread_mutex_t xt_lock_t;
 typedef pthread_cond_t xt_cond_t;
 
@@ -65,6 +65,27 @@ typedef enum {
         XT_LOG_TRACE,      /* full trace of operation */
 } xt_loglevel_t;
 
+/*
+ * what a thread does with a record when its log ring is full
+ */
+typedef enum {
+        XT_LOG_FULL_DROP,       /* count it and go on */
+        XT_LOG_FULL_BLOCK,      /* wait for the writer */
+} xt_log_full_t;
+
+struct xt_log_async;
+
+/*
+ * log level of a domain, overriding the global one
+ */
+#define XT_LOG_MAX_DOMAINS      32
+#define XT_LOG_DOMAIN_SIZE      32
+
+typedef struct xt_log_domain {
+        char             name[XT_LOG_DOMAIN_SIZE];
+        xt_loglevel_t    level;
+} xt_log_domain_t;
+
 typedef struct xt_log_handle_ {
         xt_lock_t  logfile_mutex;
         xt_loglevel_t    loglevel;
@@ -72,29 +93,52 @@ typedef struct xt_log_handle_ {
         xt_loglevel_t    sys_log_level;
         FILE            *logfile;
         size_t          log_max_size; 
+        struct xt_log_async *async;
+        xt_log_domain_t  domains[XT_LOG_MAX_DOMAINS];
+        int              nr_domains;
 } xt_log_handle_t;
 
+/*
+ * the messages above XT_LOG_COMPILE_LEVEL are compiled out, configure
+ * --with-log-level=LEVEL sets it.
+ */
+#ifndef XT_LOG_COMPILE_LEVEL
+#define XT_LOG_COMPILE_LEVEL    XT_LOG_TRACE
+#endif
+
+/*
+ * highest level enabled globally or for a domain, checked before the
+ * call so a disabled message costs a compare.
+ */
+extern xt_loglevel_t xt_log_max_level;
+
+#define XT_LOG_ENABLED(levl)                                            \
+        ((levl) <= XT_LOG_COMPILE_LEVEL && (levl) <= xt_log_max_level)
+
 #define FMT_WARN(fmt...) do { if (0) printf (fmt); } while (0)
 
 #define xt_log(dom, levl, fmt...) do {                                  \
                 FMT_WARN (fmt);                                         \
                                                                         \
-                _xt_log (dom, __FILE__, __FUNCTION__, __LINE__,         \
-                         levl, ##fmt);                                  \
+                if (XT_LOG_ENABLED (levl))                              \
+                        _xt_log (dom, __FILE__, __FUNCTION__, __LINE__, \
+                                 levl, ##fmt);                          \
         } while (0)
 
 #define xt_log_callingfn(dom, levl, fmt...) do {                        \
                 FMT_WARN (fmt);                                         \
                                                                         \
-                _xt_log_callingfn (dom, __FILE__, __FUNCTION__, __LINE__, \
-                                   levl, ##fmt);                        \
+                if (XT_LOG_ENABLED (levl))                              \
+                        _xt_log_callingfn (dom, __FILE__, __FUNCTION__, \
+                                           __LINE__, levl, ##fmt);      \
         } while (0)
 
 
 /* No malloc or calloc should be called in this function */
 #define xt_log_nomem(dom, levl, size) do {                              \
-                _xt_log_nomem (dom, __FILE__, __FUNCTION__, __LINE__,   \
-                               levl, size);                             \
+                if (XT_LOG_ENABLED (levl))                              \
+                        _xt_log_nomem (dom, __FILE__, __FUNCTION__,     \
+                                       __LINE__, levl, size);           \
         } while (0)
 
 
@@ -111,6 +155,15 @@ int xt_log_init (const char *filename);
 
 void xt_log_cleanup (void);
 
+/*
+ * asynchronous logging: every thread appends its records to its own
+ * ring and a writer thread formats and writes them in batches. Start
+ * it after daemon(), the writer does not survive a fork.
+ */
+int xt_log_async_start (void);
+void xt_log_async_stop (void);
+void xt_log_set_full_policy (xt_loglevel_t level, xt_log_full_t policy);
+
 int _xt_log (const char *domain, const char *file, const char *function,
              int32_t line, xt_loglevel_t level, const char *fmt, ...);
 int _xt_log_callingfn (const char *domain, const char *file, const char *function,
@@ -128,7 +181,16 @@ void xt_log_enable_syslog (void);
 xt_loglevel_t xt_log_get_loglevel (void);
 void xt_log_set_loglevel (xt_loglevel_t level);
 
+/*
+ * per domain levels, XT_LOG_NONE drops the override of the domain
+ */
+int xt_log_set_domain_level (const char *domain, xt_loglevel_t level);
+void xt_log_clear_domain_levels (void);
+xt_loglevel_t xt_log_get_domain_level (const char *domain);
+int xt_log_domain_levels (char *buf, size_t size);
+
 xt_loglevel_t xt_str2loglvl(char *str);
+const char *xt_loglvl2str(xt_loglevel_t level);
 
 #define XT_DEBUG(xl, format, args...)                           \
         xt_log ((xl)->name, XT_LOG_DEBUG, format, ##args)
@@ -30,6 +30,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <time.h>
 
 #include "xlist.h"
 #include "locking.h"
@@ -78,20 +79,99 @@ char * xt_strdup (const char *src)
         return dup_str;
 }
 
+/*
+ * per thread cache of free chunks. A thread gets and puts the chunks
+ * of its magazine without the pool lock, an empty magazine is refilled
+ * and a full one is flushed by MEM_MAG_BATCH chunks under the lock.
+ * The chunks in the magazines are counted as hot.
+ */
+#define MEM_MAG_SIZE    32
+#define MEM_MAG_BATCH   (MEM_MAG_SIZE / 2)
+
+struct mem_pool;
+
+struct mem_mag {
+        struct xlist_head  list;        /* in mem_pool->mags */
+        struct mem_pool   *pool;
+        int                lookup;      /* in mem_slab_lookup() */
+        int                count;
+        void              *chunks[MEM_MAG_SIZE];
+};
+
+/*
+ * the chunks of a pool are carved from slabs of MEM_SLAB_SIZE bytes at
+ * least, aligned to their size, with the slab header at the start. The
+ * slabs for the count of mem_pool_new() stay with the pool, the pool
+ * grows by a slab when all the chunks are taken and a grown slab is
+ * released after it stays free for MEM_SLAB_IDLE seconds.
+ */
+#define MEM_SLAB_SIZE           (64 * 1024)
+#define MEM_SLAB_IDLE           10
+#define MEM_SLAB_REAP_TICKS     64
+#define MEM_SLAB_DIR_SIZE       16
+
+struct mem_slab {
+        struct xlist_head  list;        /* in mem_pool->slabs */
+        struct xlist_head  plist;       /* in mem_pool->partial */
+        struct xlist_head  free;        /* free chunks */
+        int                nfree;
+        int                reserved;    /* never released */
+        time_t             idle_since;
+        void              *chunks;
+        unsigned long      bitmap[];    /* in use, cache aligned pools */
+};
+
+struct mem_slab_dir {
+        unsigned long        size;      /* power of 2 */
+        struct mem_slab_dir *retired;
+        struct mem_slab     *slots[];
+};
+
+/*
+ * mem_pool_new_flags() flags
+ *
+ * MEM_POOL_CACHE_ALIGNED: the chunks start on a cache line and are
+ * padded to whole cache lines, without a header. The objects written
+ * by different threads do not share cache lines.
+ * MEM_POOL_HUGEPAGE: the slabs are huge pages, from the reserved huge
+ * pages or transparent ones, if the pool holds a huge page at least.
+ */
+#define MEM_POOL_NO_MAGAZINE    0x1
+#define MEM_POOL_CACHE_ALIGNED  0x2
+#define MEM_POOL_HUGEPAGE       0x4
+
 struct mem_pool {
-        struct xlist_head  list;
         int               hot_count;
         int               cold_count;
         xt_lock_t         lock;
         unsigned long     padded_sizeof_type;
-        void             *pool;
-        void             *pool_end;
+        unsigned long     chunk_off;    /* of the object in the chunk */
         int               real_sizeof_type;
+        int               flags;
+
+        unsigned long     slab_size;
+        unsigned long     slab_hdr;
+        int               slab_chunks;
+        int               nr_slabs;
+        int               nr_tombs;
+        struct xlist_head slabs;
+        struct xlist_head partial;      /* slabs with free chunks */
+        struct mem_slab_dir *dir;
+        int               lookups;      /* without a magazine */
+        unsigned long     reap_tick;
+        time_t            reap_next;
+
+        pthread_key_t     mag_key;
+        struct xlist_head mags;
 };
 
 struct mem_pool *
 mem_pool_new (unsigned long sizeof_type, unsigned long count);
 
+struct mem_pool *
+mem_pool_new_flags (unsigned long sizeof_type, unsigned long count,
+                    int flags);
+
 void mem_put (struct mem_pool *pool, void *ptr);
 void *mem_get (struct mem_pool *pool);
 void *mem_get0 (struct mem_pool *pool);
@@ -0,0 +1,68 @@
+/*
+ * Copyright (c) 2016 XTAO Technology <www.xtaotech.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef __MH_METRICS_H__
+#define __MH_METRICS_H__
+
+#include <pthread.h>
+
+/*
+ * stats server of the hunter. The counters of the reader, the
+ * pipeline stages and the memory pools are served in the Prometheus
+ * text format on a unix domain socket, and optionally on a localhost
+ * HTTP port. The counters are read without taking any lock of the
+ * pipeline, a scrape never stalls the workers.
+ */
+typedef struct metrics_server {
+	char *sock_path; /* NULL to disable */
+	int http_port; /* 0 to disable, bound to 127.0.0.1 */
+
+	int sock_fd;
+	int http_fd;
+	pthread_t tid;
+	int running;
+	int exiting;
+	struct metahunter *info;
+} metrics_server_t;
+
+/*
+ * start serving the counters of @info, return 0 on success.
+ */
+int metrics_start(metrics_server_t *ms, struct metahunter *info);
+
+/*
+ * stop the server thread and remove the unix socket, it is fine to
+ * stop a server which is not started.
+ */
+void metrics_stop(metrics_server_t *ms);
+
+/*
+ * render the counters into a new allocated buffer, the caller frees
+ * it with XT_FREE. return the length of the text or -1.
+ */
+int metrics_render(struct metahunter *info, char **text);
+
+#endif /* __MH_METRICS_H__ */
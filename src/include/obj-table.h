@@ -0,0 +1,114 @@
+/*
+ * Copyright (c) 2016 XTAO Technology <www.xtaotech.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef __OBJ_TABLE_H__
+#define __OBJ_TABLE_H__
+
+#include <sys/types.h>
+#include <stdint.h>
+
+#include "xlist.h"
+
+/*
+ * slot state of the object table
+ */
+#define OBJ_SLOT_FREE	0
+#define OBJ_SLOT_USED	1
+#define OBJ_SLOT_DEAD	2
+
+/*
+ * slots migrated from the old table on every maintenance call
+ */
+#define OBJ_TBL_MIGRATE	16
+
+/*
+ * 64 bit finalizer of murmur3, inode numbers are mostly sequential,
+ * mix all bits into the low bits used as slot index.
+ */
+static inline uint32_t obj_hash(ino_t ino)
+{
+	uint64_t h = (uint64_t)ino;
+
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+
+	return (uint32_t)h;
+}
+
+typedef struct op_object
+{
+	ino_t obj;
+	unsigned int ref;
+	unsigned int slot:2;
+	unsigned int being_proceed:1;
+	unsigned int being_created:1;
+	unsigned int being_removed:1;
+
+	unsigned int deleting_children;
+	struct xlist_head pending;
+	void *creator; /* outstanding create op, for coalescing */
+} op_obj_t;
+
+/*
+ * inode keyed open addressing table, the objects are stored inline.
+ *
+ * an object never moves when other objects are inserted or removed,
+ * the objects are only relocated by obj_tbl_maint(). So the caller
+ * must not keep pointers to the objects across obj_tbl_maint().
+ *
+ * when the table is full, a new table is allocated and the objects
+ * are moved from the old table a few slots per obj_tbl_maint(), the
+ * lookups check both tables in the meantime.
+ */
+typedef struct obj_table {
+	op_obj_t *slots;
+	unsigned int mask;
+	unsigned int used;
+	unsigned int dead;
+	unsigned int min_slots;
+
+	op_obj_t *old;
+	unsigned int old_mask;
+	unsigned int old_used;
+	unsigned int old_pos;
+} obj_table_t;
+
+obj_table_t *obj_tbl_new(unsigned int expected);
+
+void obj_tbl_destroy(obj_table_t *tbl);
+
+op_obj_t *obj_tbl_get(obj_table_t *tbl, ino_t ino);
+
+op_obj_t *obj_tbl_insert(obj_table_t *tbl, ino_t ino);
+
+void obj_tbl_remove(obj_table_t *tbl, op_obj_t *obj);
+
+int obj_tbl_maint(obj_table_t *tbl, unsigned int room);
+
+#endif /* __OBJ_TABLE_H__ */
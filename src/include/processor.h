@@ -2,11 +2,12 @@
 #define __MH_PROCESSOR_H__
 
 #include <pthread.h>
-#include <semaphore.h>
 
 #include "mem.h"
 #include "xlist.h"
-#include "rbthash.h"
+#include "obj-table.h"
+#include "wsdeque.h"
+#include "stats.h"
 
 #include "filesystem.h"
 #include "database.h"
@@ -53,33 +54,101 @@ typedef struct entry_proc_op
 	unsigned int can_skip:1;
 	unsigned int invalid:1;
 	unsigned int no_release:1;
+	unsigned int proceeding:1; /* op holds being_proceed of its obj */
+	unsigned int coalesced:1; /* creation of the obj cancelled by op */
 
-	time_t log_inserted; /* used by changelog reader */
+	/*
+	 * PL_OP_* claim state at the current stage, see entry_coalesce()
+	 */
+	int claim;
+
+	/*
+	 * xt_now_ns() along the way of the op, for the replication lag.
+	 * ts_hold is set by the reader, ts_applied by the processor.
+	 */
+	uint64_t ts_hold; /* journal entry held, 0 if pushed directly */
+	uint64_t ts_admit; /* pushed into the pipeline */
+	uint64_t ts_applied; /* changes applied to the database */
+	unsigned int lag_bucket; /* see entry_lag_enter() */
 
-	/* double chained list for pipeline */
+	/*
+	 * xt_now_ns() when the op is pushed into the current stage and
+	 * when it becomes runnable, for the stage statistics
+	 */
+	uint64_t ts_push;
+	uint64_t ts_ready;
+
+	/* link in the ready queue of the current stage */
 	struct xlist_head list;
 
+	/* link in the pending list of the object the op waits on */
 	struct xlist_head waitq;
 
 	void *extra_info;
 
-	void * obj; /* pointer to op_object in the rbthash */
-
 	void *worker; /* Current worker handler thread */
 } entry_proc_op_t;
 
-typedef struct op_object
-{
-	ino_t obj;
-	xt_lock_t lock;
-	unsigned int ref;
-	unsigned int being_proceed:1;
-	unsigned int being_created:1;
-	unsigned int being_removed:1;
+/*
+ * claim state of an op at a stage. A runnable op is taken by a worker
+ * or coalesced with a later op, whichever claims it first.
+ */
+#define PL_OP_FREE		0
+#define PL_OP_TAKEN		1
+#define PL_OP_COALESCING	2 /* transient, being merged with a later op */
+#define PL_OP_CANCELLED		3 /* the worker takes it as can_skip */
+
+/*
+ * result of the coalesce function of a stage
+ */
+enum {
+	PL_COALESCE_NONE = 0,
+	PL_COALESCE_FOLD, /* op is folded into prev, op is skipped */
+	PL_COALESCE_CANCEL, /* op cancels prev, prev is skipped */
+};
+
+/*
+ * latency of the ops at a stage, in nanoseconds
+ */
+typedef struct stage_hist {
+	xt_hist_t wait; /* runnable until taken by a worker */
+	xt_hist_t service; /* stage function, or batch function */
+	xt_hist_t blocked; /* pushed until runnable, ops pending only */
+} stage_hist_t;
+
+/*
+ * statistics of a stage collected by a single worker, only the worker
+ * writes them. See processor_stage_stat().
+ */
+typedef struct stage_worker_stat {
+	unsigned long long taken;
+	unsigned long long processed;
+	unsigned long long nb_batches;
+	unsigned long long total_batched_entries;
+	unsigned long long processing_ns;
+	stage_hist_t hist;
+} stage_worker_stat_t;
+
+/*
+ * replication lag of the ops, in nanoseconds from the journal entry
+ * being held, recorded when the op leaves the pipeline
+ */
+typedef struct lag_hist {
+	xt_hist_t admit; /* until pushed, waiting for the credit */
+	xt_hist_t commit; /* until applied to the database */
+	xt_hist_t release; /* until released to the journal */
+} lag_hist_t;
 
-	unsigned int deleting_children;
-	struct xlist_head pending;
-} op_obj_t;
+/*
+ * the ops in the pipeline counted by the second they are held in,
+ * to tell the age of the oldest one without tracking every op.
+ */
+#define PL_LAG_BUCKETS	1024
+
+typedef struct lag_bucket {
+	uint64_t epoch; /* second of the ops in the bucket */
+	long inflight;
+} lag_bucket_t;
 
 /*
  * each stage of the pipeline consist of the following information:
@@ -97,12 +166,49 @@ typedef struct stage_stat
 } stage_stat_t;
 
 
-typedef struct pipeline_stage {
+/*
+ * the objects of a stage are split into shards by inode hash, every
+ * shard has its own lock, object table and ready queue. The pending
+ * lists are embedded in the objects, so they belong to the shard of
+ * the object.
+ */
+typedef struct pipeline_shard {
 	xt_lock_t mutex;
-	struct xlist_head entries;
-	int outstanding;
-	stage_stat_t stage_stat;
-	rbthash_table_t *obj_tbl;
+	struct xlist_head ready; /* ops which can be taken by workers */
+	int queued; /* ops in the ready queue */
+	obj_table_t *obj_tbl;
+} pipeline_shard_t;
+
+/*
+ * coalesce the op with the earlier creation of the same object, which
+ * is not taken by any worker yet. Return PL_COALESCE_*.
+ */
+typedef int (*step_coalesce_function_t) (void *pl,
+    struct entry_proc_op *prev, struct entry_proc_op *op);
+
+/*
+ * workers serving a set of stages. A stage with a thread limit, or
+ * with workers configured, runs on a group of its own, the other
+ * stages share a group of workercnt workers. A worker only takes the
+ * ops of the stages of its group, and only wakes up the idle workers
+ * of the group which serves the op.
+ */
+typedef struct worker_group {
+	unsigned int first; /* index of the first worker */
+	unsigned int count;
+	unsigned long stage_mask; /* 1 << stage index */
+	int idle; /* idle workers of the group */
+} worker_group_t;
+
+#define PL_MAX_STAGES	(sizeof(unsigned long) * 8)
+
+typedef struct pipeline_stage {
+	void *pl; /* back reference */
+	worker_group_t *group;
+	step_coalesce_function_t coalesce; /* NULL if disabled */
+	int fused; /* run inline by the worker completing the previous stage */
+	unsigned int shard_count;
+	pipeline_shard_t *shards;
 } pipeline_stage_t;
 
 /*
@@ -114,6 +220,28 @@ typedef int (*step_valid_op_function_t) (pipeline_stage_t *stage,
 typedef void (*step_post_function_t) (void *pl,
     struct entry_proc_op *op);
 
+/*
+ * batch variant of the stage function, the ops are independent ready
+ * ops of the same stage. The post function is still invoked per op.
+ */
+typedef int (*step_batch_function_t) (void *pl, struct entry_proc_op **ops,
+    int count);
+
+/*
+ * upper limit of ops handed to a batch function at once
+ */
+#define PL_MAX_BATCH	64
+
+/*
+ * stage flags
+ *
+ * PL_STAGE_FUSABLE: the stage has no valid_op, the op runs it right
+ * after the previous stage in the same worker without being queued.
+ * The post function of a fused stage is not invoked, the op moves on
+ * to the next stage as entry_stage_cmplt() does.
+ */
+#define PL_STAGE_FUSABLE	0x1
+
 /*
  * Definition of a pipeline stage
  */
@@ -124,6 +252,10 @@ typedef struct pipeline_stage_desc {
 	step_function_t function; 
 	step_post_function_t post_function;
 	unsigned int max_thread_count; /*< 0 = UNLIMITED */
+	step_batch_function_t batch_function; /*< optional */
+	unsigned int max_batch; /*< ops per batch, up to PL_MAX_BATCH */
+	step_coalesce_function_t coalesce; /*< optional */
+	unsigned int flags; /*< PL_STAGE_* */
 } pipeline_stage_desc_t;
 
 typedef int (*pl_init_t) (void *pl);
@@ -134,11 +266,50 @@ typedef pipeline_stage_desc_t * (*get_stages_t) (int *stagecnt);
 
 typedef struct worker_info {
 	unsigned int index;
+	worker_group_t *group;
 	pthread_t tid;
 	void *priv;
 	void *pl; /* point back to the pipeline_desc */
+
+	/*
+	 * ops made runnable by the worker, stolen by idle workers
+	 */
+	wsdeque_t deque;
+	int parked; /* futex word, 1 while the worker is idle */
+	unsigned int seed; /* victim selection for stealing */
+
+	stage_worker_stat_t *stats; /* per stage */
+	lag_hist_t *lag;
 } worker_info_t;
 
+/*
+ * state of the outstanding ops window controller, only the thread
+ * which moves next forward adapts the window.
+ */
+typedef struct credit_ctl {
+	uint64_t next; /* xt_now_ns() of the next adaption */
+	uint64_t base_ns; /* lowest service time per op seen */
+
+	/*
+	 * totals of the worker statistics at the last adaption
+	 */
+	unsigned long long taken;
+	unsigned long long blocked;
+	unsigned long long serviced;
+	unsigned long long service_ns;
+	unsigned long long stalls;
+} credit_ctl_t;
+
+/*
+ * return 1 if the worker takes the ops of the stage, for the worker
+ * init of the processor to set up only what the stages need.
+ */
+static inline int worker_serves_stage(worker_info_t *worker,
+    unsigned int stage_index)
+{
+	return (worker->group->stage_mask >> stage_index) & 1;
+}
+
 typedef int (*pl_worker_init_t) (worker_info_t *worker);
 typedef void (*pl_worker_fini_t) (worker_info_t *worker);
 /*
@@ -148,8 +319,13 @@ struct metahunter;
 typedef struct processor
 {
 	char *name;
-	int workercnt;
-	int outstanding_ops;
+	int workercnt; /* workers of the shared group */
+	int *stage_workers; /* optional, workers of each stage */
+	int outstanding_ops; /* initial window */
+	int outstanding_min;
+	int outstanding_max;
+	int shard_count;
+	int no_coalesce;
 	void *conf;
 	void *dlhandle;
 	void *private;
@@ -174,14 +350,24 @@ typedef struct processor
 	 * stage array.
 	 */
 	pipeline_stage_t *stages;
-	int waiting_workers;
+	int group_count;
+	worker_group_t *groups;
+	int nr_workers; /* workers of all the groups */
 	worker_info_t *workers;
-	xt_lock_t lock;
-	xt_cond_t cond;
-	sem_t credit;
+
+	/*
+	 * window of outstanding ops. It is adapted between
+	 * outstanding_min and outstanding_max from the service time of
+	 * the stages and the ratio of the blocked ops.
+	 */
+	int window;
+	int inflight;
+	int credit_waiters;
+	int credit_gen; /* futex word of the waiters */
+	unsigned long long credit_stalls; /* pushes waited for credit */
+	credit_ctl_t ctl;
 	struct mem_pool *op_pool;
-	struct mem_pool *obj_pool;
-	struct mem_pool *obj_tbl_pool;
+	lag_bucket_t *lag_buckets;
 	int exiting;
 } processor_t;
 
@@ -191,6 +377,26 @@ int processor_init(processor_t *pl);
 
 void processor_cleanup(processor_t *pl);
 
+/*
+ * aggregate the statistics of the stage over all the workers, @hist
+ * is optional. return -1 if the stage does not exist.
+ */
+int processor_stage_stat(processor_t *pl, int stage_index,
+    stage_stat_t *stat, stage_hist_t *hist);
+
+/*
+ * aggregate the replication lag histograms over all the workers, and
+ * return the age in nanoseconds of the oldest op in the pipeline, it
+ * is counted from the second the op is held in, so it is up to one
+ * second over. 0 if the pipeline is empty.
+ */
+uint64_t processor_lag_stat(processor_t *pl, lag_hist_t *hist);
+
+/*
+ * log the statistics of all the stages
+ */
+void processor_stats_dump(processor_t *pl);
+
 /*
  * get a new entry
  */
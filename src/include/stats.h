@@ -0,0 +1,107 @@
+/*
+ * Copyright (c) 2016 XTAO Technology <www.xtaotech.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * log-linear histogram of 64 bits values, the nanoseconds of latency
+ * mostly. Every power of two range is split into XT_HIST_SUB linear
+ * buckets, so the relative error of a value is below 1/XT_HIST_SUB.
+ * The values of 2^XT_HIST_MAX_SHIFT and more fall in the last bucket.
+ *
+ * a histogram has a single writer, the readers merge the histograms
+ * of all the writers without locking, the counters are read in a
+ * slightly inconsistent way which is fine for statistics.
+ */
+#define XT_HIST_SUB_BITS	3
+#define XT_HIST_SUB		(1 << XT_HIST_SUB_BITS)
+#define XT_HIST_MAX_SHIFT	40 /* about 18 minutes in ns */
+#define XT_HIST_BUCKETS	\
+	((XT_HIST_MAX_SHIFT - XT_HIST_SUB_BITS + 1) * XT_HIST_SUB)
+
+typedef struct xt_hist {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t max;
+	uint64_t buckets[XT_HIST_BUCKETS];
+} xt_hist_t;
+
+static inline unsigned int xt_hist_bucket(uint64_t v)
+{
+	unsigned int shift = 0;
+
+	if (v < XT_HIST_SUB)
+		return v;
+
+	shift = 63 - __builtin_clzll(v);
+	if (shift >= XT_HIST_MAX_SHIFT)
+		return XT_HIST_BUCKETS - 1;
+
+	return (shift - XT_HIST_SUB_BITS + 1) * XT_HIST_SUB +
+	    ((v >> (shift - XT_HIST_SUB_BITS)) & (XT_HIST_SUB - 1));
+}
+
+static inline void xt_hist_record(xt_hist_t *h, uint64_t v)
+{
+	h->buckets[xt_hist_bucket(v)]++;
+	h->count++;
+	h->sum += v;
+	if (v > h->max)
+		h->max = v;
+}
+
+/*
+ * add the counters of @src to @dst
+ */
+void xt_hist_merge(xt_hist_t *dst, const xt_hist_t *src);
+
+/*
+ * return the upper bound of the bucket the @p percentile (0 - 100)
+ * falls in, 0 if the histogram is empty.
+ */
+uint64_t xt_hist_percentile(const xt_hist_t *h, double p);
+
+/*
+ * lowest value counted in the bucket
+ */
+uint64_t xt_hist_bucket_low(unsigned int bucket);
+
+/*
+ * monotonic clock in nanoseconds
+ */
+static inline uint64_t xt_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+#endif /* __STATS_H__ */
@@ -34,18 +34,47 @@
 #include <pthread.h>
 #include "xlist.h"
 #include "logging.h"
+#include "wsdeque.h"
 typedef struct tp_s tp_t;
 typedef struct tp_ctrl_s tp_ctrl_t;
 
 typedef int (*thread_handler_t) (tp_t *tp);
 typedef xt_boolean_t (*tp_match_t) (tp_t *tp, void *data);
 
+/*
+ * work stealing executor
+ *
+ * every worker owns a Chase-Lev deque, the tasks a worker enqueues go
+ * to its own deque and are run LIFO, idle workers steal the oldest
+ * tasks of a random victim. Tasks enqueued by other threads go to the
+ * global injection queue, bounded by inject_max, the producer waits
+ * while it is full, until it is drained to half. A worker takes up to
+ * TP_INJECT_BATCH tasks of the queue at once, the ones it does not run
+ * go to its deque and can be stolen.
+ *
+ * a worker is added when a task is enqueued while none is idle and the
+ * backlog exceeds the workers, up to max_thread_count, a worker idle
+ * for idle_time seconds exits, down to min_thread_count.
+ */
+#define TP_DEQUE_SIZE           1024
+#define TP_DEFAULT_INJECT_MAX   4096
+#define TP_INJECT_BATCH         32
+
 struct tp_s {
         struct xlist_head        list;
         thread_handler_t         handler;
         thread_handler_t         cleanup;
 };
 
+typedef struct tp_worker_s {
+        wsdeque_t               deque;
+        tp_ctrl_t              *ctrl;
+        int32_t                 index;
+        int32_t                 active;
+        uint32_t                seed;
+        uint64_t                processed;
+        uint64_t                stolen;
+} tp_worker_t;
 
 struct tp_ctrl_s {
         int32_t                 idle_time;
@@ -61,10 +90,16 @@ struct tp_ctrl_s {
         int32_t                 curr_thread_count;
         int32_t                 sleep_thread_count;
 
+        tp_worker_t            *workers;       /* max_thread_count */
+        int64_t                 pending;       /* tasks not taken yet */
+
+        /* injection queue */
 	struct xlist_head       queue;
-        pthread_cond_t          cond;
+        pthread_cond_t          cond;          /* idle workers */
+        pthread_cond_t          not_full;      /* producers */
         int32_t                 qsize;
-        uint64_t                tp_processed;
+        int32_t                 inject_max;
+        int32_t                 inject_waiters; /* producers waiting */
 
         pthread_mutex_t         mutex;
 
@@ -81,7 +116,15 @@ tp_ctrl_t *tp_ctrl_new (char *name, int32_t stack_size,
 
 int tp_threads_start (tp_ctrl_t *ctrl); 
 int tp_threads_finish (tp_ctrl_t *ctrl);
+/*
+ * only the tasks still in the injection queue can be purged
+ */
 int tp_purge (tp_ctrl_t *ctrl, tp_match_t match, void *data);
 int tp_ctrl_free(tp_ctrl_t *ctrl);
 
+/*
+ * tasks run by the workers, and stolen from other workers
+ */
+uint64_t tp_processed (tp_ctrl_t *ctrl, uint64_t *stolen);
+
 #endif
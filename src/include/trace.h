@@ -0,0 +1,100 @@
+/*
+ * Copyright (c) 2016 XTAO Technology <www.xtaotech.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef __MH_TRACE_H__
+#define __MH_TRACE_H__
+
+#include <stdint.h>
+
+/*
+ * binary tracepoints of the pipeline. Every thread appends fixed size
+ * records to its own ring, a file mapped in the trace directory and
+ * named mh-trace.<pid>.<tid>. The ring keeps the last records, the
+ * files outlive the process and are decoded by mh-tracedump.
+ */
+#define MH_TRACE_MAGIC		0x5254484d	/* "MHTR" */
+#define MH_TRACE_VERSION	1
+#define MH_TRACE_HDR_SIZE	4096
+
+typedef enum {
+	MH_TR_PUSH = 1,		/* op pushed into a stage, arg ready */
+	MH_TR_RESUME,		/* pending op made runnable */
+	MH_TR_SKIP,		/* pending op merged, arg 0 */
+	MH_TR_FOLD,		/* op folded into the creation */
+	MH_TR_TAKE,		/* op taken by a worker */
+	MH_TR_FUSED,		/* fused stage run inline */
+	MH_TR_POST,		/* post handler of the stage */
+	MH_TR_DONE,		/* op left the pipeline */
+	MH_TR_MAX
+} mh_trace_event_t;
+
+typedef struct mh_trace_rec {
+	uint64_t tsc;
+	uint64_t op;
+	uint64_t ino;
+	uint16_t event;
+	uint16_t stage;
+	uint32_t arg;		/* event specific */
+} mh_trace_rec_t;
+
+/*
+ * head of a ring file, the records follow at MH_TRACE_HDR_SIZE. head
+ * counts the records ever written, the ring holds the last nr_recs.
+ */
+typedef struct mh_trace_hdr {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t rec_size;
+	uint32_t nr_recs;
+	uint64_t head;
+	uint64_t tsc_hz;
+	uint64_t tsc_base;
+	uint64_t time_base;	/* CLOCK_REALTIME ns at tsc_base */
+	uint32_t pid;
+	uint32_t tid;
+	char name[16];		/* of the thread */
+} mh_trace_hdr_t;
+
+extern int mh_trace_enabled;
+
+#define MH_TRACE(ev, op, ino, stage, arg) do {				\
+		if (mh_trace_enabled)					\
+			mh_trace_event(ev, (uint64_t)(uintptr_t)(op),	\
+			    ino, stage, arg);				\
+	} while (0)
+
+/*
+ * start tracing into @dir, @records per thread rounded up to a power
+ * of 2.
+ */
+int mh_trace_init(const char *dir, unsigned int records);
+
+void mh_trace_event(unsigned int event, uint64_t op, uint64_t ino,
+    unsigned int stage, uint32_t arg);
+
+const char *mh_trace_event_name(unsigned int event);
+
+#endif /* __MH_TRACE_H__ */
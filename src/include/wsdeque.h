@@ -0,0 +1,70 @@
+/*
+ * Copyright (c) 2016 XTAO Technology <www.xtaotech.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef __WSDEQUE_H__
+#define __WSDEQUE_H__
+
+#define WSDEQUE_CACHELINE	64
+
+/*
+ * Chase-Lev work stealing deque of bounded capacity.
+ *
+ * the owner thread pushes and pops items at the bottom, other threads
+ * steal items from the top. Only the owner calls wsdeque_push() and
+ * wsdeque_pop(), any thread can call wsdeque_steal().
+ */
+typedef struct wsdeque {
+	long top;
+	char pad0[WSDEQUE_CACHELINE - sizeof(long)];
+	long bottom;
+	char pad1[WSDEQUE_CACHELINE - sizeof(long)];
+	unsigned long mask;
+	void **buf;
+} wsdeque_t;
+
+int wsdeque_init(wsdeque_t *q, unsigned long capacity);
+
+void wsdeque_destroy(wsdeque_t *q);
+
+/*
+ * return 0 on success, -1 if the deque is full.
+ */
+int wsdeque_push(wsdeque_t *q, void *item);
+
+void *wsdeque_pop(wsdeque_t *q);
+
+/*
+ * return NULL if the deque is empty or the item is taken by a
+ * concurrent pop or steal.
+ */
+void *wsdeque_steal(wsdeque_t *q);
+
+/*
+ * approximate count of items, only for hints and statistics
+ */
+long wsdeque_size(wsdeque_t *q);
+
+#endif /* __WSDEQUE_H__ */
@@ -304,6 +304,7 @@ retry:
 		}
 	}
 
+	op->ts_applied = xt_now_ns();
 	return ret;
 }
 
@@ -319,6 +320,10 @@ static int entry_reclaim_log(void *processor, struct entry_proc_op *op)
 		return 0;
 	xt_log(MH_IRODS, XT_LOG_TRACE, "release entry %llx",
 	    (unsigned long long)entry->seq);
+	/*
+	 * the release advances the journal watermark, see
+	 * filesystem_release_jentry().
+	 */
 	filesystem_release_jentry(fs, entry);
 	return ret;
 }
@@ -332,7 +337,7 @@ pipeline_stage_desc_t stages[] = {
 	 0},
 	{STAGE_RECLAIM_LOG, "STAGE_RECLAIM_LOG", NULL,
 	 entry_reclaim_log, entry_stage_cmplt, /* reclaim log */
-	 0},
+	 0, NULL, 0, NULL, PL_STAGE_FUSABLE},
 };
 
 pipeline_stage_desc_t *get_stages(int *stagecnt)
@@ -393,6 +398,12 @@ int worker_init(worker_info_t *info)
 	rcComm_t *conn;
 	rErrMsg_t errMsg;
 
+	/*
+	 * only the workers applying to irods need a connection
+	 */
+	if (!worker_serves_stage(info, STAGE_DB_APPLY))
+		return 0;
+
 	conn = rcConnect(env->rodsHost, env->rodsPort, env->rodsUserName,
 	    env->rodsZone, 1, &errMsg);
 	if (conn == NULL) {
@@ -424,7 +435,9 @@ int worker_init(worker_info_t *info)
 void worker_fini(worker_info_t *info)
 {
 	mh_irods_priv_t *priv = info->priv;
-	rcComm_t *conn = priv->conn;
-	rcDisconnect(conn);
+
+	if (priv == NULL)
+		return;
+	rcDisconnect(priv->conn);
 	XT_FREE(priv);
 }
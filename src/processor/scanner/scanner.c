@@ -108,7 +108,7 @@ pipeline_stage_desc_t stages[] = {
 	 0},
 	{STAGE_RECLAIM_ENTRY, "STAGE_RECLAIM_ENTRY", NULL,
 	 entry_reclaim_entry, entry_stage_cmplt, /* reclaim log */
-	 0},
+	 0, NULL, 0, NULL, PL_STAGE_FUSABLE},
 };
 
 pipeline_stage_desc_t *get_stages(int *stagecnt)
@@ -134,7 +134,10 @@ int worker_init(worker_info_t *info)
 	int rc = 0;
 	processor_t *pl = info->pl;
 	metahunter_t *mh = pl->info;
-	if (mh->db)
+	/*
+	 * only the workers applying to the database need a connection
+	 */
+	if (mh->db && worker_serves_stage(info, STAGE_DB_APPLY))
 		rc = database_connect(mh->db, &info->priv);
 	return rc;
 }
@@ -144,6 +147,6 @@ void worker_fini(worker_info_t *info)
 	processor_t *pl = info->pl;
 	metahunter_t *mh = pl->info;
 
-	if (mh->db)
+	if (mh->db && info->priv)
 		database_disconnect(mh->db, info->priv);
 }
@@ -27,6 +27,7 @@
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <libgen.h>
 #include <pthread.h>
 #include <semaphore.h>
@@ -44,7 +45,7 @@
 
 #define MH_STD "standard"
 
-static int entry_db_apply(void *processor, struct entry_proc_op *op)
+static int entry_db_apply_op(void *processor, struct entry_proc_op *op)
 {
 	processor_t *pl = (processor_t *)processor;
 	journal_entry_t *entry = (journal_entry_t *)op->extra_info;
@@ -62,6 +63,18 @@ static int entry_db_apply(void *processor, struct entry_proc_op *op)
 		return -1;		
 	}
 
+	if (op->coalesced) {
+		/*
+		 * the creation of the object is cancelled by the op,
+		 * only the parent is updated.
+		 */
+		if (pattr == NULL) {
+			xt_log(MH_STD, XT_LOG_ERROR, "parent attr is NULL!");
+			return -1;
+		}
+		return database_update(db, hdl, NULL, pattr);
+	}
+
 	switch(entry->op) {
 	case op_create:
 	case op_mkdir:
@@ -144,6 +157,140 @@ static int entry_db_apply(void *processor, struct entry_proc_op *op)
 	return ret;
 }
 
+static int entry_db_apply(void *processor, struct entry_proc_op *op)
+{
+	int ret = entry_db_apply_op(processor, op);
+
+	op->ts_applied = xt_now_ns();
+	return ret;
+}
+
+/*
+ * translate the journal entry of the op into record changes of the
+ * batch, return the number of changes.
+ */
+static int entry_db_batch_ops(struct entry_proc_op *op, db_batch_op_t *bops)
+{
+	journal_entry_t *entry = (journal_entry_t *)op->extra_info;
+	mattr_t *attr = entry->attr;
+	mattr_t *pattr = entry->pattr;
+	int n = 0;
+
+	if (attr == NULL) {
+		xt_log(MH_STD, XT_LOG_ERROR, "attr is NULL!");
+		return 0;
+	}
+
+	if (op->coalesced)
+		goto parent;
+
+	switch(entry->op) {
+	case op_create:
+	case op_mkdir:
+		bops[n].type = db_op_insert;
+		break;
+	case op_unlink:
+		bops[n].type = attr->nlink ? db_op_rm_dentry : db_op_rm_inode;
+		break;
+	case op_rmdir:
+		bops[n].type = db_op_rm_inode;
+		break;
+	default:
+		bops[n].type = db_op_update;
+		break;
+	}
+	bops[n].name = entry->name;
+	bops[n].attr = attr;
+	n++;
+
+parent:
+	switch(entry->op) {
+	case op_create:
+	case op_mkdir:
+	case op_unlink:
+	case op_rmdir:
+		if (pattr == NULL) {
+			xt_log(MH_STD, XT_LOG_ERROR, "parent attr is NULL!");
+			break;
+		}
+		bops[n].type = db_op_update;
+		bops[n].name = NULL;
+		bops[n].attr = pattr;
+		n++;
+		break;
+	default:
+		break;
+	}
+
+	return n;
+}
+
+/*
+ * apply the ready ops in one batch
+ */
+static int entry_db_apply_batch(void *processor, struct entry_proc_op **ops,
+    int count)
+{
+	processor_t *pl = (processor_t *)processor;
+	metahunter_t *mh = pl->info;
+	database_t *db = mh->db;
+	worker_info_t *info = ops[0]->worker;
+	void *hdl = info->priv;
+	db_batch_op_t bops[STD_MAX_BATCH * 2];
+	uint64_t now = 0;
+	int n = 0;
+	int i = 0;
+	int ret = 0;
+
+	for (i = 0; i < count; i++) {
+		n += entry_db_batch_ops(ops[i], &bops[n]);
+	}
+
+	xt_log(MH_STD, XT_LOG_TRACE, "apply batch of %d ops, %d records",
+	    count, n);
+
+	ret = database_apply_batch(db, hdl, bops, n);
+	if (ret) {
+		xt_log(MH_STD, XT_LOG_ERROR, "database apply batch of %d ops "
+		    "failed!", count);
+	}
+
+	now = xt_now_ns();
+	for (i = 0; i < count; i++)
+		ops[i]->ts_applied = now;
+
+	return ret;
+}
+
+/*
+ * the creation is not applied yet. A setattr is folded into it with
+ * the final attributes, the last unlink of the file or the rmdir
+ * cancels it.
+ */
+static int entry_db_coalesce(void *processor, struct entry_proc_op *prev,
+    struct entry_proc_op *op)
+{
+	journal_entry_t *pentry = (journal_entry_t *)prev->extra_info;
+	journal_entry_t *entry = (journal_entry_t *)op->extra_info;
+
+	if (pentry->attr == NULL || entry->attr == NULL)
+		return PL_COALESCE_NONE;
+
+	switch(entry->op) {
+	case op_setattr:
+		memcpy(pentry->attr, entry->attr, sizeof(mattr_t));
+		return PL_COALESCE_FOLD;
+	case op_unlink:
+		if (entry->attr->nlink)
+			return PL_COALESCE_NONE;
+		return PL_COALESCE_CANCEL;
+	case op_rmdir:
+		return PL_COALESCE_CANCEL;
+	default:
+		return PL_COALESCE_NONE;
+	}
+}
+
 static int entry_reclaim_log(void *processor, struct entry_proc_op *op)
 {
 	int ret = -1;
@@ -155,6 +302,10 @@ static int entry_reclaim_log(void *processor, struct entry_proc_op *op)
 	if (op->no_release)
 		return 0;
 
+	/*
+	 * the release advances the journal watermark, see
+	 * filesystem_release_jentry().
+	 */
 	filesystem_release_jentry(fs, entry);
 	return ret;
 }
@@ -165,10 +316,10 @@ static int entry_reclaim_log(void *processor, struct entry_proc_op *op)
 pipeline_stage_desc_t stages[] = {
 	{STAGE_DB_APPLY, "STAGE_DB_APPLY", entry_valid_op,
 	 entry_db_apply, entry_post_op, /* apply db */
-	 0},
+	 0, entry_db_apply_batch, STD_MAX_BATCH, entry_db_coalesce},
 	{STAGE_RECLAIM_LOG, "STAGE_RECLAIM_LOG", NULL,
 	 entry_reclaim_log, entry_stage_cmplt, /* reclaim log */
-	 0},
+	 0, NULL, 0, NULL, PL_STAGE_FUSABLE},
 };
 
 pipeline_stage_desc_t *get_stages(int *stagecnt)
@@ -204,7 +355,10 @@ int worker_init(worker_info_t *info)
 	metahunter_t *mh = pl->info;
 	int rc = 0;
 
-	if (mh->db)
+	/*
+	 * only the workers applying to the database need a connection
+	 */
+	if (mh->db && worker_serves_stage(info, STAGE_DB_APPLY))
 		rc = database_connect(mh->db, &info->priv);
 	return rc;
 }
@@ -214,6 +368,6 @@ void worker_fini(worker_info_t *info)
 	processor_t *pl = info->pl;
 	metahunter_t *mh = pl->info;
 
-	if (mh->db)
+	if (mh->db && info->priv)
 		database_disconnect(mh->db, info->priv);
 }
@@ -26,6 +26,11 @@
 #ifndef __STANDARD_H__
 #define __STANDARD_H__
 
+/*
+ * ops applied to the database in one batch
+ */
+#define STD_MAX_BATCH 32
+
 enum {
     STAGE_DB_APPLY = 0,
     STAGE_RECLAIM_LOG,
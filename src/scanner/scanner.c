@@ -33,6 +33,7 @@
 #include <fcntl.h>              /* for open flags */
 #include <signal.h>
 #include <errno.h>
+#include <time.h>
 
 #include "mem.h"
 #include "defaults.h"
@@ -42,17 +43,73 @@
 #include "filesystem.h"
 #include "processor.h"
 #include "thread-pool.h"
+#include "locking.h"
+#include "stats.h"
 
+/*
+ * entries read at once by fs_readdirplus
+ */
+#define SCAN_READDIRPLUS_BATCH	128
+
+/*
+ * entries of a bulk load batch
+ */
+#define SCAN_BULK_BATCH		4096
+
+/*
+ * a directory to read, queued to the walkers, it is opened when a
+ * walker takes it.
+ */
 typedef struct scan_dir
 {
-	struct xlist_head list;
-	void *dir_desc;
-	char path[PATH_MAX];
+	tp_t tp;
+	struct scanner *scanner;
+	char *path;
 	obj_id_t id;
+	struct scan_loader *loader;	/* bulk load, while it is read */
 } scan_dir_t;
 
+/*
+ * bulk load of a fresh scan, the entries bypass the pipeline and are
+ * loaded in batches sorted by inode. A walker takes a free loader for
+ * the directory it reads, each loader has its own connection.
+ */
+typedef struct scan_loader
+{
+	struct xlist_head list;
+	void *hdl;
+	int count;
+	db_batch_op_t ops[SCAN_BULK_BATCH];
+	mattr_t attrs[SCAN_BULK_BATCH];
+} scan_loader_t;
+
+/*
+ * the parallel walk, the walkers are the workers of the thread pool,
+ * each reads a directory at a time with its own handle. The entries
+ * are pushed to the pipeline, and the sub directories queued to the
+ * walkers, the walker runs them depth first and the idle walkers
+ * steal them.
+ */
+typedef struct scanner
+{
+	metahunter_t *info;
+	scan_ctrl_t *scan;
+	tp_ctrl_t *walkers;
+	unsigned long long seq;
+
+	xt_lock_t lock;
+	xt_cond_t open_cond;	/* max_open_dirs reached */
+	xt_cond_t done_cond;	/* no directory left */
+	long outstanding;	/* directories queued or being read */
+
+	scan_loader_t **loaders;	/* one per walker, bulk load only */
+	struct xlist_head free_loaders;
+} scanner_t;
+
 static pthread_t sigwaiter;
 
+static char *scanner_conf_file = MH_DEFAULT_CONF_FILE;
+
 /*
  * allocated a op and then push the op into pipeline
  */
@@ -70,7 +127,6 @@ static int queue_log_entry(metahunter_t *info, journal_entry_t *entry)
 	}
 
 	op->stage = 0;
-	op->log_inserted = time(NULL);
 	op->extra_info = entry;
 	op->id = entry->attr->fid.inode;
 
@@ -89,11 +145,9 @@ static void stat2id (obj_id_t *id, struct stat *st)
 	id->validator = st->st_ctime;
 }
 
-static mattr_t * mattr_new(struct mem_pool *pool, obj_id_t *pid, struct stat *st)
+static void mattr_fill(mattr_t *attr, obj_id_t *pid, struct stat *st)
 {
-	mattr_t *attr = NULL;
-
-	attr = mem_get0(pool);
+	memset(attr, 0, sizeof(mattr_t));
 	memcpy(&attr->parentid, pid, sizeof(obj_id_t));
 	stat2id(&attr->fid, st);
 	attr->mode = st->st_mode;
@@ -106,124 +160,600 @@ static mattr_t * mattr_new(struct mem_pool *pool, obj_id_t *pid, struct stat *st
 	attr->atime = st->st_atime;
 	attr->mtime = st->st_mtime;
 	attr->ctime = st->st_ctime;
+}
+
+static mattr_t * mattr_new(struct mem_pool *pool, obj_id_t *pid, struct stat *st)
+{
+	mattr_t *attr = NULL;
+
+	attr = mem_get0(pool);
+	mattr_fill(attr, pid, st);
 	return attr;
 }
 
-static scan_dir_t *xt_new_scan(filesystem_t *fs, const char *path, struct stat *st)
+static int xt_scan_dir(tp_t *tp);
+static int xt_scan_cleanup(tp_t *tp);
+
+/*
+ * queue a directory to the walkers
+ */
+static int xt_queue_scan(scanner_t *scanner, const char *path,
+    struct stat *st)
 {
-	void *dirp = NULL;
-	int ret = -1;
 	scan_dir_t *new = NULL;
 
-	if (!strlen(path))
-		ret = filesystem_opendir(fs, "/", &dirp);
-	else
-		ret = filesystem_opendir(fs, path, &dirp);
-	if (ret)
-		return new;
-
 	new = XT_CALLOC(1, sizeof (scan_dir_t));
-	new->dir_desc = dirp;
-	strncpy(new->path, path, PATH_MAX);
-	INIT_XLIST_HEAD(&new->list);
+	if (new == NULL)
+		return -1;
+
+	new->path = xt_strdup(path);
+	if (new->path == NULL) {
+		XT_FREE(new);
+		return -1;
+	}
+
+	new->scanner = scanner;
+	new->tp.handler = xt_scan_dir;
+	new->tp.cleanup = xt_scan_cleanup;
+	INIT_XLIST_HEAD(&new->tp.list);
 	stat2id(&new->id, st);
-	return new;
+
+	LOCK(&scanner->lock);
+	scanner->outstanding++;
+	UNLOCK(&scanner->lock);
+	atomic_inc(&scanner->scan->queued_dirs);
+	tp_enqueue(scanner->walkers, &new->tp);
+	return 0;
 }
 
-static void xt_del_scan(filesystem_t *fs, scan_dir_t *scan)
+/*
+ * the directory is done, wake the scanner with the last one
+ */
+static void xt_del_scan(scan_dir_t *scan)
 {
-	filesystem_closedir(fs, scan->dir_desc);
-	xlist_del(&scan->list);
-	XT_FREE(scan);	
+	scanner_t *scanner = scan->scanner;
+
+	XT_FREE(scan->path);
+	XT_FREE(scan);
+
+	/*
+	 * under the lock, the scanner returns only after the last
+	 * walker is out of it
+	 */
+	LOCK(&scanner->lock);
+	if (--scanner->outstanding == 0)
+		COND_BROADCAST(&scanner->done_cond);
+	UNLOCK(&scanner->lock);
 }
 
-static void xt_traverse_tree(metahunter_t *info)
+static int xt_scan_cleanup(tp_t *tp)
 {
-	struct xlist_head scan_list;
-	scan_dir_t *scan = NULL;
-	scan_dir_t *new = NULL;
-	struct dirent *dent = NULL;
-	struct stat stbuf;
-	struct mem_pool *entry_pool = info->entry_pool;
-	struct mem_pool *attr_pool = info->attr_pool;
+	scan_dir_t *scan = (scan_dir_t *)tp;
+
+	atomic_dec(&scan->scanner->scan->queued_dirs);
+	xt_del_scan(scan);
+	return 0;
+}
+
+/*
+ * open the directory when less than max_open_dirs are open
+ */
+static int xt_open_scan(scanner_t *scanner, scan_dir_t *scan, void **dirp)
+{
+	scan_ctrl_t *ctrl = scanner->scan;
+	filesystem_t *fs = scanner->info->fs;
+	int ret = -1;
+
+	LOCK(&scanner->lock);
+	while (ctrl->open_dirs >= ctrl->max_open_dirs)
+		COND_WAIT(&scanner->open_cond, &scanner->lock);
+	ctrl->open_dirs++;
+	UNLOCK(&scanner->lock);
+
+	if (!strlen(scan->path))
+		ret = filesystem_opendir(fs, "/", dirp);
+	else
+		ret = filesystem_opendir(fs, scan->path, dirp);
+	if (ret == 0)
+		return 0;
+
+	LOCK(&scanner->lock);
+	ctrl->open_dirs--;
+	COND_SIGNAL(&scanner->open_cond);
+	UNLOCK(&scanner->lock);
+	return ret;
+}
+
+static void xt_close_scan(scanner_t *scanner, void *dirp)
+{
+	filesystem_closedir(scanner->info->fs, dirp);
+
+	LOCK(&scanner->lock);
+	scanner->scan->open_dirs--;
+	COND_SIGNAL(&scanner->open_cond);
+	UNLOCK(&scanner->lock);
+}
+
+static int xt_bulk_cmp(const void *a, const void *b)
+{
+	const db_batch_op_t *x = a;
+	const db_batch_op_t *y = b;
+
+	if (x->attr->fid.inode != y->attr->fid.inode)
+		return x->attr->fid.inode < y->attr->fid.inode ? -1 : 1;
+	return 0;
+}
+
+/*
+ * push an entry the database rejected to the pipeline
+ */
+static int xt_bulk_push(scanner_t *scanner, db_batch_op_t *op)
+{
+	metahunter_t *info = scanner->info;
 	journal_entry_t *jentry = NULL;
-	filesystem_t *fs = info->fs;
-	char path[PATH_MAX];
-	uint64_t i = 0;
 
-	INIT_XLIST_HEAD(&scan_list);
+	jentry = mem_get0(info->entry_pool);
+	if (jentry == NULL)
+		return -1;
+
+	jentry->attr = mem_get0(info->attr_pool);
+	if (jentry->attr == NULL)
+		goto err;
+
+	jentry->seq = atomic_add_and_fetch(&scanner->seq, 1) - 1;
+	jentry->name = op->name;
+	memcpy(jentry->attr, op->attr, sizeof(mattr_t));
+	jentry->op = op_setattr;
+
+	if (queue_log_entry(info, jentry))
+		goto err;
+
+	op->name = NULL;
+	return 0;
+err:
+	if (jentry->attr)
+		mem_put(info->attr_pool, jentry->attr);
+	mem_put(info->entry_pool, jentry);
+	return -1;
+}
+
+/*
+ * load the batch sorted by inode, so the database appends to its
+ * index instead of splitting pages all over it. The entries the
+ * database rejects are pushed to the pipeline one at a time.
+ */
+static void xt_bulk_flush(scanner_t *scanner, scan_loader_t *loader)
+{
+	metahunter_t *info = scanner->info;
+	int failed = 0;
+	int ret = 0;
+	int i = 0;
+
+	if (loader->count == 0)
+		return;
+
+	qsort(loader->ops, loader->count, sizeof(db_batch_op_t), xt_bulk_cmp);
+
+	ret = database_apply_batch(info->db, loader->hdl, loader->ops,
+	    loader->count);
+	atomic_inc(&scanner->scan->batches);
+	if (ret == 0) {
+		atomic_add(&scanner->scan->loaded, loader->count);
+		goto out;
+	}
+
+	for (i = 0; i < loader->count; i++) {
+		if (loader->ops[i].status == 0)
+			continue;
+
+		failed++;
+		if (xt_bulk_push(scanner, &loader->ops[i])) {
+			xt_log("scanner", XT_LOG_ERROR, "failed to push %s to "
+			    "the pipeline", loader->ops[i].name);
+			atomic_inc(&scanner->scan->errors);
+		}
+	}
+	atomic_add(&scanner->scan->loaded, loader->count - failed);
+
+	xt_log("scanner", XT_LOG_WARNING, "bulk load of %d entries failed "
+	    "for %d, pushed them to the pipeline", loader->count, failed);
+
+out:
+	for (i = 0; i < loader->count; i++)
+		XT_FREE(loader->ops[i].name);
+	loader->count = 0;
+}
+
+static void xt_bulk_add(scanner_t *scanner, scan_loader_t *loader,
+    obj_id_t *pid, const char *name, struct stat *stbuf)
+{
+	db_batch_op_t *op = &loader->ops[loader->count];
+	mattr_t *attr = &loader->attrs[loader->count];
+
+	mattr_fill(attr, pid, stbuf);
+	op->type = db_op_insert;
+	op->name = xt_strdup(name);
+	op->attr = attr;
+	loader->count++;
+
+	if (loader->count == SCAN_BULK_BATCH)
+		xt_bulk_flush(scanner, loader);
+}
+
+/*
+ * a loader is free whenever a walker looks for one, there is one per
+ * walker
+ */
+static scan_loader_t *xt_bulk_get(scanner_t *scanner)
+{
+	scan_loader_t *loader = NULL;
+
+	LOCK(&scanner->lock);
+	if (!xlist_empty(&scanner->free_loaders)) {
+		loader = xlist_entry(scanner->free_loaders.next,
+		    scan_loader_t, list);
+		xlist_del_init(&loader->list);
+	}
+	UNLOCK(&scanner->lock);
+
+	return loader;
+}
+
+static void xt_bulk_put(scanner_t *scanner, scan_loader_t *loader)
+{
+	LOCK(&scanner->lock);
+	xlist_add(&loader->list, &scanner->free_loaders);
+	UNLOCK(&scanner->lock);
+}
+
+static int xt_bulk_start(scanner_t *scanner)
+{
+	metahunter_t *info = scanner->info;
+	int walkers = scanner->scan->walkers;
+	scan_loader_t *loader = NULL;
+	int i = 0;
+
+	if (info->db == NULL) {
+		xt_log("scanner", XT_LOG_ERROR, "bulk load without database");
+		return -1;
+	}
+
+	scanner->loaders = XT_CALLOC(walkers, sizeof(scan_loader_t *));
+	if (scanner->loaders == NULL)
+		return -1;
+
+	for (i = 0; i < walkers; i++) {
+		loader = XT_CALLOC(1, sizeof(scan_loader_t));
+		if (loader == NULL)
+			return -1;
+		scanner->loaders[i] = loader;
+		INIT_XLIST_HEAD(&loader->list);
+
+		if (database_connect(info->db, &loader->hdl)) {
+			xt_log("scanner", XT_LOG_ERROR, "bulk load failed to "
+			    "connect to the database");
+			return -1;
+		}
+		xlist_add(&loader->list, &scanner->free_loaders);
+	}
+
+	return 0;
+}
+
+/*
+ * load the partial batches of the walk
+ */
+static void xt_bulk_stop(scanner_t *scanner)
+{
+	scan_loader_t *loader = NULL;
+	int i = 0;
+
+	if (scanner->loaders == NULL)
+		return;
+
+	for (i = 0; i < scanner->scan->walkers; i++) {
+		loader = scanner->loaders[i];
+		if (loader == NULL)
+			continue;
+
+		if (loader->hdl) {
+			xt_bulk_flush(scanner, loader);
+			database_disconnect(scanner->info->db, loader->hdl);
+		}
+		XT_FREE(loader);
+	}
+
+	XT_FREE(scanner->loaders);
+	scanner->loaders = NULL;
+}
+
+/*
+ * path of an entry of the directory, an entry whose path does not fit
+ * is counted as an error and skipped
+ */
+static int xt_scan_path(scanner_t *scanner, scan_dir_t *scan,
+    const char *name, char *path)
+{
+	if (snprintf(path, PATH_MAX, "%s/%s", scan->path, name) >= PATH_MAX) {
+		xt_log("scanner", XT_LOG_ERROR, "path too long: %s/%s",
+		    scan->path, name);
+		atomic_inc(&scanner->scan->errors);
+		return -1;
+	}
 
-	filesystem_lstat(fs, "/", &stbuf);
+	return 0;
+}
 
-	scan = xt_new_scan(fs, "", &stbuf);
-	xlist_add(&scan->list, &scan_list);
+/*
+ * push an entry of the directory to the pipeline, and queue it to the
+ * walkers if it is a directory
+ */
+static void xt_scan_entry(scanner_t *scanner, scan_dir_t *scan,
+    const char *name, struct stat *stbuf)
+{
+	metahunter_t *info = scanner->info;
+	scan_ctrl_t *ctrl = scanner->scan;
+	journal_entry_t *jentry = NULL;
+	char path[PATH_MAX];
 
-#if 0
 	/*
-	 * build root jentry and push to pipeline
+	 * a directory is queued by path, skip it before it is pushed
 	 */
-	jentry = mem_get0(entry_pool);
+	if (S_ISDIR(stbuf->st_mode) && xt_scan_path(scanner, scan, name, path))
+		return;
 
-	jentry->seq = i;
+	if (scan->loader) {
+		xt_bulk_add(scanner, scan->loader, &scan->id, name, stbuf);
+		atomic_inc(&ctrl->entries);
+		goto dir;
+	}
+
+	jentry = mem_get0(info->entry_pool);
+
+	jentry->seq = atomic_add_and_fetch(&scanner->seq, 1) - 1;
+	jentry->name = strdup(name);
+	jentry->attr = mattr_new(info->attr_pool, &scan->id, stbuf);
 	jentry->op = op_setattr;
-	jentry->name = strdup("/");
-	jentry->attr = mattr_new(attr_pool, &scan->id, &stbuf);
 
+	/*
+	 * push to pipeline, before the entries of a directory
+	 */
 	queue_log_entry(info, jentry);
-#endif
+	atomic_inc(&ctrl->entries);
+
+dir:
 	/*
-	 * deep first traverse filesystem tree
+	 * If directory, queue it to the walkers
 	 */
-	while (scan) {
-		dent = filesystem_readdir(fs, scan->dir_desc);
-		if (dent == NULL) {
-			xt_del_scan(fs, scan);
-			goto next;
+	if (S_ISDIR(stbuf->st_mode)) {
+		if (xt_queue_scan(scanner, path, stbuf)) {
+			xt_log("scanner", XT_LOG_ERROR, "failed to queue %s",
+			    path);
+			atomic_inc(&ctrl->errors);
 		}
+	}
+}
 
-		if (!strcmp(dent->d_name, ".") || !strcmp(dent->d_name, "..")) {
-			/*
-			 * skip . and ..
-			 */
+static int xt_skip_dent(const char *name)
+{
+	return !strcmp(name, ".") || !strcmp(name, "..");
+}
+
+/*
+ * readdir and then lstat by path, two round trips per entry
+ */
+static void xt_scan_readdir(scanner_t *scanner, scan_dir_t *scan,
+    void *dirp)
+{
+	filesystem_t *fs = scanner->info->fs;
+	struct dirent *dent = NULL;
+	struct stat stbuf;
+	char path[PATH_MAX];
+
+	while ((dent = filesystem_readdir(fs, dirp)) != NULL) {
+		if (xt_skip_dent(dent->d_name))
 			continue;
-		}
 
-		snprintf(path, PATH_MAX, "%s/%s", scan->path, dent->d_name);
+		if (xt_scan_path(scanner, scan, dent->d_name, path))
+			continue;
 		xt_log("scanner", XT_LOG_TRACE, "scan: %s", path);
-		filesystem_lstat(fs, path, &stbuf);
-		
-		jentry = mem_get0(entry_pool);
-
-		jentry->seq = i++;
-		jentry->name = strdup(dent->d_name);
-		jentry->attr = mattr_new(attr_pool, &scan->id, &stbuf);
-		/*
-		 * If directory, add the directory into scan list head
-		 */
-		jentry->op = op_setattr;
-
-		if (S_ISDIR(stbuf.st_mode)) {
-			/*
-			 * directory
-			 */
-			new = xt_new_scan(fs, path, &stbuf);
-			xlist_add(&new->list, &scan_list);
+		if (filesystem_lstat(fs, path, &stbuf)) {
+			xt_log("scanner", XT_LOG_ERROR, "failed to stat %s",
+			    path);
+			atomic_inc(&scanner->scan->errors);
+			continue;
+		}
+
+		xt_scan_entry(scanner, scan, dent->d_name, &stbuf);
+	}
+}
+
+/*
+ * the entries come with their attributes, SCAN_READDIRPLUS_BATCH at a
+ * time. An error before any entry is read is returned, the caller falls
+ * back to xt_scan_readdir(), an error afterwards stops the directory.
+ * An entry returned without its attributes is stat by path.
+ */
+static int xt_scan_readdirplus(scanner_t *scanner, scan_dir_t *scan,
+    void *dirp)
+{
+	filesystem_t *fs = scanner->info->fs;
+	fs_dirent_plus_t *ents = NULL;
+	char path[PATH_MAX];
+	int read = 0;
+	int ret = 0;
+	int i = 0;
+
+	ents = XT_MALLOC(SCAN_READDIRPLUS_BATCH * sizeof (fs_dirent_plus_t));
+	if (ents == NULL)
+		return -1;
+
+	while ((ret = filesystem_readdirplus(fs, dirp, ents,
+	    SCAN_READDIRPLUS_BATCH)) > 0) {
+		read = 1;
+		for (i = 0; i < ret; i++) {
+			if (xt_skip_dent(ents[i].dent.d_name))
+				continue;
+
+			xt_log("scanner", XT_LOG_TRACE, "scan: %s/%s",
+			    scan->path, ents[i].dent.d_name);
 			/*
-			 * build op_mkdir jentry
+			 * the attributes were not read with the entry, stat
+			 * it by path
 			 */
-
+			if (ents[i].err) {
+				if (xt_scan_path(scanner, scan,
+				    ents[i].dent.d_name, path))
+					continue;
+				if (filesystem_lstat(fs, path, &ents[i].st)) {
+					xt_log("scanner", XT_LOG_ERROR,
+					    "failed to stat %s", path);
+					atomic_inc(&scanner->scan->errors);
+					continue;
+				}
+			}
+			xt_scan_entry(scanner, scan, ents[i].dent.d_name,
+			    &ents[i].st);
 		}
+	}
 
-		/*
-		 * push to pipeline
-		 */
-		queue_log_entry(info, jentry);
+	if (ret < 0 && !read) {
+		xt_log("scanner", XT_LOG_WARNING, "failed to read %s with "
+		    "attributes: %d, fall back to readdir.",
+		    strlen(scan->path) ? scan->path : "/", ret);
+		XT_FREE(ents);
+		return ret;
+	}
 
-	next:		
-		if (xlist_empty(&scan_list))
-			break;
-		scan = xlist_entry(scan_list.next, scan_dir_t, list);
+	if (ret < 0) {
+		xt_log("scanner", XT_LOG_ERROR, "failed to read %s: %d",
+		    strlen(scan->path) ? scan->path : "/", ret);
+		atomic_inc(&scanner->scan->errors);
+	}
+
+	XT_FREE(ents);
+	return 0;
+}
+
+/*
+ * walker, read a directory
+ */
+static int xt_scan_dir(tp_t *tp)
+{
+	scan_dir_t *scan = (scan_dir_t *)tp;
+	scanner_t *scanner = scan->scanner;
+	scan_ctrl_t *ctrl = scanner->scan;
+	void *dirp = NULL;
+
+	atomic_dec(&ctrl->queued_dirs);
+
+	if (xt_open_scan(scanner, scan, &dirp)) {
+		xt_log("scanner", XT_LOG_ERROR, "failed to open %s",
+		    strlen(scan->path) ? scan->path : "/");
+		atomic_inc(&ctrl->errors);
+		goto out;
+	}
+
+	if (scanner->loaders)
+		scan->loader = xt_bulk_get(scanner);
+
+	if (!filesystem_has_readdirplus(scanner->info->fs) ||
+	    xt_scan_readdirplus(scanner, scan, dirp))
+		xt_scan_readdir(scanner, scan, dirp);
+
+	if (scan->loader)
+		xt_bulk_put(scanner, scan->loader);
+
+	xt_close_scan(scanner, dirp);
+	atomic_inc(&ctrl->dirs);
+out:
+	xt_del_scan(scan);
+	return 0;
+}
+
+static void xt_scan_progress(scan_ctrl_t *ctrl, uint64_t start)
+{
+	double secs = (xt_now_ns() - start) / 1e9;
+
+	xt_log("scanner", XT_LOG_INFO, "scan: %llu dirs, %llu entries "
+	    "(%.0f/s), %llu errors, %d open, %ld queued, %llu bulk loaded",
+	    ctrl->dirs, ctrl->entries, secs > 0 ? ctrl->entries / secs : 0,
+	    ctrl->errors, ctrl->open_dirs, ctrl->queued_dirs, ctrl->loaded);
+}
+
+static int xt_traverse_tree(metahunter_t *info)
+{
+	scanner_t scanner;
+	scan_ctrl_t *ctrl = info->scan;
+	struct stat stbuf;
+	struct timespec ts;
+	uint64_t start = xt_now_ns();
+	int ret = -1;
+
+	memset(&scanner, 0, sizeof(scanner));
+	scanner.info = info;
+	scanner.scan = ctrl;
+	LOCK_INIT(&scanner.lock);
+	COND_INIT(&scanner.open_cond);
+	COND_INIT(&scanner.done_cond);
+	INIT_XLIST_HEAD(&scanner.free_loaders);
+
+	if (ctrl->bulk_load && xt_bulk_start(&scanner)) {
+		xt_log("scanner", XT_LOG_ERROR, "failed to start bulk load");
+		goto out;
+	}
+
+	if (filesystem_lstat(info->fs, "/", &stbuf)) {
+		xt_log("scanner", XT_LOG_ERROR, "failed to stat /");
+		goto out;
+	}
+
+	scanner.walkers = tp_ctrl_new("scanner", 1024 * 1024, 10,
+	    ctrl->walkers, ctrl->walkers);
+	if (scanner.walkers == NULL || tp_threads_start(scanner.walkers)) {
+		xt_log("scanner", XT_LOG_ERROR, "failed to start %d walkers",
+		    ctrl->walkers);
+		goto out;
+	}
+
+	xt_log("scanner", XT_LOG_INFO, "scan with %d walkers, %d open dirs%s",
+	    ctrl->walkers, ctrl->max_open_dirs,
+	    ctrl->bulk_load ? ", bulk load" : "");
+
+	if (xt_queue_scan(&scanner, "", &stbuf)) {
+		xt_log("scanner", XT_LOG_ERROR, "failed to queue /");
+		goto out;
+	}
+
+	/*
+	 * log the progress until the walk is done
+	 */
+	LOCK(&scanner.lock);
+	while (scanner.outstanding) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += MH_DEFAULT_SCAN_PROGRESS;
+		if (pthread_cond_timedwait(&scanner.done_cond, &scanner.lock,
+		    &ts) == ETIMEDOUT)
+			xt_scan_progress(ctrl, start);
 	}
+	UNLOCK(&scanner.lock);
+
+	/*
+	 * the walk is done, the walkers left the loaders
+	 */
+	xt_bulk_stop(&scanner);
+	xt_scan_progress(ctrl, start);
+	ret = 0;
+out:
+	if (scanner.walkers) {
+		tp_threads_finish(scanner.walkers);
+		tp_ctrl_free(scanner.walkers);
+	}
+	xt_bulk_stop(&scanner);
+	COND_DESTROY(&scanner.done_cond);
+	COND_DESTROY(&scanner.open_cond);
+	LOCK_DESTROY(&scanner.lock);
+	return ret;
 }
 /*
  * start filesystem scan
@@ -283,8 +813,28 @@ static int xt_start_scanner(metahunter_t *info)
 	info->attr_pool = mem_pool_new(sizeof(mattr_t),
 	    processor->outstanding_ops);
 
-	xt_traverse_tree(info);
-	ret = 0;
+	/*
+	 * default walkers without a Scanner segment
+	 */
+	if (info->scan == NULL) {
+		info->scan = XT_CALLOC(1, sizeof (scan_ctrl_t));
+		if (info->scan == NULL) {
+			ret = -1;
+			goto err;
+		}
+		info->scan->walkers = MH_DEFAULT_SCAN_WALKERS;
+		info->scan->max_open_dirs = MH_DEFAULT_SCAN_MAX_OPEN_DIRS;
+	}
+
+	if (info->metrics && metrics_start(info->metrics, info)) {
+		xt_log("scanner", XT_LOG_WARNING, "Failed to start metrics "
+		    "server.");
+	}
+
+	ret = xt_traverse_tree(info);
+
+	if (info->metrics)
+		metrics_stop(info->metrics);
 err:
 	processor_cleanup(processor);
 
@@ -322,6 +872,9 @@ static void *xt_sigwaiter (void *arg)
                         break;
                 case SIGUSR1:
 			xt_log("hunter", XT_LOG_ERROR, "handle signal USR1");
+			if (xt_parse_log_config(scanner_conf_file))
+				xt_log("scanner", XT_LOG_WARNING, "failed to "
+				    "reload log levels");
                         break;
                 default:
 
@@ -436,6 +989,12 @@ int main(int argc, char **argv)
 
 	xt_log_set_loglevel(log_lvl);
 
+	ret = xt_log_async_start();
+	if (ret)
+		xt_log("scanner", XT_LOG_WARNING, "Failed to start log writer, "
+		    "logging synchronously.");
+
+	scanner_conf_file = conf_file;
 	ret = xt_parse_config(conf_file, info);
 	if (ret) {
 		xt_log("scanner", XT_LOG_ERROR, "Failed to parse configuration"
@@ -0,0 +1,268 @@
+/*
+ * Copyright (c) 2016 XTAO Technology <www.xtaotech.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * decode the trace ring files of the threads, merged in time order,
+ * to text or, with -j, to the Chrome trace event JSON format
+ * (chrome://tracing, Perfetto).
+ *
+ * mh-tracedump [-j] /var/lib/metahunter/trace/mh-trace.*
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/stat.h>
+#include "mem.h"
+#include "trace.h"
+
+typedef struct dump_file {
+	const char *path;
+	mh_trace_hdr_t hdr;
+} dump_file_t;
+
+typedef struct dump_rec {
+	mh_trace_rec_t rec;
+	uint64_t ns;		/* CLOCK_REALTIME */
+	dump_file_t *file;
+} dump_rec_t;
+
+static dump_rec_t *recs;
+static size_t nr_recs;
+static size_t max_recs;
+
+static uint64_t dump_ns(mh_trace_hdr_t *hdr, uint64_t tsc)
+{
+	uint64_t delta = tsc - hdr->tsc_base;
+
+	if (tsc < hdr->tsc_base || hdr->tsc_hz == 0)
+		return hdr->time_base;
+
+	return hdr->time_base + delta / hdr->tsc_hz * 1000000000ULL +
+	    delta % hdr->tsc_hz * 1000000000ULL / hdr->tsc_hz;
+}
+
+/*
+ * append the records held by the ring of @path, the oldest first
+ */
+static int dump_load(dump_file_t *file)
+{
+	mh_trace_rec_t *ring = NULL;
+	dump_rec_t *more = NULL;
+	struct stat st;
+	uint64_t first = 0;
+	uint64_t i = 0;
+	size_t size = 0;
+	int fd = -1;
+	int ret = -1;
+
+	fd = open(file->path, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st)) {
+		fprintf(stderr, "%s: %s\n", file->path, strerror(errno));
+		goto out;
+	}
+
+	if (pread(fd, &file->hdr, sizeof(file->hdr), 0) !=
+	    sizeof(file->hdr) || file->hdr.magic != MH_TRACE_MAGIC ||
+	    file->hdr.version != MH_TRACE_VERSION ||
+	    file->hdr.rec_size != sizeof(mh_trace_rec_t) ||
+	    file->hdr.nr_recs == 0) {
+		fprintf(stderr, "%s: not a trace file\n", file->path);
+		goto out;
+	}
+
+	size = (size_t)file->hdr.nr_recs * sizeof(mh_trace_rec_t);
+	if (st.st_size < MH_TRACE_HDR_SIZE + size) {
+		fprintf(stderr, "%s: truncated\n", file->path);
+		goto out;
+	}
+
+	ring = XT_MALLOC(size);
+	if (ring == NULL || pread(fd, ring, size, MH_TRACE_HDR_SIZE) !=
+	    size) {
+		fprintf(stderr, "%s: read failed\n", file->path);
+		goto out;
+	}
+
+	if (file->hdr.head > file->hdr.nr_recs)
+		first = file->hdr.head - file->hdr.nr_recs;
+
+	for (i = first; i < file->hdr.head; i++) {
+		if (nr_recs == max_recs) {
+			max_recs = max_recs ? max_recs * 2 : 65536;
+			more = XT_REALLOC(recs, max_recs * sizeof(dump_rec_t));
+			if (more == NULL) {
+				fprintf(stderr, "out of memory\n");
+				goto out;
+			}
+			recs = more;
+		}
+
+		recs[nr_recs].rec = ring[i % file->hdr.nr_recs];
+		recs[nr_recs].ns = dump_ns(&file->hdr,
+		    recs[nr_recs].rec.tsc);
+		recs[nr_recs].file = file;
+		nr_recs++;
+	}
+
+	ret = 0;
+out:
+	XT_FREE(ring);
+	if (fd >= 0)
+		close(fd);
+	return ret;
+}
+
+static int dump_cmp(const void *a, const void *b)
+{
+	const dump_rec_t *ra = a;
+	const dump_rec_t *rb = b;
+
+	if (ra->ns != rb->ns)
+		return ra->ns < rb->ns ? -1 : 1;
+	return 0;
+}
+
+static void dump_text(void)
+{
+	dump_rec_t *r = NULL;
+	char timestr[64];
+	struct tm tm;
+	time_t sec = 0;
+	size_t i = 0;
+
+	for (i = 0; i < nr_recs; i++) {
+		r = &recs[i];
+		sec = r->ns / 1000000000;
+		localtime_r(&sec, &tm);
+		strftime(timestr, sizeof(timestr), "%Y-%m-%d %H:%M:%S", &tm);
+
+		printf("[%s.%09" PRIu64 "] %u/%u %-15s %-6s stage %u "
+		    "op 0x%" PRIx64 " ino %" PRIu64 " arg %u\n", timestr,
+		    r->ns % 1000000000, r->file->hdr.pid,
+		    r->file->hdr.tid, r->file->hdr.name,
+		    mh_trace_event_name(r->rec.event), r->rec.stage,
+		    r->rec.op, r->rec.ino, r->rec.arg);
+	}
+}
+
+/*
+ * instant events in us from the first record, a track per thread
+ */
+static void dump_json(dump_file_t *files, int nr_files)
+{
+	dump_rec_t *r = NULL;
+	uint64_t base = nr_recs ? recs[0].ns : 0;
+	const char *sep = "";
+	size_t i = 0;
+	int j = 0;
+
+	printf("{\"traceEvents\":[\n");
+	for (j = 0; j < nr_files; j++) {
+		if (files[j].hdr.magic != MH_TRACE_MAGIC)
+			continue;
+		printf("%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%u,"
+		    "\"tid\":%u,\"args\":{\"name\":\"%s\"}}", sep,
+		    files[j].hdr.pid, files[j].hdr.tid,
+		    files[j].hdr.name[0] ? files[j].hdr.name : "thread");
+		sep = ",\n";
+	}
+
+	for (i = 0; i < nr_recs; i++) {
+		r = &recs[i];
+		printf("%s{\"name\":\"%s\",\"cat\":\"stage%u\",\"ph\":\"i\","
+		    "\"s\":\"t\",\"ts\":%" PRIu64 ".%03" PRIu64 ",\"pid\":%u,"
+		    "\"tid\":%u,\"args\":{\"op\":\"0x%" PRIx64 "\",\"ino\":%"
+		    PRIu64 ",\"stage\":%u,\"arg\":%u}}", sep,
+		    mh_trace_event_name(r->rec.event), r->rec.stage,
+		    (r->ns - base) / 1000, (r->ns - base) % 1000,
+		    r->file->hdr.pid, r->file->hdr.tid, r->rec.op,
+		    r->rec.ino, r->rec.stage, r->rec.arg);
+		sep = ",\n";
+	}
+	printf("\n]}\n");
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-j] trace-file...\n", prog);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	dump_file_t *files = NULL;
+	int nr_files = 0;
+	int json = 0;
+	int opt = 0;
+	int ret = 0;
+	int i = 0;
+
+	while ((opt = getopt(argc, argv, "j")) != -1) {
+		switch (opt) {
+		case 'j':
+			json = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	nr_files = argc - optind;
+	if (nr_files <= 0)
+		usage(argv[0]);
+
+	files = XT_CALLOC(nr_files, sizeof(dump_file_t));
+	if (files == NULL) {
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+
+	for (i = 0; i < nr_files; i++) {
+		files[i].path = argv[optind + i];
+		if (dump_load(&files[i])) {
+			files[i].hdr.magic = 0;
+			ret = 1;
+		}
+	}
+
+	qsort(recs, nr_recs, sizeof(dump_rec_t), dump_cmp);
+
+	if (json)
+		dump_json(files, nr_files);
+	else
+		dump_text();
+
+	XT_FREE(recs);
+	XT_FREE(files);
+	return ret;
+}